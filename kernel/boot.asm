@@ -22,7 +22,18 @@ global _start:function (_start.end - _start)
 _start:
     mov esp, stack_top
     cli
+    lgdt [gdt_ptr]          ; GRUB's GDT may be anywhere, even gone
+    jmp 0x08:.flat
+.flat:
+    mov cx, 0x10
+    mov ds, cx
+    mov es, cx
+    mov fs, cx
+    mov gs, cx
+    mov ss, cx
     
+    push ebx                ; multiboot info
+    push eax                ; multiboot magic
     extern kernel_main
     call kernel_main
     
@@ -31,9 +42,83 @@ _start:
     jmp .hang
 .end:
 
+; GDT plat : 0x08 code, 0x10 données, 0-4 Go
+section .rodata
+align 8
+gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF
+    dq 0x00CF92000000FFFF
+gdt_ptr:
+    dw gdt_ptr - gdt - 1
+    dd gdt
+
+section .text
 ; IDT support (simplifié pour compatibilité)
 global idt_flush
 idt_flush:
     mov eax, [esp+4]
     lidt [eax]
     ret
+
+; IRQ 4, COM1 (see SERIAL in kernel.c)
+global serial_isr
+extern serial_irq
+serial_isr:
+    pushad
+    cld
+    call serial_irq
+    popad
+    iretd
+
+; virtio-blk, on the IRQ its PCI function reports (see VIRTIO-BLK)
+global blk_isr
+extern blk_irq
+blk_isr:
+    pushad
+    cld
+    call blk_irq
+    popad
+    iretd
+
+; Default gates (see init_idt): exceptions stop the kernel, IRQs nobody
+; installed are acknowledged, other vectors return
+extern cpu_fault
+extern irq_default
+%assign i 0
+%rep 32
+fault_%+i:
+    push dword i
+    call cpu_fault
+%assign i i+1
+%endrep
+%assign i 0
+%rep 16
+irq_stub_%+i:
+    pushad
+    cld
+    push dword i
+    call irq_default
+    add esp, 4
+    popad
+    iretd
+%assign i i+1
+%endrep
+
+global isr_ignore
+isr_ignore:
+    iretd
+
+section .rodata
+global isr_stubs
+isr_stubs:
+%assign i 0
+%rep 32
+    dd fault_%+i
+%assign i i+1
+%endrep
+%assign i 0
+%rep 16
+    dd irq_stub_%+i
+%assign i i+1
+%endrep
@@ -0,0 +1,264 @@
+// ==========================================
+// HybridOS - hosted platform layer
+// kernel.c built with -DHOSTED runs as an ordinary Linux process, so perf,
+// valgrind and the sanitizers can look at the filesystem, editor, shell and
+// BASIC. This file stands in for boot.asm and the hardware: COM1 is
+// emulated on stdin/stdout (the serial console carries the shell), the VGA
+// text buffer lives in memory and --screen draws it on the terminal, every
+// other port reads as an empty bus.
+//
+//     make hosted
+//     ./hybridos-hosted [--screen] [--memory MB] [--image rootfs.img] < script
+// ==========================================
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define COM1 0x3F8
+#define MULTIBOOT_MAGIC 0x2BADB002
+
+uint16_t hosted_vga[80 * 25];
+uint8_t hosted_graphics[320 * 200];
+uint8_t* hosted_memory;
+size_t hosted_memory_size = 64 << 20;
+
+void kernel_main(uint32_t magic, void* mbi);
+
+// boot.asm
+void idt_flush(uint32_t idt) { (void)idt; }
+void serial_isr(void) {}
+void blk_isr(void) {}
+void isr_ignore(void) {}
+uint32_t isr_stubs[48];
+
+static int screen;                  // --screen: draw hosted_vga, drop serial output
+static int stdout_tty;
+static uint64_t start_us;
+static struct termios saved_termios;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t hosted_time_us(void) {
+    return now_us() - start_us;
+}
+
+// The kernel hands out pointers as 32-bit values (multiboot, DMA
+// descriptors), so its RAM and the boot image stay below 4 GB
+static void* low_alloc(size_t size) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_32BIT
+    flags |= MAP_32BIT;
+#endif
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// ==================== STDIN ====================
+static unsigned char input[4096];
+static size_t input_len, input_pos;
+static int input_eof;
+static uint64_t input_checked;
+
+// Refills the buffer once the kernel has taken all of it, waiting up to timeout_ms
+static void input_fill(int timeout_ms) {
+    if (input_pos < input_len || input_eof) return;
+    struct pollfd p = { 0, POLLIN, 0 };
+    if (poll(&p, 1, timeout_ms) <= 0) return;
+    ssize_t n = read(0, input, sizeof(input));
+    if (n <= 0) input_eof = 1;
+    else input_len = (size_t)n, input_pos = 0;
+}
+
+static void terminal_restore(void) {
+    tcsetattr(0, TCSANOW, &saved_termios);
+    if (screen) printf("\x1b[0m\x1b[%dH\n", 25);
+    fflush(stdout);
+}
+
+// Keys one at a time and unechoed, the kernel echoes; ^C still quits
+static void terminal_raw(void) {
+    if (!isatty(0) || tcgetattr(0, &saved_termios) < 0) return;
+    struct termios raw = saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSANOW, &raw);
+    atexit(terminal_restore);
+}
+
+// ==================== SCREEN ====================
+static uint16_t shown[80 * 25];
+static uint8_t crtc_index;
+static uint16_t cursor;
+
+// Redraws the rows that changed since the last call
+static void screen_draw(void) {
+    static const char ansi[8] = { 0, 4, 2, 6, 1, 5, 3, 7 };   // VGA and ANSI order colors differently
+    for (int row = 0; row < 25; row++) {
+        const uint16_t* cells = hosted_vga + row * 80;
+        if (!memcmp(cells, shown + row * 80, sizeof(uint16_t) * 80)) continue;
+        memcpy(shown + row * 80, cells, sizeof(uint16_t) * 80);
+        printf("\x1b[%dH", row + 1);
+        int color = -1;
+        for (int col = 0; col < 80; col++) {
+            uint8_t c = cells[col] & 0xFF, attr = cells[col] >> 8;
+            if (attr != color) {
+                color = attr;
+                printf("\x1b[%d;%dm", (attr & 8 ? 90 : 30) + ansi[attr & 7], 40 + ansi[(attr >> 4) & 7]);
+            }
+            putchar(c < 32 ? ' ' : c);   // UTF-8 spans consecutive cells
+        }
+    }
+    printf("\x1b[0m\x1b[%d;%dH", cursor / 80 + 1, cursor % 80 + 1);
+}
+
+// ==================== PORTS ====================
+// COM1 is a 16550 without interrupts: THR goes to stdout, RBR comes from
+// stdin, MCR bit 4 loops THR back to RBR for the kernel's detection probe.
+// Its FIFO is the stdin buffer, nothing overruns: the kernel leaves bytes
+// there while its receive ring is full.
+static uint8_t uart_ier, uart_lcr, uart_mcr;
+static int uart_looped = -1;
+
+uint32_t hosted_in(uint16_t port) {
+    switch (port) {
+    case COM1:
+        if (uart_lcr & 0x80) return 0;
+        if (uart_looped >= 0) {
+            int c = uart_looped;
+            uart_looped = -1;
+            return (uint32_t)c;
+        }
+        return input_pos < input_len ? input[input_pos++] : 0;
+    case COM1 + 1: return uart_ier;
+    case COM1 + 2: return 0xC1;                 // FIFOs on, no interrupt pending
+    case COM1 + 3: return uart_lcr;
+    case COM1 + 4: return uart_mcr;
+    case COM1 + 5: {
+        uint64_t now = now_us();
+        if (now - input_checked >= 1000) {      // a poll() per status read would dominate profiles
+            input_checked = now;
+            input_fill(0);
+        }
+        return 0x60 | (uart_looped >= 0 || input_pos < input_len);
+    }
+    case 0x64: return 0;                        // no PS/2 controller, keys come through COM1
+    case 0x3D5: return 0;
+    default: return 0xFFFFFFFF;                 // nothing decodes it: ATA, PCI and fw_cfg come up absent
+    }
+}
+
+void hosted_out(uint16_t port, uint32_t val) {
+    switch (port) {
+    case COM1:
+        if (uart_lcr & 0x80) break;
+        if (uart_mcr & 0x10) uart_looped = val & 0xFF;
+        else if (!screen && (val != '\r' || stdout_tty)) putchar((int)(val & 0xFF));
+        break;
+    case COM1 + 1: if (!(uart_lcr & 0x80)) uart_ier = (uint8_t)val; break;
+    case COM1 + 3: uart_lcr = (uint8_t)val; break;
+    case COM1 + 4: uart_mcr = (uint8_t)val; break;
+    case 0x3D4: crtc_index = (uint8_t)val; break;
+    case 0x3D5:
+        if (crtc_index == 0x0E) cursor = (uint16_t)((cursor & 0xFF) | (val & 0xFF) << 8);
+        else if (crtc_index == 0x0F) cursor = (uint16_t)((cursor & 0xFF00) | (val & 0xFF));
+        break;
+    case 0x64:
+        if (val == 0xFE) exit(0);               // reboot
+        break;
+    }
+}
+
+// The kernel is waiting: show what it did, then sleep on stdin. The end
+// of stdin ends the process once the kernel has used every key.
+void hosted_idle(int keys_pending) {
+    if (screen) screen_draw();
+    fflush(stdout);
+    if (input_eof && input_pos == input_len && !keys_pending) exit(0);
+    input_fill(10);
+}
+
+// ==================== BOOT ====================
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower, mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count, mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length, mmap_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+// Loads path as the one multiboot module, the way GRUB would
+static int load_image(const char* path, multiboot_info_t* mbi) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    uint32_t* mod = low_alloc(16 + size);
+    if (!mod) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        return -1;
+    }
+    uint8_t* data = (uint8_t*)(mod + 4);
+    for (size_t done = 0; done < size;) {
+        ssize_t n = read(fd, data + done, size - done);
+        if (n <= 0) {
+            perror(path);
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    close(fd);
+    mod[0] = (uint32_t)(uintptr_t)data;         // start, end, string, reserved
+    mod[1] = (uint32_t)(uintptr_t)(data + size);
+    mbi->flags |= 8;
+    mbi->mods_count = 1;
+    mbi->mods_addr = (uint32_t)(uintptr_t)mod;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* image = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--screen")) screen = 1;
+        else if (!strcmp(argv[i], "--memory") && i + 1 < argc) hosted_memory_size = (size_t)atoi(argv[++i]) << 20;
+        else if (!strcmp(argv[i], "--image") && i + 1 < argc) image = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s [--screen] [--memory MB] [--image rootfs.img]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    static multiboot_info_t mbi;
+    if (image && load_image(image, &mbi) < 0) return 1;
+    hosted_memory = low_alloc(hosted_memory_size);
+    if (!hosted_memory || hosted_memory_size < 1 << 20) {
+        fprintf(stderr, "cannot allocate %zu MB of kernel memory\n", hosted_memory_size >> 20);
+        return 1;
+    }
+
+    start_us = now_us();
+    stdout_tty = isatty(1);
+    memset(shown, 0xFF, sizeof(shown));
+    terminal_raw();
+    if (screen) printf("\x1b[2J");
+    kernel_main(MULTIBOOT_MAGIC, &mbi);
+    return 0;
+}
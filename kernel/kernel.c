@@ -7,6 +7,7 @@
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
 typedef unsigned int uint32_t;
+typedef unsigned long long uint64_t;
 typedef unsigned long size_t;
 typedef int bool;
 #define NULL ((void*)0)
@@ -17,8 +18,35 @@ typedef int bool;
 // VGA et Graphics
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
+#ifdef HOSTED
+// make hosted: the kernel as a Linux process, kernel/hosted.c supplies
+// the memory and the devices
+extern uint16_t hosted_vga[];
+extern uint8_t hosted_graphics[];
+extern uint8_t* hosted_memory;
+extern size_t hosted_memory_size;
+uint32_t hosted_in(uint16_t port);
+void hosted_out(uint16_t port, uint32_t val);
+uint64_t hosted_time_us(void);
+void hosted_idle(int keys_pending);
+#define VGA_MEMORY hosted_vga
+#define GRAPHICS_MEMORY hosted_graphics
+// The string functions below would replace the C library's
+#define strlen kstrlen
+#define strcmp kstrcmp
+#define strncmp kstrncmp
+#define strcpy kstrcpy
+#define strcat kstrcat
+#define strchr kstrchr
+#define strrchr kstrrchr
+#define memcpy kmemcpy
+#define memset kmemset
+#define memmove kmemmove
+#define memcmp kmemcmp
+#else
 #define VGA_MEMORY ((uint16_t*)0xB8000)
 #define GRAPHICS_MEMORY ((uint8_t*)0xA0000)
+#endif
 
 // Terminal state
 static size_t term_row = 0, term_col = 0;
@@ -31,38 +59,83 @@ static uint32_t tick_count = 0;
 
 // FILE SYSTEM
 #define MAX_FILENAME 32
-#define MAX_FILES 256
-#define MAX_FILE_SIZE 8192
 #define MAX_PATH 256
 
 typedef enum { FS_FILE = 1, FS_DIRECTORY = 2 } fs_node_type;
+
+// Directory entries live outside the inode, as parallel arrays so a
+// lookup scans packed name hashes before touching any child inode.
+typedef struct fs_dir {
+    uint32_t count, capacity;
+    uint32_t* hashes;
+    struct fs_node** nodes;
+} fs_dir_t;
+
+// File content: runs of consecutive blocks in the block store. cp shares
+// the whole list between files (refs); the first write gives the writer
+// its own copy, and shared blocks are copied one by one as they change.
+typedef struct { uint32_t start, count; } fs_extent_t;
+typedef struct fs_extents {
+    uint32_t count, capacity;
+    uint32_t refs;
+    fs_extent_t runs[];
+} fs_extents_t;
+
+// Inode: one cache line. Files up to FS_INLINE_MAX bytes keep their data
+// in the inode itself (FS_NODE_INLINE) and move to blocks when they grow.
+// Cold files are LZ4-compressed in their blocks (FS_NODE_COMPRESSED); size
+// stays the logical size. Files mounted from disk are read on first use
+// (FS_NODE_ONDISK, no data yet).
+#define FS_INODE_SIZE 64
+#define FS_INLINE_MAX ((FS_INODE_SIZE - 2 * sizeof(void*) - 3 * sizeof(uint32_t)) & ~(sizeof(void*) - 1))
+#define FS_NODE_INLINE 0x0001
+#define FS_NODE_COMPRESSED 0x0002
+#define FS_NODE_REFERENCED 0x0004    // read or written since the last sweep
+#define FS_NODE_INCOMPRESSIBLE 0x0008
+#define FS_NODE_UNINDEXED 0x0010     // queued for the trigram index
+#define FS_NODE_ONDISK 0x0020        // content still only on disk
+#define FS_NODE_DIRTY 0x0040         // changed since the last disk checkpoint
+
 typedef struct fs_node {
-    char name[MAX_FILENAME];
-    fs_node_type type;
-    size_t size;
-    char* content;
+    const char* name;           // interned, see fs_intern()
     struct fs_node* parent;
-    struct fs_node* children[64];
-    int child_count;
+    union {
+        fs_extents_t* extents;  // FS_FILE in blocks, NULL while empty
+        fs_dir_t* entries;      // FS_DIRECTORY, NULL while empty
+        char data[FS_INLINE_MAX];  // FS_FILE with FS_NODE_INLINE
+    };
+    uint32_t size;
     uint32_t created_time;
+    uint8_t type;
     uint8_t permissions;
-} fs_node_t;
+    uint16_t flags;
+} __attribute__((aligned(FS_INODE_SIZE))) fs_node_t;
 
 fs_node_t* fs_root;
 fs_node_t* current_dir;
-fs_node_t fs_nodes[MAX_FILES];
+static fs_node_t* fs_free_nodes = NULL;  // recycled inodes, chained through parent
+static fs_node_t** fs_slabs = NULL;      // every inode page, for the background sweep
+static uint32_t fs_slab_count = 0;
 int fs_node_count = 0;
-char file_data_pool[MAX_FILES * MAX_FILE_SIZE];
-int file_data_used = 0;
+static bool fs_changed = false;          // anything to write at the next disk checkpoint
 char current_path[256] = "/";
 
 // EDITOR
 typedef struct {
-    char* content;
-    size_t size;
+    char* text;                 // gap buffer, see EDITOR
     size_t capacity;
-    size_t cursor_x, cursor_y;  // CORRIGÉ: size_t au lieu de int
-    int scroll_y;
+    size_t gap_start, gap_end;
+    size_t* lines;              // line start index, see EDITOR
+    uint8_t* line_state;        // lexer state at each line start, same layout
+    size_t line_capacity;
+    size_t line_gap_start, line_gap_end;
+    size_t cursor_x;            // offset in the text
+    size_t line, column;        // the cursor's line, and column kept across lines
+    size_t top, left;           // first line and first column shown
+    bool syntax;                // C highlighting
+    size_t lex_valid;           // lines whose cached state is right
+    size_t lex_resume, lex_end; // states in [lex_resume, lex_end) right once met again
+    uint32_t dirty;             // text rows to redraw, EDITOR_HEADER for all
     bool modified;
     char filename[MAX_FILENAME];
 } editor_t;
@@ -109,6 +182,26 @@ idt_entry_t idt_entries[256];
 idt_ptr_t idt_ptr;
 
 // ==================== I/O FUNCTIONS ====================
+#ifdef HOSTED
+static inline void outb(uint16_t port, uint8_t val) { hosted_out(port, val); }
+static inline uint8_t inb(uint16_t port) { return hosted_in(port); }
+static inline void outw(uint16_t port, uint16_t val) { hosted_out(port, val); }
+static inline uint16_t inw(uint16_t port) { return hosted_in(port); }
+static inline void outl(uint16_t port, uint32_t val) { hosted_out(port, val); }
+static inline uint32_t inl(uint16_t port) { return hosted_in(port); }
+
+static inline void insw(uint16_t port, void* buf, uint32_t count) {
+    for (uint16_t* p = buf; count--; ) *p++ = hosted_in(port);
+}
+
+static inline void outsw(uint16_t port, const void* buf, uint32_t count) {
+    for (const uint16_t* p = buf; count--; ) hosted_out(port, *p++);
+}
+
+// No interrupts in a process
+static inline uint32_t irq_save() { return 0; }
+static inline void irq_restore(uint32_t flags) { (void)flags; }
+#else
 static inline void outb(uint16_t port, uint8_t val) {
     __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
 }
@@ -119,6 +212,50 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
+static inline void outw(uint16_t port, uint16_t val) {
+    __asm__ volatile ("outw %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint16_t inw(uint16_t port) {
+    uint16_t ret;
+    __asm__ volatile ("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outl(uint16_t port, uint32_t val) {
+    __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void insw(uint16_t port, void* buf, uint32_t count) {
+    __asm__ volatile ("rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* buf, uint32_t count) {
+    __asm__ volatile ("rep outsw" : "+S"(buf), "+c"(count) : "d"(port));
+}
+
+// Interrupts off, returning the previous EFLAGS for irq_restore()
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ volatile ("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200) __asm__ volatile ("sti" : : : "memory");
+}
+#endif
+
+static inline uint32_t bswap32(uint32_t x) {
+    return (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);
+}
+
 // ==================== STRING FUNCTIONS ====================
 size_t strlen(const char* str) { 
     size_t len = 0; 
@@ -150,6 +287,12 @@ char* strchr(const char* str, char c) {
     return NULL; 
 }
 
+char* strrchr(const char* str, char c) {
+    const char* last = NULL;
+    for (; *str; str++) if (*str == c) last = str;
+    return (char*)last;
+}
+
 void memcpy(void* dest, const void* src, size_t n) { 
     uint8_t* d = dest; 
     const uint8_t* s = src; 
@@ -161,6 +304,20 @@ void memset(void* ptr, int value, size_t n) {
     while (n--) *p++ = value; 
 }
 
+void memmove(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+    if (d < s) while (n--) *d++ = *s++;
+    else { d += n; s += n; while (n--) *--d = *--s; }
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    const uint8_t* p = a;
+    const uint8_t* q = b;
+    for (; n; n--, p++, q++) if (*p != *q) return *p - *q;
+    return 0;
+}
+
 // CORRIGÉ: strncmp avec retour correct et SIZE_MAX défini
 int strncmp(const char* s1, const char* s2, size_t n) {
     if (n == 0) return 0;
@@ -178,6 +335,712 @@ bool starts_with(const char* str, const char* prefix) {
     return true;
 }
 
+// ==================== SEARCH ====================
+// Word-at-a-time byte scans (SWAR): the kernel runs without SSE, so a
+// machine word is the widest vector available.
+#define SWAR_ONES ((size_t)-1 / 255)
+#define SWAR_HIGHS (SWAR_ONES * 0x80)
+
+typedef size_t __attribute__((may_alias)) swar_word_t;
+
+// High bit set in exactly the zero bytes of v
+static inline size_t swar_zero_bytes(size_t v) {
+    size_t low7 = ~SWAR_HIGHS;
+    return ~(((v & low7) + low7) | v | low7);
+}
+
+const uint8_t* mem_find_byte(const uint8_t* p, const uint8_t* end, uint8_t c) {
+    size_t pattern = SWAR_ONES * c;
+    for (; p < end && ((size_t)p & (sizeof(size_t) - 1)); p++) if (*p == c) return p;
+    for (; p + sizeof(size_t) <= end; p += sizeof(size_t)) {
+        size_t zero = swar_zero_bytes(*(const swar_word_t*)p ^ pattern);
+        if (zero) return p + (__builtin_ctzl(zero) >> 3);
+    }
+    for (; p < end; p++) if (*p == c) return p;
+    return NULL;
+}
+
+uint32_t mem_count_byte(const uint8_t* p, const uint8_t* end, uint8_t c) {
+    size_t pattern = SWAR_ONES * c;
+    uint32_t count = 0;
+    for (; p < end && ((size_t)p & (sizeof(size_t) - 1)); p++) count += *p == c;
+    for (; p + sizeof(size_t) <= end; p += sizeof(size_t)) {
+        size_t zero = swar_zero_bytes(*(const swar_word_t*)p ^ pattern);
+        count += ((zero >> 7) * SWAR_ONES) >> ((sizeof(size_t) - 1) * 8);
+    }
+    for (; p < end; p++) count += *p == c;
+    return count;
+}
+
+// Literal substring search: Horspool's bad-character skip, or a first-byte
+// word scan for needles too short to skip much
+#define SEARCH_MAX 255
+
+typedef struct {
+    const uint8_t* needle;
+    uint32_t len;
+    uint8_t skip[256];
+} search_t;
+
+void search_init(search_t* s, const char* needle) {
+    size_t len = strlen(needle);
+    s->needle = (const uint8_t*)needle;
+    s->len = len < SEARCH_MAX ? len : SEARCH_MAX;
+    memset(s->skip, s->len, sizeof(s->skip));
+    for (uint32_t i = 0; i + 1 < s->len; i++) s->skip[s->needle[i]] = s->len - 1 - i;
+}
+
+// First occurrence in [p, end), or NULL
+const uint8_t* search_find(const search_t* s, const uint8_t* p, const uint8_t* end) {
+    uint32_t len = s->len;
+    if (len == 0) return p;
+    if (p + len > end) return NULL;
+    if (len < 4) {
+        const uint8_t* last = end - len + 1;
+        for (; (p = mem_find_byte(p, last, s->needle[0])); p++)
+            if (memcmp(p + 1, s->needle + 1, len - 1) == 0) return p;
+        return NULL;
+    }
+    uint8_t tail = s->needle[len - 1];
+    for (const uint8_t* last = end - len; p <= last; p += s->skip[p[len - 1]])
+        if (p[len - 1] == tail && memcmp(p, s->needle, len - 1) == 0) return p;
+    return NULL;
+}
+
+// Length of the glob element at pat if it matches c, else 0
+static int glob_element(const char* pat, char c) {
+    if (*pat == '?') return 1;
+    if (*pat == '[') {
+        const char* p = pat + 1;
+        bool negate = *p == '!' || *p == '^', hit = false;
+        if (negate) p++;
+        if (!*p) return c == '[';   // a trailing [ or [! is a plain '['
+        do {    // a leading ']' is literal
+            if (p[1] == '-' && p[2] && p[2] != ']') { hit |= c >= p[0] && c <= p[2]; p += 3; }
+            else hit |= c == *p++;
+        } while (*p && *p != ']');
+        if (!*p) return c == '[';   // unterminated: a plain '['
+        return hit != negate ? p + 1 - pat : 0;
+    }
+    return *pat && *pat == c;
+}
+
+// Shell glob: * any run, ? any character, [abc] [a-z] [!x] classes
+bool glob_match(const char* pat, const char* str) {
+    const char *star = NULL, *resume = NULL;
+    while (*str) {
+        int len;
+        if (*pat == '*') { star = ++pat; resume = str; }
+        else if ((len = glob_element(pat, *str))) { pat += len; str++; }
+        else if (star) { pat = star; str = ++resume; }
+        else return false;
+    }
+    while (*pat == '*') pat++;
+    return !*pat;
+}
+
+// ==================== MEMORY ====================
+// Page allocator over the RAM above the kernel image (one bitmap bit per
+// page) and a small kmalloc() with power-of-two size classes on top of it.
+#define PAGE_SIZE 4096
+#define KHEAP_CLASSES 7          // 16, 32, ... 1024 bytes
+#define KHEAP_MAX_SMALL 1024
+#define KHEAP_MAGIC 0x4B48
+
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower, mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count, mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length, mmap_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+typedef struct {
+    uint16_t magic;
+    uint16_t size_class;     // block size, 0 for a multi-page allocation
+    uint32_t pages;
+    uint32_t reserved[2];    // keeps blocks 16-byte aligned
+} kheap_page_t;
+
+static uint8_t* kmem_base = NULL;
+static uint8_t* kmem_bitmap = NULL;
+static size_t kmem_pages = 0, kmem_used_pages = 0, kmem_hint = 0;
+static void* kheap_free_lists[KHEAP_CLASSES];
+
+void kmem_init(void* start, void* end) {
+    size_t base = ((size_t)start + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    size_t pages = ((size_t)end - base) / PAGE_SIZE;
+    size_t bitmap_pages = ((pages + 7) / 8 + PAGE_SIZE - 1) / PAGE_SIZE;
+    kmem_bitmap = (uint8_t*)base;
+    kmem_base = (uint8_t*)(base + bitmap_pages * PAGE_SIZE);
+    kmem_pages = pages - bitmap_pages;
+    kmem_used_pages = 0; kmem_hint = 0;
+    memset(kmem_bitmap, 0, (kmem_pages + 7) / 8);
+    memset(kheap_free_lists, 0, sizeof(kheap_free_lists));
+}
+
+static bool kpage_used(size_t page) { return kmem_bitmap[page >> 3] & (1 << (page & 7)); }
+
+static void kpage_mark(size_t first, size_t count, bool used) {
+    for (size_t i = first; i < first + count; i++) {
+        if (used) kmem_bitmap[i >> 3] |= 1 << (i & 7);
+        else kmem_bitmap[i >> 3] &= ~(1 << (i & 7));
+    }
+}
+
+// First fit for count contiguous pages, starting from the last allocation
+void* kpage_alloc(size_t count) {
+    if (!count || count > kmem_pages - kmem_used_pages) return NULL;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t run = 0;
+        for (size_t i = pass ? 0 : kmem_hint; i < kmem_pages; i++) {
+            if (!(i & 7) && kmem_bitmap[i >> 3] == 0xFF && run == 0) { i += 7; continue; }
+            run = kpage_used(i) ? 0 : run + 1;
+            if (run == count) {
+                size_t first = i + 1 - count;
+                kpage_mark(first, count, true);
+                kmem_used_pages += count;
+                kmem_hint = i + 1;
+                return kmem_base + first * PAGE_SIZE;
+            }
+        }
+    }
+    return NULL;
+}
+
+void kpage_free(void* ptr, size_t count) {
+    size_t first = ((uint8_t*)ptr - kmem_base) / PAGE_SIZE;
+    kpage_mark(first, count, false);
+    kmem_used_pages -= count;
+    if (first < kmem_hint) kmem_hint = first;
+}
+
+static int kheap_class(size_t size) {
+    int cls = 0;
+    size_t block = 16;
+    while (block < size) { block <<= 1; cls++; }
+    return cls;
+}
+
+void* kmalloc(size_t size) {
+    if (size == 0) size = 1;
+    if (size > KHEAP_MAX_SMALL) {
+        size_t pages = (size + sizeof(kheap_page_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+        kheap_page_t* hdr = kpage_alloc(pages);
+        if (!hdr) return NULL;
+        hdr->magic = KHEAP_MAGIC; hdr->size_class = 0; hdr->pages = pages;
+        return hdr + 1;
+    }
+    int cls = kheap_class(size);
+    if (!kheap_free_lists[cls]) {
+        // Carve a fresh page into blocks of this class
+        kheap_page_t* hdr = kpage_alloc(1);
+        if (!hdr) return NULL;
+        size_t block = (size_t)16 << cls;
+        hdr->magic = KHEAP_MAGIC; hdr->size_class = block; hdr->pages = 1;
+        for (uint8_t* b = (uint8_t*)(hdr + 1); b + block <= (uint8_t*)hdr + PAGE_SIZE; b += block) {
+            *(void**)b = kheap_free_lists[cls];
+            kheap_free_lists[cls] = b;
+        }
+    }
+    void* ptr = kheap_free_lists[cls];
+    kheap_free_lists[cls] = *(void**)ptr;
+    return ptr;
+}
+
+static kheap_page_t* kheap_header(void* ptr) {
+    return (kheap_page_t*)((size_t)ptr & ~(size_t)(PAGE_SIZE - 1));
+}
+
+size_t kmalloc_size(void* ptr) {
+    kheap_page_t* hdr = kheap_header(ptr);
+    if (hdr->size_class) return hdr->size_class;
+    return hdr->pages * PAGE_SIZE - sizeof(kheap_page_t);
+}
+
+void kfree(void* ptr) {
+    if (!ptr) return;
+    kheap_page_t* hdr = kheap_header(ptr);
+    if (hdr->magic != KHEAP_MAGIC) return;
+    if (!hdr->size_class) { kpage_free(hdr, hdr->pages); return; }
+    int cls = kheap_class(hdr->size_class);
+    *(void**)ptr = kheap_free_lists[cls];
+    kheap_free_lists[cls] = ptr;
+}
+
+void* krealloc(void* ptr, size_t size) {
+    if (!ptr) return kmalloc(size);
+    size_t old = kmalloc_size(ptr);
+    if (size <= old) return ptr;
+    void* fresh = kmalloc(size);
+    if (!fresh) return NULL;
+    memcpy(fresh, ptr, old);
+    kfree(ptr);
+    return fresh;
+}
+
+// ==================== REGEX ====================
+// Extended regular expressions: literals, ., [a-z] [^x] classes, \d \w \s,
+// ^ $, (), |, * + ? {m,n}. The pattern is parsed into a tree, compiled
+// to a Thompson NFA program, and matched through a DFA built lazily one
+// transition at a time: a cached transition is one table lookup per byte,
+// there is no backtracking, and the DFA cache is bounded (it is flushed
+// when full). A line that can no longer match is skipped with a word
+// scan to its end. Matching is line-oriented: '\n' ends a line, $ matches
+// before it and ^ after it.
+#define RE_MAX_AST 256
+#define RE_MAX_CLASSES 32
+#define RE_MAX_PROG 512
+#define RE_MAX_DFA 128
+#define RE_MAX_REPEAT 100
+#define RE_INFINITE 0xFFFF
+#define RE_NONE 0xFFFF
+#define RE_DFA_UNKNOWN 0xFF
+
+typedef struct { uint32_t bits[8]; } re_class_t;
+
+enum { RE_AST_EMPTY, RE_AST_CHAR, RE_AST_CLASS, RE_AST_BOL, RE_AST_EOL, RE_AST_CAT, RE_AST_ALT, RE_AST_REPEAT };
+typedef struct { uint8_t type; uint16_t a, b, min, max; } re_ast_t;
+
+typedef struct {
+    const char* p;
+    const char* error;
+    re_ast_t ast[RE_MAX_AST];
+    uint16_t ast_count, class_count;
+    re_class_t classes[RE_MAX_CLASSES];
+} re_parser_t;
+
+enum { RE_BYTE, RE_CLASS, RE_SPLIT, RE_JMP, RE_BOL, RE_EOL, RE_MATCH };
+typedef struct { uint8_t op; uint16_t x, y; } re_inst_t;
+
+typedef struct {
+    uint32_t hash;
+    uint16_t count;
+    bool bol;                    // line start: a pending $ may be followed by ^
+    bool match, match_eol;
+    uint8_t next[256];           // RE_DFA_UNKNOWN until computed
+    uint16_t insts[];            // sorted NFA positions
+} re_dfa_t;
+
+typedef struct regex {
+    re_inst_t prog[RE_MAX_PROG];
+    uint16_t prog_len, class_count;
+    re_class_t* classes;
+    re_dfa_t* dfa[RE_MAX_DFA];
+    uint32_t dfa_count, flushes;
+    uint8_t table[2 * RE_MAX_DFA];   // set hash -> DFA state
+    uint8_t start;                   // DFA state at the start of a line
+    uint32_t gen;                    // closure marks
+    uint32_t mark[RE_MAX_PROG];
+    uint16_t stack[2 * RE_MAX_PROG + 1], list[RE_MAX_PROG], start_list[RE_MAX_PROG], scratch[RE_MAX_PROG];
+} regex_t;
+
+static inline void re_class_add(re_class_t* c, uint8_t ch) { c->bits[ch >> 5] |= 1u << (ch & 31); }
+static inline bool re_class_has(const re_class_t* c, uint8_t ch) { return c->bits[ch >> 5] & (1u << (ch & 31)); }
+
+static void re_class_range(re_class_t* c, uint8_t lo, uint8_t hi) {
+    for (uint32_t ch = lo; ch <= hi; ch++) re_class_add(c, ch);
+}
+
+static uint16_t re_node(re_parser_t* P, uint8_t type, uint16_t a, uint16_t b) {
+    if (P->ast_count == RE_MAX_AST) { P->error = "pattern too long"; return 0; }
+    re_ast_t* n = &P->ast[P->ast_count];
+    n->type = type; n->a = a; n->b = b; n->min = n->max = 0;
+    return P->ast_count++;
+}
+
+static re_class_t* re_new_class(re_parser_t* P, uint16_t* node) {
+    if (P->class_count == RE_MAX_CLASSES) { P->error = "too many classes"; return NULL; }
+    re_class_t* c = &P->classes[P->class_count];
+    memset(c, 0, sizeof(*c));
+    *node = re_node(P, RE_AST_CLASS, P->class_count++, 0);
+    return c;
+}
+
+// \d \w \s and their negations; false for any other escape
+static bool re_escape_class(re_class_t* c, char e) {
+    re_class_t set;
+    memset(&set, 0, sizeof(set));
+    char lower = e | 0x20;
+    if (lower == 'd') re_class_range(&set, '0', '9');
+    else if (lower == 'w') { re_class_range(&set, 'a', 'z'); re_class_range(&set, 'A', 'Z'); re_class_range(&set, '0', '9'); re_class_add(&set, '_'); }
+    else if (lower == 's') { re_class_add(&set, ' '); re_class_range(&set, '\t', '\r'); }
+    else return false;
+    for (int i = 0; i < 8; i++) c->bits[i] |= e == lower ? set.bits[i] : ~set.bits[i];
+    return true;
+}
+
+static uint8_t re_escape_char(char e) { return e == 'n' ? '\n' : e == 't' ? '\t' : (uint8_t)e; }
+
+static void re_parse_class(re_parser_t* P, re_class_t* c) {
+    bool negate = *P->p == '^';
+    if (negate) P->p++;
+    const char* first = P->p;
+    while (*P->p && (*P->p != ']' || P->p == first)) {
+        uint8_t lo = *P->p++;
+        if (lo == '\\' && *P->p) {
+            if (re_escape_class(c, *P->p)) { P->p++; continue; }
+            lo = re_escape_char(*P->p++);
+        }
+        if (P->p[0] == '-' && P->p[1] && P->p[1] != ']') {
+            uint8_t hi = P->p[1] == '\\' && P->p[2] ? re_escape_char(P->p[2]) : (uint8_t)P->p[1];
+            P->p += P->p[1] == '\\' && P->p[2] ? 3 : 2;
+            if (hi < lo) { P->error = "bad class range"; return; }
+            re_class_range(c, lo, hi);
+        } else {
+            re_class_add(c, lo);
+        }
+    }
+    if (*P->p != ']') { P->error = "missing ]"; return; }
+    P->p++;
+    if (negate) {
+        for (int i = 0; i < 8; i++) c->bits[i] = ~c->bits[i];
+        c->bits['\n' >> 5] &= ~(1u << ('\n' & 31));
+    }
+}
+
+static uint16_t re_parse_alt(re_parser_t* P);
+
+static uint16_t re_parse_atom(re_parser_t* P) {
+    char ch = *P->p++;
+    uint16_t node;
+    re_class_t* c;
+    switch (ch) {
+    case '(':
+        node = re_parse_alt(P);
+        if (*P->p != ')') { if (!P->error) P->error = "missing )"; return node; }
+        P->p++;
+        return node;
+    case '[':
+        if ((c = re_new_class(P, &node))) re_parse_class(P, c);
+        return node;
+    case '.':
+        if ((c = re_new_class(P, &node))) { re_class_range(c, 0, 255); c->bits['\n' >> 5] &= ~(1u << ('\n' & 31)); }
+        return node;
+    case '^': return re_node(P, RE_AST_BOL, 0, 0);
+    case '$': return re_node(P, RE_AST_EOL, 0, 0);
+    case '*': case '+': case '?': case '{':
+        P->error = "nothing to repeat";
+        return 0;
+    case '\\':
+        if (!*P->p) { P->error = "trailing backslash"; return 0; }
+        if (P->p[0] == 'd' || P->p[0] == 'D' || P->p[0] == 'w' || P->p[0] == 'W' || P->p[0] == 's' || P->p[0] == 'S') {
+            if ((c = re_new_class(P, &node))) re_escape_class(c, *P->p);
+            P->p++;
+            return node;
+        }
+        ch = re_escape_char(*P->p++);
+        /* fall through */
+    default:
+        return re_node(P, RE_AST_CHAR, (uint8_t)ch, 0);
+    }
+}
+
+static uint32_t re_parse_number(re_parser_t* P) {
+    uint32_t n = 0;
+    if (*P->p < '0' || *P->p > '9') { P->error = "bad repetition"; return 0; }
+    while (*P->p >= '0' && *P->p <= '9' && n <= RE_MAX_REPEAT) n = n * 10 + (*P->p++ - '0');
+    if (n > RE_MAX_REPEAT) P->error = "repetition too large";
+    return n;
+}
+
+static uint16_t re_parse_repeat(re_parser_t* P) {
+    uint16_t node = re_parse_atom(P);
+    while (!P->error && (*P->p == '*' || *P->p == '+' || *P->p == '?' || *P->p == '{')) {
+        uint32_t min = 0, max = RE_INFINITE;
+        char op = *P->p++;
+        if (op == '+') min = 1;
+        else if (op == '?') max = 1;
+        else if (op == '{') {
+            min = max = re_parse_number(P);
+            if (*P->p == ',') { P->p++; max = *P->p == '}' ? RE_INFINITE : re_parse_number(P); }
+            if (!P->error && (*P->p != '}' || max < min)) P->error = "bad repetition";
+            if (!P->error) P->p++;
+        }
+        node = re_node(P, RE_AST_REPEAT, node, 0);
+        P->ast[node].min = min;
+        P->ast[node].max = max;
+    }
+    return node;
+}
+
+static uint16_t re_parse_cat(re_parser_t* P) {
+    uint16_t left = re_node(P, RE_AST_EMPTY, 0, 0);
+    while (*P->p && *P->p != '|' && *P->p != ')' && !P->error) {
+        uint16_t right = re_parse_repeat(P);
+        left = P->ast[left].type == RE_AST_EMPTY ? right : re_node(P, RE_AST_CAT, left, right);
+    }
+    return left;
+}
+
+static uint16_t re_parse_alt(re_parser_t* P) {
+    uint16_t left = re_parse_cat(P);
+    while (*P->p == '|' && !P->error) {
+        P->p++;
+        left = re_node(P, RE_AST_ALT, left, re_parse_cat(P));
+    }
+    return left;
+}
+
+static uint16_t re_emit(regex_t* re, uint8_t op, uint16_t x, uint16_t y) {
+    if (re->prog_len == RE_MAX_PROG) return RE_NONE;
+    re->prog[re->prog_len].op = op;
+    re->prog[re->prog_len].x = x;
+    re->prog[re->prog_len].y = y;
+    return re->prog_len++;
+}
+
+static bool re_compile_node(regex_t* re, re_parser_t* P, uint16_t node) {
+    re_ast_t* n = &P->ast[node];
+    uint16_t split, jmp;
+    switch (n->type) {
+    case RE_AST_EMPTY: return true;
+    case RE_AST_CHAR: return re_emit(re, RE_BYTE, n->a, 0) != RE_NONE;
+    case RE_AST_CLASS: return re_emit(re, RE_CLASS, n->a, 0) != RE_NONE;
+    case RE_AST_BOL: return re_emit(re, RE_BOL, 0, 0) != RE_NONE;
+    case RE_AST_EOL: return re_emit(re, RE_EOL, 0, 0) != RE_NONE;
+    case RE_AST_CAT: return re_compile_node(re, P, n->a) && re_compile_node(re, P, n->b);
+    case RE_AST_ALT:
+        // split L1, L2; L1: a; jmp L3; L2: b; L3:
+        if ((split = re_emit(re, RE_SPLIT, 0, 0)) == RE_NONE) return false;
+        re->prog[split].x = re->prog_len;
+        if (!re_compile_node(re, P, n->a) || (jmp = re_emit(re, RE_JMP, 0, 0)) == RE_NONE) return false;
+        re->prog[split].y = re->prog_len;
+        if (!re_compile_node(re, P, n->b)) return false;
+        re->prog[jmp].x = re->prog_len;
+        return true;
+    default: {  // RE_AST_REPEAT: min copies, then a loop or (max - min) optional copies
+        for (uint32_t i = 0; i < n->min; i++) if (!re_compile_node(re, P, n->a)) return false;
+        if (n->max == RE_INFINITE) {
+            if ((split = re_emit(re, RE_SPLIT, 0, 0)) == RE_NONE) return false;
+            re->prog[split].x = re->prog_len;
+            if (!re_compile_node(re, P, n->a) || re_emit(re, RE_JMP, split, 0) == RE_NONE) return false;
+            re->prog[split].y = re->prog_len;
+            return true;
+        }
+        // Optional copies: each split's exit is chained through y, patched at the end
+        uint16_t chain = RE_NONE;
+        for (uint32_t i = n->min; i < n->max; i++) {
+            if ((split = re_emit(re, RE_SPLIT, re->prog_len + 1, chain)) == RE_NONE) return false;
+            chain = split;
+            if (!re_compile_node(re, P, n->a)) return false;
+        }
+        while (chain != RE_NONE) {
+            uint16_t prev = re->prog[chain].y;
+            re->prog[chain].y = re->prog_len;
+            chain = prev;
+        }
+        return true;
+    }
+    }
+}
+
+// Adds the NFA positions reachable from pc without consuming a byte
+static void re_closure(regex_t* re, uint16_t pc, bool bol, bool eol, uint16_t* list, uint32_t* count) {
+    uint32_t sp = 0;
+    re->stack[sp++] = pc;
+    while (sp) {
+        pc = re->stack[--sp];
+        if (re->mark[pc] == re->gen) continue;
+        re->mark[pc] = re->gen;
+        re_inst_t* in = &re->prog[pc];
+        if (in->op == RE_JMP) re->stack[sp++] = in->x;
+        else if (in->op == RE_SPLIT) { re->stack[sp++] = in->y; re->stack[sp++] = in->x; }
+        else if (in->op == RE_BOL) { if (bol) re->stack[sp++] = pc + 1; }
+        else if (in->op == RE_EOL && eol) re->stack[sp++] = pc + 1;
+        else list[(*count)++] = pc;   // a byte, a class, a pending $ or the match
+    }
+}
+
+static void re_flush(regex_t* re) {
+    for (uint32_t i = 0; i < re->dfa_count; i++) kfree(re->dfa[i]);
+    re->dfa_count = 0;
+    memset(re->table, RE_DFA_UNKNOWN, sizeof(re->table));
+    re->flushes++;
+}
+
+// Finds or adds the DFA state for a set of NFA positions. Returns
+// RE_DFA_UNKNOWN when the cache is full or out of memory.
+static uint8_t re_state(regex_t* re, uint16_t* list, uint32_t count, bool bol) {
+    for (uint32_t i = 1; i < count; i++) {          // canonical order
+        uint16_t v = list[i];
+        uint32_t j = i;
+        for (; j > 0 && list[j - 1] > v; j--) list[j] = list[j - 1];
+        list[j] = v;
+    }
+    uint32_t hash = 2166136261u ^ bol;
+    for (uint32_t i = 0; i < count; i++) hash = (hash ^ list[i]) * 16777619u;
+    uint32_t slot = hash % sizeof(re->table);
+    for (; re->table[slot] != RE_DFA_UNKNOWN; slot = (slot + 1) % sizeof(re->table)) {
+        re_dfa_t* d = re->dfa[re->table[slot]];
+        if (d->hash == hash && d->count == count && d->bol == bol && memcmp(d->insts, list, count * sizeof(uint16_t)) == 0)
+            return re->table[slot];
+    }
+    if (re->dfa_count == RE_MAX_DFA) return RE_DFA_UNKNOWN;
+    re_dfa_t* d = kmalloc(sizeof(re_dfa_t) + count * sizeof(uint16_t));
+    if (!d) return RE_DFA_UNKNOWN;
+    d->hash = hash;
+    d->count = count;
+    d->bol = bol;
+    d->match = d->match_eol = false;
+    memset(d->next, RE_DFA_UNKNOWN, sizeof(d->next));
+    memcpy(d->insts, list, count * sizeof(uint16_t));
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t op = re->prog[list[i]].op;
+        if (op == RE_MATCH) d->match = d->match_eol = true;
+        else if (op == RE_EOL && !d->match_eol) {
+            uint32_t n = 0;
+            re->gen++;
+            re_closure(re, list[i] + 1, bol, true, re->scratch, &n);
+            for (uint32_t k = 0; k < n; k++) if (re->prog[re->scratch[k]].op == RE_MATCH) d->match_eol = true;
+        }
+    }
+    re->table[slot] = re->dfa_count;
+    re->dfa[re->dfa_count] = d;
+    return re->dfa_count++;
+}
+
+static uint8_t re_start_state(regex_t* re) {
+    uint32_t count = 0;
+    re->gen++;
+    re_closure(re, 0, true, false, re->start_list, &count);
+    return re->start = re_state(re, re->start_list, count, true);
+}
+
+// Computes (and caches) the transition of state `from` on `byte`. A new
+// match may start at every position, so the start closure is always added.
+static uint8_t re_transition(regex_t* re, uint8_t from, uint8_t byte) {
+    re_dfa_t* d = re->dfa[from];
+    uint32_t count = 0;
+    re->gen++;
+    for (uint32_t i = 0; i < d->count; i++) {
+        re_inst_t* in = &re->prog[d->insts[i]];
+        if ((in->op == RE_BYTE && in->x == byte) || (in->op == RE_CLASS && re_class_has(&re->classes[in->x], byte)))
+            re_closure(re, d->insts[i] + 1, false, false, re->list, &count);
+    }
+    re_closure(re, 0, false, false, re->list, &count);
+    uint8_t to = re_state(re, re->list, count, false);
+    if (to != RE_DFA_UNKNOWN) return d->next[byte] = to;
+    // Cache full: start over with the start state and this one
+    re_flush(re);
+    if (re_start_state(re) == RE_DFA_UNKNOWN) return RE_DFA_UNKNOWN;
+    return re_state(re, re->list, count, false);
+}
+
+void regex_free(regex_t* re) {
+    if (!re) return;
+    re_flush(re);
+    kfree(re->classes);
+    kfree(re);
+}
+
+// Compiles a pattern; on failure returns NULL and sets *error
+regex_t* regex_compile(const char* pattern, const char** error) {
+    re_parser_t* P = kmalloc(sizeof(re_parser_t));
+    regex_t* re = kmalloc(sizeof(regex_t));
+    *error = "out of memory";
+    if (!P || !re) { kfree(P); kfree(re); return NULL; }
+    memset(re, 0, sizeof(regex_t));
+    P->p = pattern;
+    P->error = NULL;
+    P->ast_count = P->class_count = 0;
+    uint16_t root = re_parse_alt(P);
+    if (!P->error && *P->p) P->error = "unmatched )";
+    if (!P->error && !re_compile_node(re, P, root)) P->error = "pattern too large";
+    if (!P->error && re_emit(re, RE_MATCH, 0, 0) == RE_NONE) P->error = "pattern too large";
+    if (!P->error && P->class_count) {
+        re->classes = kmalloc(P->class_count * sizeof(re_class_t));
+        if (re->classes) memcpy(re->classes, P->classes, P->class_count * sizeof(re_class_t));
+        else P->error = "out of memory";
+    }
+    re->class_count = P->class_count;
+    memset(re->table, RE_DFA_UNKNOWN, sizeof(re->table));
+    if (!P->error && re_start_state(re) == RE_DFA_UNKNOWN) P->error = "out of memory";
+    *error = P->error;
+    kfree(P);
+    if (*error) { regex_free(re); return NULL; }
+    re->flushes = 0;
+    return re;
+}
+
+// Start of the first line in [p, end) containing a match, or NULL.
+// p must be at the start of a line.
+const uint8_t* regex_find_line(regex_t* re, const uint8_t* p, const uint8_t* end) {
+    while (p < end) {
+        const uint8_t* line = p;
+        uint8_t s = re->start;
+        re_dfa_t* d = re->dfa[s];
+        for (; p < end && *p != '\n' && !d->match && d->count; p++) {
+            uint8_t next = d->next[*p];
+            if (next == RE_DFA_UNKNOWN && (next = re_transition(re, s, *p)) == RE_DFA_UNKNOWN) return NULL;
+            d = re->dfa[s = next];
+        }
+        if (d->match_eol) return line;
+        p = mem_find_byte(p, end, '\n');
+        if (!p) return NULL;
+        p++;
+    }
+    return NULL;
+}
+
+// Whether a single line (no '\n') contains a match
+bool regex_match(regex_t* re, const char* str, size_t len) {
+    if (len == 0) return re->dfa[re->start]->match_eol;
+    return regex_find_line(re, (const uint8_t*)str, (const uint8_t*)str + len) != NULL;
+}
+
+// ==================== TIME ====================
+// Monotonic time from the TSC, calibrated once at boot against PIT
+// channel 2 (the speaker timer, polled, so no IRQ is needed)
+#define PIT_HZ 1193182
+
+#ifndef HOSTED
+static uint32_t tsc_per_us = 1000;
+static uint64_t tsc_boot = 0;
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+#endif
+
+// 64/32 division: the kernel links without libgcc's __udivdi3
+static inline uint64_t udiv64(uint64_t n, uint32_t d) {
+#ifdef __i386__
+    uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n, qlo, rem = hi % d;
+    __asm__ ("divl %4" : "=a"(qlo), "=d"(rem) : "a"(lo), "d"(rem), "rm"(d));
+    return ((uint64_t)(hi / d) << 32) | qlo;
+#else
+    return n / d;
+#endif
+}
+
+#ifdef HOSTED
+void time_init() {}
+uint64_t time_us() { return hosted_time_us(); }
+uint32_t time_ms() { return (uint32_t)(hosted_time_us() / 1000); }
+#else
+void time_init() {
+    uint8_t gate = inb(0x61);
+    outb(0x61, (gate & ~0x02) | 0x01);   // speaker off, channel 2 gate on
+    outb(0x43, 0xB0);                    // channel 2, lobyte/hibyte, mode 0
+    outb(0x42, (PIT_HZ / 100) & 0xFF);   // 10 ms
+    outb(0x42, (PIT_HZ / 100) >> 8);
+    uint64_t start = rdtsc();
+    for (uint32_t spins = 0; !(inb(0x61) & 0x20) && spins < 10000000; spins++);
+    uint32_t per_us = (uint32_t)udiv64(rdtsc() - start, 10000);
+    outb(0x61, gate);
+    if (per_us) tsc_per_us = per_us;
+    tsc_boot = rdtsc();
+}
+
+uint64_t time_us() { return udiv64(rdtsc() - tsc_boot, tsc_per_us); }
+uint32_t time_ms() { return (uint32_t)udiv64(rdtsc() - tsc_boot, tsc_per_us * 1000); }
+#endif
+
 // ==================== TERMINAL FUNCTIONS ====================
 static inline uint16_t vga_entry(char c, uint8_t color) { 
     return (uint16_t)c | (uint16_t)color << 8; 
@@ -197,7 +1060,20 @@ void term_scroll() {
     term_row = VGA_HEIGHT - 1;
 }
 
+// Where the running command writes: NULL is the screen, a shell pipe or
+// redirection points it at a stream. Text in the error color stays on the
+// screen, it is the stderr of the shell.
+typedef struct stream stream_t;
+struct stream {
+    void (*write)(stream_t* s, const char* data, size_t len);
+};
+static stream_t* term_out = NULL;
+
+void serial_putchar(char c);
+
 void term_putchar(char c) {
+    if (term_out && term_color != 0x0C) { term_out->write(term_out, &c, 1); return; }
+    serial_putchar(c);
     if (c == '\n') {
         term_col = 0;
         if (++term_row >= VGA_HEIGHT) term_scroll();
@@ -218,6 +1094,21 @@ void term_putchar(char c) {
 void term_write(const char* str) { while (*str) term_putchar(*str++); }
 void term_setcolor(uint8_t color) { term_color = color; }
 
+void term_write_dec(uint32_t value) {
+    char buf[12];
+    int idx = 11;
+    buf[idx] = '\0';
+    do {
+        buf[--idx] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+    term_write(&buf[idx]);
+}
+
+void term_write_hex(uint32_t value, int digits) {
+    while (digits-- > 0) term_putchar("0123456789abcdef"[(value >> (4 * digits)) & 0xF]);
+}
+
 // Curseur clignotant
 void enable_cursor() {
     outb(0x3D4, 0x0A);
@@ -272,7 +1163,11 @@ void draw_rect(int x, int y, int w, int h, uint8_t color) {
 void exit_graphics() { graphics_mode = false; }
 
 // ==================== IDT ET INTERRUPTIONS ====================
+#define KERNEL_CS 0x08           // flat GDT loaded by boot.asm
+
 extern void idt_flush(uint32_t);
+extern uint32_t isr_stubs[48];   // boot.asm: 32 exceptions, then IRQ 0-15
+extern void isr_ignore(void);
 
 void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags) {
     idt_entries[num].base_lo = base & 0xFFFF;
@@ -284,19 +1179,64 @@ void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags) {
 
 void init_idt() {
     idt_ptr.limit = sizeof(idt_entry_t) * 256 - 1;
-    idt_ptr.base = (uint32_t)&idt_entries;
+    idt_ptr.base = (uint32_t)(size_t)&idt_entries;
     
-    for (int i = 0; i < 256; i++) idt_set_gate(i, 0, 0, 0);
+    for (int i = 0; i < 256; i++) idt_set_gate(i, i < 48 ? isr_stubs[i] : (uint32_t)(size_t)isr_ignore, KERNEL_CS, 0x8E);
     
-    // Remap PIC
+    // Remap PIC, every line masked until irq_install()
     outb(0x20, 0x11); outb(0xA0, 0x11);
     outb(0x21, 0x20); outb(0xA1, 0x28);
     outb(0x21, 0x04); outb(0xA1, 0x02);
     outb(0x21, 0x01); outb(0xA1, 0x01);
-    outb(0x21, 0x0);  outb(0xA1, 0x0);
+    outb(0x21, 0xFF); outb(0xA1, 0xFF);
     
-    idt_flush((uint32_t)&idt_ptr);
+    idt_flush((uint32_t)(size_t)&idt_ptr);
+}
+
+// Called by the exception stubs, never returns
+void cpu_fault(uint32_t vector) {
+    term_setcolor(0x0C);
+    term_write("\nCPU exception "); term_write_dec(vector); term_write(", system halted\n");
+    term_setcolor(0x07);
+    for (;;) __asm__ volatile ("cli; hlt");
+}
+
+// IRQs with no handler. 7 and 15 also fire spuriously, when a line drops
+// before the PIC has picked it: its in-service bit is then clear and it
+// must not get an EOI (the master still does for 15, it did see the cascade)
+void irq_default(uint32_t irq) {
+    uint16_t pic = irq < 8 ? 0x20 : 0xA0;
+    if ((irq & 7) == 7) {
+        outb(pic, 0x0B);             // read ISR
+        bool spurious = !(inb(pic) & 0x80);
+        outb(pic, 0x0A);
+        if (spurious) {
+            if (irq == 15) outb(0x20, 0x20);
+            return;
+        }
+    }
+    if (irq >= 8) outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+}
+
+// Routes IRQ irq (vector 0x20 + irq) to an assembly stub from boot.asm and
+// enables interrupts; false when there are none (hosted). Only installed
+// IRQs are unmasked: the keyboard, the ATA disk and the timer stay polled.
+#ifdef HOSTED
+bool irq_install(uint8_t irq, void (*stub)(void)) { (void)irq; (void)stub; return false; }
+#else
+static uint16_t irq_mask = 0xFFFF;
+
+bool irq_install(uint8_t irq, void (*stub)(void)) {
+    if (irq_mask == 0xFFFF) init_idt();
+    idt_set_gate(0x20 + irq, (uint32_t)(size_t)stub, KERNEL_CS, 0x8E);
+    irq_mask &= ~(1 << irq);
+    if (irq >= 8) irq_mask &= ~(1 << 2);
+    outb(0x21, irq_mask & 0xFF); outb(0xA1, irq_mask >> 8);
+    __asm__ volatile ("sti");
+    return true;
 }
+#endif
 
 // Timer handler
 void timer_handler() {
@@ -332,93 +1272,1660 @@ void init_timer(uint32_t freq) {
     outb(0x40, (divisor >> 8) & 0xFF);
 }
 
-// ==================== FILE SYSTEM ====================
-fs_node_t* fs_find_child(fs_node_t* parent, const char* name) {
-    if (!parent || parent->type != FS_DIRECTORY) return NULL;
-    for (int i = 0; i < parent->child_count; i++) {
-        if (strcmp(parent->children[i]->name, name) == 0) return parent->children[i];
-    }
-    return NULL;
+// ==================== BLOCK STORE ====================
+// File data lives in 512-byte blocks. Blocks are grouped in 64 KB chunks
+// taken from the page allocator on demand, each with its own free bitmap
+// and per-block reference counts (blocks are shared by copy-on-write cp
+// and by deduplication); a group whose blocks are all freed goes back to
+// the page allocator.
+#define FS_BLOCK_SIZE 512
+#define FS_GROUP_BLOCKS 128
+#define FS_GROUP_PAGES (FS_GROUP_BLOCKS * FS_BLOCK_SIZE / PAGE_SIZE)
+#define FS_NO_BLOCK 0xFFFFFFFF
+
+typedef struct {
+    uint8_t* data;              // NULL once released
+    uint32_t used;
+    uint32_t bitmap[FS_GROUP_BLOCKS / 32];
+    uint32_t indexed[FS_GROUP_BLOCKS / 32];  // in the dedup index, hence read-only
+    uint32_t refs[FS_GROUP_BLOCKS];
+    uint32_t hash[FS_GROUP_BLOCKS];          // dedup index: content hash
+    uint32_t next[FS_GROUP_BLOCKS];          // dedup index: bucket chain
+} fs_group_t;
+
+static fs_group_t* fs_groups = NULL;
+static uint32_t fs_group_count = 0, fs_group_capacity = 0, fs_group_hint = 0;
+static uint32_t fs_blocks_used = 0, fs_adopted_groups = 0;
+
+static inline uint8_t* fs_block_data(uint32_t block) {
+    return fs_groups[block / FS_GROUP_BLOCKS].data + (block % FS_GROUP_BLOCKS) * FS_BLOCK_SIZE;
 }
 
-fs_node_t* fs_create_node(const char* name, fs_node_type type, fs_node_t* parent) {
-    if (fs_node_count >= MAX_FILES) return NULL;
-    fs_node_t* node = &fs_nodes[fs_node_count++];
-    strcpy(node->name, name);
-    node->type = type; node->size = 0; node->content = NULL;
-    node->parent = parent; node->child_count = 0; node->permissions = 0x75;
-    if (parent && parent->child_count < 64) parent->children[parent->child_count++] = node;
-    return node;
+static bool fs_block_is_free(uint32_t block) {
+    fs_group_t* g = &fs_groups[block / FS_GROUP_BLOCKS];
+    uint32_t bit = block % FS_GROUP_BLOCKS;
+    return g->data && !(g->bitmap[bit / 32] & (1u << (bit % 32)));
 }
 
-fs_node_t* fs_resolve_path(const char* path) {
-    if (!path || !*path) return current_dir;
-    fs_node_t* node;
-    char temp_path[MAX_PATH];
-    strcpy(temp_path, path);
-    
-    if (path[0] == '/') {
-        node = fs_root;
-        char* p = temp_path + 1;
-        char* token = p;
-        while (*p) {
-            if (*p == '/') {
-                *p = '\0';
-                if (*token) {
-                    node = fs_find_child(node, token);
-                    if (!node) return NULL;
-                }
-                token = p + 1;
-            }
-            p++;
-        }
-        if (*token) node = fs_find_child(node, token);
-    } else {
-        node = current_dir;
-        char* token = temp_path;
-        char* p = temp_path;
-        while (*p) {
-            if (*p == '/') {
-                *p = '\0';
-                if (strcmp(token, "..") == 0) {
-                    if (node->parent) node = node->parent;
-                } else if (strcmp(token, ".") != 0 && *token) {
-                    node = fs_find_child(node, token);
-                    if (!node) return NULL;
-                }
-                token = p + 1;
-            }
-            p++;
+static uint32_t fs_block_take(uint32_t block) {
+    fs_group_t* g = &fs_groups[block / FS_GROUP_BLOCKS];
+    uint32_t bit = block % FS_GROUP_BLOCKS;
+    g->bitmap[bit / 32] |= 1u << (bit % 32);
+    g->refs[bit] = 1;
+    g->used++;
+    fs_blocks_used++;
+    return block;
+}
+
+static fs_group_t* fs_group_open(uint32_t* index) {
+    uint32_t g = 0;
+    while (g < fs_group_count && fs_groups[g].data) g++;   // reuse a released slot
+    if (g == fs_group_count) {
+        if (fs_group_count == fs_group_capacity) {
+            uint32_t capacity = fs_group_capacity ? fs_group_capacity * 2 : 16;
+            fs_group_t* groups = krealloc(fs_groups, capacity * sizeof(fs_group_t));
+            if (!groups) return NULL;
+            fs_groups = groups;
+            fs_group_capacity = capacity;
         }
-        if (*token) {
-            if (strcmp(token, "..") == 0) {
-                if (node->parent) node = node->parent;
-            } else if (strcmp(token, ".") != 0) {
-                node = fs_find_child(node, token);
-            }
+        fs_group_count++;
+    }
+    fs_group_t* group = &fs_groups[g];
+    memset(group, 0, sizeof(fs_group_t));
+    group->data = kpage_alloc(FS_GROUP_PAGES);
+    if (!group->data) return NULL;
+    *index = g;
+    return group;
+}
+
+// Allocates a block, preferring `near` so files stay contiguous
+uint32_t fs_block_alloc(uint32_t near) {
+    if (near / FS_GROUP_BLOCKS < fs_group_count && fs_block_is_free(near)) return fs_block_take(near);
+    for (uint32_t n = 0; n < fs_group_count; n++) {
+        uint32_t g = (fs_group_hint + n) % fs_group_count;
+        fs_group_t* group = &fs_groups[g];
+        if (!group->data || group->used == FS_GROUP_BLOCKS) continue;
+        for (uint32_t w = 0; w < FS_GROUP_BLOCKS / 32; w++) {
+            if (group->bitmap[w] == 0xFFFFFFFF) continue;
+            fs_group_hint = g;
+            return fs_block_take(g * FS_GROUP_BLOCKS + w * 32 + __builtin_ctz(~group->bitmap[w]));
         }
     }
-    return node;
+    uint32_t g;
+    if (!fs_group_open(&g)) return FS_NO_BLOCK;
+    fs_group_hint = g;
+    return fs_block_take(g * FS_GROUP_BLOCKS);
 }
 
-void fs_get_path(fs_node_t* node, char* buffer) {
-    if (!node || node == fs_root) { strcpy(buffer, "/"); return; }
-    char temp[MAX_PATH];
-    char* p = temp + MAX_PATH - 1;
-    *p = '\0';
-    while (node && node != fs_root) {
-        size_t len = strlen(node->name);
-        p -= len; memcpy(p, node->name, len);
-        p--; *p = '/';
-        node = node->parent;
+static inline uint32_t* fs_block_refs(uint32_t block) {
+    return &fs_groups[block / FS_GROUP_BLOCKS].refs[block % FS_GROUP_BLOCKS];
+}
+
+// ---- Deduplication index ----
+// Blocks are hashed after each write; a block whose content already exists
+// is dropped in favour of the existing copy. Indexed blocks are immutable:
+// writing to one goes through copy-on-write like any shared block.
+static bool fs_dedup_enabled = false;
+static uint32_t* fs_dedup_buckets = NULL;
+static uint32_t fs_dedup_bucket_count = 0, fs_dedup_indexed = 0, fs_dedup_merged = 0;
+
+typedef uint32_t __attribute__((may_alias)) fs_word_t;
+
+static inline uint32_t rotl32(uint32_t x, int r) { return (x << r) | (x >> (32 - r)); }
+
+// xxHash32 over one block: four independent lanes keep the multipliers
+// pipelined (the kernel does not enable SSE, so lanes stay in registers)
+static uint32_t fs_hash_block(const uint8_t* data) {
+    const uint32_t P1 = 2654435761u, P2 = 2246822519u, P3 = 3266489917u;
+    const fs_word_t* w = (const fs_word_t*)data;
+    uint32_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+    for (int i = 0; i < FS_BLOCK_SIZE / 4; i += 4) {
+        v1 = rotl32(v1 + w[i] * P2, 13) * P1;
+        v2 = rotl32(v2 + w[i + 1] * P2, 13) * P1;
+        v3 = rotl32(v3 + w[i + 2] * P2, 13) * P1;
+        v4 = rotl32(v4 + w[i + 3] * P2, 13) * P1;
     }
-    strcpy(buffer, p);
+    uint32_t h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18) + FS_BLOCK_SIZE;
+    h ^= h >> 15; h *= P2;
+    h ^= h >> 13; h *= P3;
+    h ^= h >> 16;
+    return h;
 }
 
-void fs_init() {
-    fs_node_count = 0; file_data_used = 0;
-    fs_root = fs_create_node("/", FS_DIRECTORY, NULL);
-    current_dir = fs_root;
+static inline bool fs_block_indexed(uint32_t block) {
+    return fs_groups[block / FS_GROUP_BLOCKS].indexed[(block % FS_GROUP_BLOCKS) / 32] & (1u << (block % 32));
+}
+
+static void fs_dedup_link(uint32_t block) {
+    fs_group_t* g = &fs_groups[block / FS_GROUP_BLOCKS];
+    uint32_t bit = block % FS_GROUP_BLOCKS;
+    uint32_t* bucket = &fs_dedup_buckets[g->hash[bit] & (fs_dedup_bucket_count - 1)];
+    g->next[bit] = *bucket;
+    *bucket = block;
+}
+
+static void fs_dedup_grow() {
+    uint32_t count = fs_dedup_bucket_count ? fs_dedup_bucket_count * 2 : 1024;
+    uint32_t* buckets = kmalloc(count * sizeof(uint32_t));
+    if (!buckets) return;
+    memset(buckets, 0xFF, count * sizeof(uint32_t));
+    kfree(fs_dedup_buckets);
+    fs_dedup_buckets = buckets;
+    fs_dedup_bucket_count = count;
+    for (uint32_t block = 0; block < fs_group_count * FS_GROUP_BLOCKS; block++)
+        if (fs_groups[block / FS_GROUP_BLOCKS].data && fs_block_indexed(block)) fs_dedup_link(block);
+}
+
+static void fs_dedup_unlink(uint32_t block) {
+    fs_group_t* g = &fs_groups[block / FS_GROUP_BLOCKS];
+    uint32_t bit = block % FS_GROUP_BLOCKS;
+    uint32_t* link = &fs_dedup_buckets[g->hash[bit] & (fs_dedup_bucket_count - 1)];
+    while (*link != block) link = &fs_groups[*link / FS_GROUP_BLOCKS].next[*link % FS_GROUP_BLOCKS];
+    *link = g->next[bit];
+    g->indexed[bit / 32] &= ~(1u << (bit % 32));
+    fs_dedup_indexed--;
+}
+
+// Returns an indexed block with the same content, or indexes this one
+static uint32_t fs_dedup_lookup(uint32_t block) {
+    if (fs_dedup_indexed >= fs_dedup_bucket_count) fs_dedup_grow();
+    if (!fs_dedup_buckets) return block;
+    uint8_t* data = fs_block_data(block);
+    uint32_t hash = fs_hash_block(data);
+    uint32_t other = fs_dedup_buckets[hash & (fs_dedup_bucket_count - 1)];
+    while (other != FS_NO_BLOCK) {
+        fs_group_t* g = &fs_groups[other / FS_GROUP_BLOCKS];
+        if (g->hash[other % FS_GROUP_BLOCKS] == hash && memcmp(fs_block_data(other), data, FS_BLOCK_SIZE) == 0)
+            return other;
+        other = g->next[other % FS_GROUP_BLOCKS];
+    }
+    fs_group_t* g = &fs_groups[block / FS_GROUP_BLOCKS];
+    uint32_t bit = block % FS_GROUP_BLOCKS;
+    g->hash[bit] = hash;
+    g->indexed[bit / 32] |= 1u << (bit % 32);
+    fs_dedup_link(block);
+    fs_dedup_indexed++;
+    return block;
+}
+
+// Drops one reference; the block is freed with the last one
+void fs_block_free(uint32_t block) {
+    fs_group_t* g = &fs_groups[block / FS_GROUP_BLOCKS];
+    uint32_t bit = block % FS_GROUP_BLOCKS;
+    if (--g->refs[bit] > 0) return;
+    if (fs_block_indexed(block)) fs_dedup_unlink(block);
+    g->bitmap[bit / 32] &= ~(1u << (bit % 32));
+    fs_blocks_used--;
+    if (--g->used == 0) {
+        kpage_free(g->data, FS_GROUP_PAGES);
+        g->data = NULL;
+    }
+}
+
+// Adopts `count` blocks of memory outside the page allocator (a boot
+// image) as new groups at the end of the table. Each block keeps one
+// permanent reference, so it is never freed and writes always copy it.
+// Returns the first block number.
+uint32_t fs_block_adopt(uint8_t* data, uint32_t count) {
+    uint32_t groups = (count + FS_GROUP_BLOCKS - 1) / FS_GROUP_BLOCKS;
+    if (fs_group_count + groups > fs_group_capacity) {
+        uint32_t capacity = fs_group_capacity ? fs_group_capacity : 16;
+        while (capacity < fs_group_count + groups) capacity *= 2;
+        fs_group_t* grown = krealloc(fs_groups, capacity * sizeof(fs_group_t));
+        if (!grown) return FS_NO_BLOCK;
+        fs_groups = grown;
+        fs_group_capacity = capacity;
+    }
+    uint32_t first = fs_group_count * FS_GROUP_BLOCKS;
+    fs_adopted_groups += groups;
+    for (uint32_t i = 0; i < groups; i++) {
+        fs_group_t* g = &fs_groups[fs_group_count++];
+        memset(g, 0, sizeof(fs_group_t));
+        g->data = data + i * FS_GROUP_BLOCKS * FS_BLOCK_SIZE;
+        g->used = FS_GROUP_BLOCKS;   // the tail past `count` is never handed out
+        memset(g->bitmap, 0xFF, sizeof(g->bitmap));
+        for (uint32_t b = 0; b < FS_GROUP_BLOCKS; b++) g->refs[b] = 1;
+    }
+    return first;
+}
+
+// ==================== LZ4 COMPRESSION ====================
+// LZ4 block format: each sequence is a token (literal length << 4 | match
+// length - 4), the literals, a 16-bit offset back into the output and the
+// length extensions (runs of 255). The last 5 bytes are always literals.
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT 12           // a match must start this far from the end
+
+static uint32_t lz_table[1 << LZ_HASH_BITS];
+
+static inline uint32_t lz_bound(uint32_t size) { return size + size / 255 + 16; }
+
+static inline uint32_t lz_hash(uint32_t seq) { return (seq * 2654435761u) >> (32 - LZ_HASH_BITS); }
+
+static uint8_t* lz_put_length(uint8_t* op, uint32_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+static uint8_t* lz_put_literals(uint8_t* op, const uint8_t* lit, uint32_t count, uint32_t match_nibble) {
+    *op++ = (count < 15 ? count : 15) << 4 | match_nibble;
+    if (count >= 15) op = lz_put_length(op, count - 15);
+    memcpy(op, lit, count);
+    return op + count;
+}
+
+// Greedy single-probe compressor; dst needs lz_bound(size) bytes
+uint32_t lz_compress(const uint8_t* src, uint32_t size, uint8_t* dst) {
+    const uint8_t *ip = src, *anchor = src, *end = src + size;
+    uint8_t* op = dst;
+    if (size > LZ_MF_LIMIT) {
+        const uint8_t* limit = end - LZ_MF_LIMIT;
+        memset(lz_table, 0, sizeof(lz_table));
+        while (ip < limit) {
+            uint32_t seq = *(const fs_word_t*)ip;
+            uint32_t* slot = &lz_table[lz_hash(seq)];
+            const uint8_t* ref = src + *slot;
+            *slot = ip - src;
+            if (ref >= ip || ip - ref > 0xFFFF || *(const fs_word_t*)ref != seq) { ip++; continue; }
+            const uint8_t* mp = ip + LZ_MIN_MATCH;
+            ref += LZ_MIN_MATCH;
+            while (mp < end - LZ_LAST_LITERALS && *mp == *ref) { mp++; ref++; }
+            uint32_t match = mp - ip - LZ_MIN_MATCH, offset = mp - ref;
+            op = lz_put_literals(op, anchor, ip - anchor, match < 15 ? match : 15);
+            *op++ = offset & 0xFF;
+            *op++ = offset >> 8;
+            if (match >= 15) op = lz_put_length(op, match - 15);
+            ip = anchor = mp;
+        }
+    }
+    op = lz_put_literals(op, anchor, end - anchor, 0);
+    return op - dst;
+}
+
+// Decodes exactly `size` bytes; false on a malformed stream
+bool lz_decompress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t size) {
+    const uint8_t *ip = src, *iend = src + len;
+    uint8_t *op = dst, *oend = dst + size;
+    while (ip < iend) {
+        uint8_t token = *ip++, b;
+        uint32_t count = token >> 4;
+        if (count == 15) do { if (ip == iend) return false; b = *ip++; count += b; } while (b == 255);
+        if (count > (uint32_t)(iend - ip) || count > (uint32_t)(oend - op)) return false;
+        memcpy(op, ip, count);
+        op += count; ip += count;
+        if (ip == iend) break;
+        if (iend - ip < 2) return false;
+        uint32_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        count = token & 15;
+        if (count == 15) do { if (ip == iend) return false; b = *ip++; count += b; } while (b == 255);
+        count += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (uint32_t)(op - dst) || count > (uint32_t)(oend - op)) return false;
+        const uint8_t* ref = op - offset;   // may overlap the output: copy bytewise
+        while (count--) *op++ = *ref++;
+    }
+    return op == oend;
+}
+
+// ==================== FILE DATA ====================
+static void ix_file_changed(fs_node_t* file);   // trigram index, see below
+static void ix_forget(fs_node_t* file);
+static bool fs_file_load(fs_node_t* file);      // disk, see below
+static void dk_forget(fs_node_t* node);
+
+// Every change to a file's content goes through here
+static void fs_file_changed(fs_node_t* file) {
+    file->flags |= FS_NODE_DIRTY;
+    fs_changed = true;
+    ix_file_changed(file);
+}
+
+static inline uint32_t fs_blocks_for(uint32_t size) { return (size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE; }
+
+// Block number holding logical block `index` of a file
+static uint32_t fs_file_block(fs_node_t* file, uint32_t index) {
+    fs_extents_t* ext = file->extents;
+    for (uint32_t i = 0; ext && i < ext->count; i++) {
+        if (index < ext->runs[i].count) return ext->runs[i].start + index;
+        index -= ext->runs[i].count;
+    }
+    return FS_NO_BLOCK;
+}
+
+// Appends a block to an extent list, extending the last run when contiguous
+static bool fs_extents_push(fs_extents_t** list, uint32_t block) {
+    fs_extents_t* ext = *list;
+    if (ext && ext->count) {
+        fs_extent_t* last = &ext->runs[ext->count - 1];
+        if (last->start + last->count == block) { last->count++; return true; }
+    }
+    if (!ext || ext->count == ext->capacity) {
+        uint32_t capacity = ext ? ext->capacity * 2 : 2;
+        fs_extents_t* grown = krealloc(ext, sizeof(fs_extents_t) + capacity * sizeof(fs_extent_t));
+        if (!grown) return false;
+        if (!ext) { grown->count = 0; grown->refs = 1; }
+        grown->capacity = capacity;
+        *list = ext = grown;
+    }
+    ext->runs[ext->count].start = block;
+    ext->runs[ext->count].count = 1;
+    ext->count++;
+    return true;
+}
+
+// Detaches a file from an extent list shared by cp; its blocks gain a reference
+static bool fs_file_own_map(fs_node_t* file) {
+    fs_extents_t* ext = file->extents;
+    if (!ext || ext->refs == 1) return true;
+    fs_extents_t* copy = kmalloc(sizeof(fs_extents_t) + ext->capacity * sizeof(fs_extent_t));
+    if (!copy) return false;
+    memcpy(copy, ext, sizeof(fs_extents_t) + ext->count * sizeof(fs_extent_t));
+    copy->refs = 1;
+    for (uint32_t i = 0; i < ext->count; i++)
+        for (uint32_t b = 0; b < ext->runs[i].count; b++) (*fs_block_refs(ext->runs[i].start + b))++;
+    ext->refs--;
+    file->extents = copy;
+    return true;
+}
+
+// Points logical block `index` of a file at `block`, splitting its run
+// and merging with contiguous neighbours. Requires a private list.
+static bool fs_extents_set(fs_node_t* file, uint32_t index, uint32_t block) {
+    fs_extents_t* ext = file->extents;
+    uint32_t i = 0;
+    while (index >= ext->runs[i].count) index -= ext->runs[i++].count;
+    fs_extent_t run = ext->runs[i];
+    if (run.count == 1) {
+        ext->runs[i].start = block;
+    } else {
+        uint32_t pieces = (index > 0) + 1 + (index + 1 < run.count);
+        if (ext->count + pieces - 1 > ext->capacity) {
+            uint32_t capacity = ext->capacity * 2 + 2;
+            ext = krealloc(ext, sizeof(fs_extents_t) + capacity * sizeof(fs_extent_t));
+            if (!ext) return false;
+            ext->capacity = capacity;
+            file->extents = ext;
+        }
+        memmove(&ext->runs[i + pieces], &ext->runs[i + 1], (ext->count - i - 1) * sizeof(fs_extent_t));
+        ext->count += pieces - 1;
+        if (index > 0) { ext->runs[i].count = index; i++; }
+        ext->runs[i].start = block;
+        ext->runs[i].count = 1;
+        if (index + 1 < run.count) {
+            ext->runs[i + 1].start = run.start + index + 1;
+            ext->runs[i + 1].count = run.count - index - 1;
+        }
+    }
+    if (i > 0 && ext->runs[i - 1].start + ext->runs[i - 1].count == block) {
+        ext->runs[--i].count++;
+        memmove(&ext->runs[i + 1], &ext->runs[i + 2], (ext->count - i - 2) * sizeof(fs_extent_t));
+        ext->count--;
+    }
+    if (i + 1 < ext->count && ext->runs[i].start + ext->runs[i].count == ext->runs[i + 1].start) {
+        ext->runs[i].count += ext->runs[i + 1].count;
+        memmove(&ext->runs[i + 1], &ext->runs[i + 2], (ext->count - i - 2) * sizeof(fs_extent_t));
+        ext->count--;
+    }
+    return true;
+}
+
+// Copy-on-write: gives the file private, writable copies of any shared or
+// dedup-indexed block in [first, last]
+static bool fs_file_unshare(fs_node_t* file, uint32_t first, uint32_t last) {
+    if (!fs_file_own_map(file)) return false;
+    uint32_t prev = FS_NO_BLOCK;
+    for (uint32_t index = first; index <= last; index++) {
+        uint32_t block = fs_file_block(file, index);
+        if (*fs_block_refs(block) > 1 || fs_block_indexed(block)) {
+            uint32_t copy = fs_block_alloc(prev != FS_NO_BLOCK ? prev + 1 : block + 1);
+            if (copy == FS_NO_BLOCK) return false;
+            memcpy(fs_block_data(copy), fs_block_data(block), FS_BLOCK_SIZE);
+            if (!fs_extents_set(file, index, copy)) { fs_block_free(copy); return false; }
+            fs_block_free(block);
+            block = copy;
+        }
+        prev = block;
+    }
+    return true;
+}
+
+// Merges freshly written blocks in [first, last] with identical existing ones
+static void fs_file_dedup(fs_node_t* file, uint32_t first, uint32_t last) {
+    for (uint32_t index = first; index <= last; index++) {
+        uint32_t block = fs_file_block(file, index);
+        uint32_t same = fs_dedup_lookup(block);
+        if (same == block) continue;
+        (*fs_block_refs(same))++;
+        if (!fs_extents_set(file, index, same)) { (*fs_block_refs(same))--; continue; }
+        fs_block_free(block);
+        fs_dedup_merged++;
+    }
+}
+
+static bool fs_file_append_block(fs_node_t* file) {
+    fs_extents_t* ext = file->extents;
+    fs_extent_t* last = ext && ext->count ? &ext->runs[ext->count - 1] : NULL;
+    uint32_t block = fs_block_alloc(last ? last->start + last->count : 0);
+    if (block == FS_NO_BLOCK) return false;
+    memset(fs_block_data(block), 0, FS_BLOCK_SIZE);
+    if (!fs_extents_push(&file->extents, block)) { fs_block_free(block); return false; }
+    return true;
+}
+
+static void fs_file_drop_last_block(fs_node_t* file) {
+    fs_extents_t* ext = file->extents;
+    fs_extent_t* last = &ext->runs[ext->count - 1];
+    fs_block_free(last->start + last->count - 1);
+    if (--last->count == 0) ext->count--;
+}
+
+// Grows (zero-filled) or shrinks a block-stored file in place
+static bool fs_truncate_blocks(fs_node_t* file, uint32_t size) {
+    uint32_t have = fs_blocks_for(file->size), need = fs_blocks_for(size);
+    if (need == 0 && file->extents && file->extents->refs > 1) {
+        // Dropping a shared list only releases our reference
+        file->extents->refs--;
+        file->extents = NULL;
+        file->size = 0;
+        return true;
+    }
+    if (size != file->size && !fs_file_own_map(file)) return false;
+    if (size > file->size && file->size % FS_BLOCK_SIZE) {
+        if (!fs_file_unshare(file, have - 1, have - 1)) return false;
+        uint8_t* tail = fs_block_data(fs_file_block(file, have - 1));
+        memset(tail + file->size % FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE - file->size % FS_BLOCK_SIZE);
+    }
+    while (have < need) {
+        if (!fs_file_append_block(file)) {
+            // Roll back to the old size so a failed grow leaves the file intact
+            uint32_t old = fs_blocks_for(file->size);
+            while (have-- > old) fs_file_drop_last_block(file);
+            return false;
+        }
+        have++;
+    }
+    while (have > need) { fs_file_drop_last_block(file); have--; }
+    if (need == 0) { kfree(file->extents); file->extents = NULL; }
+    file->size = size;
+    return true;
+}
+
+// Copies between buf and the blocks covering [offset, offset + len),
+// walking the extent list once
+static void fs_copy(fs_node_t* file, uint32_t offset, uint8_t* buf, uint32_t len, bool to_file) {
+    if (file->flags & FS_NODE_INLINE) {
+        if (to_file) memcpy(file->data + offset, buf, len);
+        else memcpy(buf, file->data + offset, len);
+        return;
+    }
+    fs_extents_t* ext = file->extents;
+    uint32_t run = 0, index = offset / FS_BLOCK_SIZE, in_block = offset % FS_BLOCK_SIZE;
+    while (index >= ext->runs[run].count) index -= ext->runs[run++].count;
+    while (len) {
+        uint8_t* data = fs_block_data(ext->runs[run].start + index) + in_block;
+        uint32_t chunk = FS_BLOCK_SIZE - in_block;
+        if (chunk > len) chunk = len;
+        if (to_file) memcpy(data, buf, chunk);
+        else memcpy(buf, data, chunk);
+        buf += chunk; len -= chunk; in_block = 0;
+        if (++index == ext->runs[run].count) { index = 0; run++; }
+    }
+}
+
+// ---- Compressed files ----
+// A compressed file's blocks hold a 4-byte stored length and an LZ4 stream.
+// Reads decompress the whole file into a small LRU cache of hot files;
+// any change decompresses it back into plain blocks first.
+#define FS_COMPRESS_MIN (2 * FS_BLOCK_SIZE)
+#define FS_COMPRESS_MAX (1024 * 1024)
+#define FS_HOT_SLOTS 8
+#define FS_HOT_BUDGET (256 * 1024)
+
+typedef struct {
+    fs_node_t* file;             // NULL when free
+    uint8_t* data;
+    uint32_t size, last_use;
+} fs_hot_t;
+
+static fs_hot_t fs_hot[FS_HOT_SLOTS];
+static uint32_t fs_hot_bytes = 0, fs_hot_clock = 0, fs_hot_hits = 0, fs_hot_misses = 0;
+
+static inline uint32_t fs_packed_size(fs_node_t* file) {
+    return *(fs_word_t*)fs_block_data(file->extents->runs[0].start);
+}
+
+static void fs_hot_evict(fs_hot_t* slot) {
+    kfree(slot->data);
+    fs_hot_bytes -= slot->size;
+    slot->file = NULL;
+}
+
+static void fs_hot_drop(fs_node_t* file) {
+    for (int i = 0; i < FS_HOT_SLOTS; i++)
+        if (fs_hot[i].file == file) fs_hot_evict(&fs_hot[i]);
+}
+
+static bool fs_unpack(fs_node_t* file, uint8_t* out) {
+    uint32_t stored = fs_packed_size(file);
+    uint8_t* packed = kmalloc(stored);
+    if (!packed) return false;
+    fs_copy(file, 0, packed, stored, false);
+    bool ok = lz_decompress(packed + 4, stored - 4, out, file->size);
+    kfree(packed);
+    return ok;
+}
+
+static uint8_t* fs_hot_find(fs_node_t* file) {
+    for (int i = 0; i < FS_HOT_SLOTS; i++)
+        if (fs_hot[i].file == file) return fs_hot[i].data;
+    return NULL;
+}
+
+// Decompressed content of a compressed file, cached while it stays hot
+static uint8_t* fs_hot_get(fs_node_t* file) {
+    fs_hot_t* victim = &fs_hot[0];
+    for (int i = 0; i < FS_HOT_SLOTS; i++) {
+        fs_hot_t* slot = &fs_hot[i];
+        if (slot->file == file) {
+            slot->last_use = ++fs_hot_clock;
+            fs_hot_hits++;
+            return slot->data;
+        }
+        if (!slot->file || (victim->file && slot->last_use < victim->last_use)) victim = slot;
+    }
+    fs_hot_misses++;
+    uint8_t* data = kmalloc(file->size);
+    if (!data || !fs_unpack(file, data)) { kfree(data); return NULL; }
+    if (victim->file) fs_hot_evict(victim);
+    while (fs_hot_bytes + file->size > FS_HOT_BUDGET) {
+        fs_hot_t* lru = NULL;
+        for (int i = 0; i < FS_HOT_SLOTS; i++)
+            if (fs_hot[i].file && (!lru || fs_hot[i].last_use < lru->last_use)) lru = &fs_hot[i];
+        if (!lru) break;
+        fs_hot_evict(lru);
+    }
+    victim->file = file;
+    victim->data = data;
+    victim->size = file->size;
+    victim->last_use = ++fs_hot_clock;
+    fs_hot_bytes += file->size;
+    return data;
+}
+
+// Releases the compressed blocks, leaving an empty block-stored file
+static void fs_drop_packed(fs_node_t* file) {
+    fs_hot_drop(file);
+    file->size = fs_packed_size(file);
+    file->flags &= ~FS_NODE_COMPRESSED;
+    fs_truncate_blocks(file, 0);
+}
+
+static bool fs_compress_candidate(fs_node_t* file) {
+    if (file->flags & (FS_NODE_INLINE | FS_NODE_COMPRESSED | FS_NODE_INCOMPRESSIBLE | FS_NODE_ONDISK)) return false;
+    if (file->size < FS_COMPRESS_MIN || file->size > FS_COMPRESS_MAX) return false;
+    // Blocks shared with other files would stay allocated anyway
+    fs_extents_t* ext = file->extents;
+    if (ext->refs > 1) return false;
+    for (uint32_t i = 0; i < ext->count; i++)
+        for (uint32_t b = 0; b < ext->runs[i].count; b++)
+            if (*fs_block_refs(ext->runs[i].start + b) > 1) return false;
+    return true;
+}
+
+// Replaces a file's blocks with their compressed form, if that frees any.
+// The new blocks are filled before the old ones are released.
+static bool fs_compress(fs_node_t* file) {
+    uint32_t size = file->size;
+    uint8_t* data = kmalloc(size);
+    uint8_t* packed = kmalloc(4 + lz_bound(size));
+    bool ok = false;
+    if (data && packed) {
+        fs_copy(file, 0, data, size, false);
+        uint32_t stored = 4 + lz_compress(data, size, packed + 4);
+        fs_node_t tmp;
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.type = FS_FILE;
+        if (fs_blocks_for(stored) >= fs_blocks_for(size)) {
+            file->flags |= FS_NODE_INCOMPRESSIBLE;
+        } else if (fs_truncate_blocks(&tmp, stored)) {
+            memcpy(packed, &stored, 4);
+            fs_copy(&tmp, 0, packed, stored, true);
+            fs_truncate_blocks(file, 0);
+            file->extents = tmp.extents;
+            file->size = size;
+            file->flags |= FS_NODE_COMPRESSED;
+            ok = true;
+        }
+    }
+    kfree(data);
+    kfree(packed);
+    return ok;
+}
+
+// Turns a compressed file back into plain blocks before it changes
+static bool fs_decompress(fs_node_t* file) {
+    uint32_t size = file->size;
+    uint8_t* data = fs_hot_get(file);
+    fs_node_t tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.type = FS_FILE;
+    if (!data || !fs_truncate_blocks(&tmp, size)) return false;
+    fs_copy(&tmp, 0, data, size, true);
+    if (fs_dedup_enabled) fs_file_dedup(&tmp, 0, fs_blocks_for(size) - 1);
+    fs_drop_packed(file);
+    file->extents = tmp.extents;
+    file->size = size;
+    return true;
+}
+
+// Resizes a file, moving it between inline and block storage as needed
+bool fs_truncate(fs_node_t* file, uint32_t size) {
+    if (file->type != FS_FILE) return false;
+    uint32_t old_size = file->size;   // dropping packed data already empties the file
+    if (file->flags & FS_NODE_ONDISK) {
+        if (size && !fs_file_load(file)) return false;
+        if (!size) file->flags = (file->flags & ~FS_NODE_ONDISK) | FS_NODE_INLINE;   // emptied unread
+    }
+    if (file->flags & FS_NODE_COMPRESSED) {
+        if (size == 0) fs_drop_packed(file);
+        else if (!fs_decompress(file)) return false;
+    }
+    if (size != old_size) {
+        file->flags = (file->flags & ~FS_NODE_INCOMPRESSIBLE) | FS_NODE_REFERENCED;
+        fs_file_changed(file);
+    }
+    char data[FS_INLINE_MAX];
+    if (file->flags & FS_NODE_INLINE) {
+        if (size <= FS_INLINE_MAX) {
+            if (size > file->size) memset(file->data + file->size, 0, size - file->size);
+            file->size = size;
+            return true;
+        }
+        // Promote to blocks
+        uint32_t len = file->size;
+        memcpy(data, file->data, len);
+        file->flags &= ~FS_NODE_INLINE;
+        file->extents = NULL;
+        file->size = 0;
+        if (!fs_truncate_blocks(file, size)) {
+            file->flags |= FS_NODE_INLINE;
+            memcpy(file->data, data, len);
+            file->size = len;
+            return false;
+        }
+        fs_copy(file, 0, (uint8_t*)data, len, true);
+        return true;
+    }
+    if (size > FS_INLINE_MAX) return fs_truncate_blocks(file, size);
+    // Small enough to move back into the inode
+    if (size) fs_copy(file, 0, (uint8_t*)data, size, false);
+    fs_truncate_blocks(file, 0);
+    file->flags |= FS_NODE_INLINE;
+    memcpy(file->data, data, size);
+    file->size = size;
+    return true;
+}
+
+uint32_t fs_read(fs_node_t* file, uint32_t offset, void* buf, uint32_t len) {
+    if (file->type != FS_FILE || offset >= file->size || !fs_file_load(file)) return 0;
+    if (len > file->size - offset) len = file->size - offset;
+    file->flags |= FS_NODE_REFERENCED;
+    if (file->flags & FS_NODE_COMPRESSED) {
+        uint8_t* data = fs_hot_get(file);
+        if (!data) return 0;
+        memcpy(buf, data + offset, len);
+        return len;
+    }
+    if (len) fs_copy(file, offset, buf, len, false);
+    return len;
+}
+
+bool fs_write(fs_node_t* file, uint32_t offset, const void* buf, uint32_t len) {
+    if (file->type != FS_FILE || !fs_file_load(file)) return false;
+    if ((file->flags & FS_NODE_COMPRESSED) && !fs_decompress(file)) return false;
+    if (offset + len > file->size && !fs_truncate(file, offset + len)) return false;
+    if (!len) return true;
+    file->flags = (file->flags & ~FS_NODE_INCOMPRESSIBLE) | FS_NODE_REFERENCED;
+    fs_file_changed(file);
+    if (file->flags & FS_NODE_INLINE) {
+        fs_copy(file, offset, (uint8_t*)buf, len, true);
+        return true;
+    }
+    uint32_t first = offset / FS_BLOCK_SIZE, last = (offset + len - 1) / FS_BLOCK_SIZE;
+    if (!fs_file_unshare(file, first, last)) return false;
+    fs_copy(file, offset, (uint8_t*)buf, len, true);
+    if (fs_dedup_enabled) fs_file_dedup(file, first, last);
+    return true;
+}
+
+// Each group is its own allocation: a run is contiguous in memory only if
+// every group it crosses starts right after the end of the previous one
+static bool fs_run_contiguous(uint32_t start, uint32_t count) {
+    for (uint32_t b = (start / FS_GROUP_BLOCKS + 1) * FS_GROUP_BLOCKS; b < start + count; b += FS_GROUP_BLOCKS)
+        if (fs_block_data(b) != fs_block_data(b - 1) + FS_BLOCK_SIZE) return false;
+    return true;
+}
+
+// Contiguous read-only view of a whole file: the data in place when it is
+// contiguous (inline, hot, or one run in contiguous memory), otherwise a
+// copy the caller releases with kfree(*copy). Scans do not make files hot.
+const uint8_t* fs_view(fs_node_t* file, uint8_t** copy) {
+    *copy = NULL;
+    if (file->type != FS_FILE || !fs_file_load(file)) return NULL;
+    if ((file->flags & FS_NODE_INLINE) || file->size == 0) return (const uint8_t*)file->data;
+    if (file->flags & FS_NODE_COMPRESSED) {
+        const uint8_t* hot = fs_hot_find(file);
+        if (hot) return hot;
+        if (!(*copy = kmalloc(file->size))) return NULL;
+        if (!fs_unpack(file, *copy)) { kfree(*copy); *copy = NULL; }
+        return *copy;
+    }
+    fs_extent_t* run = &file->extents->runs[0];
+    if (file->extents->count == 1 && fs_run_contiguous(run->start, run->count)) return fs_block_data(run->start);
+    if (!(*copy = kmalloc(file->size))) return NULL;
+    fs_copy(file, 0, *copy, file->size, false);
+    return *copy;
+}
+
+// Replaces the whole content of a file
+bool fs_write_all(fs_node_t* file, const void* buf, uint32_t len) {
+    if (len < file->size && !fs_truncate(file, len)) return false;
+    return fs_write(file, 0, buf, len);
+}
+
+// Replaces the content of a file with size bytes produced by read(),
+// called once per piece of contiguous storage in file order, so sources
+// like DMA or the disk cache fill the blocks without a bounce buffer
+typedef bool (*fs_fill_fn)(void* ctx, uint8_t* buf, uint32_t len);
+
+bool fs_fill(fs_node_t* file, uint32_t size, fs_fill_fn read, void* ctx) {
+    if (!fs_truncate(file, 0) || !fs_truncate(file, size)) return false;
+    if (file->flags & FS_NODE_INLINE) return !size || read(ctx, (uint8_t*)file->data, size);
+    uint32_t left = size;
+    fs_extents_t* ext = file->extents;
+    for (uint32_t r = 0; r < ext->count && left; r++) {
+        uint32_t block = ext->runs[r].start, end = block + ext->runs[r].count;
+        while (block < end && left) {
+            uint32_t blocks = FS_GROUP_BLOCKS - block % FS_GROUP_BLOCKS;   // contiguous memory
+            if (blocks > end - block) blocks = end - block;
+            uint32_t len = blocks * FS_BLOCK_SIZE < left ? blocks * FS_BLOCK_SIZE : left;
+            if (!read(ctx, fs_block_data(block), len)) return false;
+            block += blocks;
+            left -= len;
+        }
+    }
+    if (fs_dedup_enabled) fs_file_dedup(file, 0, fs_blocks_for(size) - 1);
+    return true;
+}
+
+// Makes dst's content the same as src's without copying data (cp)
+bool fs_share_content(fs_node_t* dst, fs_node_t* src) {
+    if (dst == src || dst->type != FS_FILE || src->type != FS_FILE) return dst == src;
+    if (!fs_file_load(src) || !fs_truncate(dst, 0)) return false;
+    if (src->flags & FS_NODE_INLINE) {
+        memcpy(dst->data, src->data, src->size);
+    } else {
+        dst->flags = (dst->flags & ~FS_NODE_INLINE) | (src->flags & FS_NODE_COMPRESSED);
+        dst->extents = src->extents;
+        if (dst->extents) dst->extents->refs++;
+    }
+    dst->size = src->size;
+    fs_file_changed(dst);
+    return true;
+}
+
+// ---- Background compression ----
+// A clock sweep over every inode, a batch per idle tick. A file accessed
+// since the previous pass is hot and only loses its REFERENCED bit; a cold
+// file is compressed, and a cold compressed one leaves the hot cache.
+// A pass starts at most every FS_COLD_MS.
+#define FS_SWEEP_BATCH 64
+#define FS_SWEEP_INTERVAL_MS 20
+#define FS_COLD_MS 10000
+
+static bool fs_compress_enabled = true;
+static uint32_t fs_sweep_slab = 0, fs_sweep_slot = 0, fs_sweep_last = 0, fs_sweep_pass = 0;
+
+void fs_background() {
+    uint32_t now = time_ms();
+    if (!fs_compress_enabled || now - fs_sweep_last < FS_SWEEP_INTERVAL_MS) return;
+    fs_sweep_last = now;
+    if (fs_sweep_slab == 0 && fs_sweep_slot == 0) {
+        if (now - fs_sweep_pass < FS_COLD_MS) return;
+        fs_sweep_pass = now;
+    }
+    for (int n = 0; n < FS_SWEEP_BATCH && fs_sweep_slab < fs_slab_count; n++) {
+        fs_node_t* node = &fs_slabs[fs_sweep_slab][fs_sweep_slot];
+        if (++fs_sweep_slot == PAGE_SIZE / sizeof(fs_node_t)) { fs_sweep_slot = 0; fs_sweep_slab++; }
+        if (node->type != FS_FILE) continue;
+        if (node->flags & FS_NODE_REFERENCED) node->flags &= ~FS_NODE_REFERENCED;
+        else if (node->flags & FS_NODE_COMPRESSED) fs_hot_drop(node);
+        else if (fs_compress_candidate(node) && fs_compress(node)) break;   // one file per tick
+    }
+    if (fs_sweep_slab >= fs_slab_count) fs_sweep_slab = 0;
+}
+
+// Compresses every eligible file now, hot or not; returns how many
+uint32_t fs_compress_all() {
+    uint32_t count = 0;
+    for (uint32_t s = 0; s < fs_slab_count; s++)
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(fs_node_t); i++) {
+            fs_node_t* node = &fs_slabs[s][i];
+            if (node->type == FS_FILE && fs_compress_candidate(node) && fs_compress(node)) count++;
+        }
+    return count;
+}
+
+// ---- Inode maps ----
+// Per-file state kept outside the 64-byte inode: an open-addressing map
+// from inode to a number, kept at most half full.
+typedef struct { fs_node_t* node; uint32_t value; } fs_map_entry_t;
+typedef struct { fs_map_entry_t* slots; uint32_t size, count; } fs_map_t;
+
+static inline uint32_t fs_ptr_hash(fs_node_t* node) { return (uint32_t)((size_t)node / sizeof(fs_node_t)) * 2654435761u; }
+
+static fs_map_entry_t* fs_map_find(fs_map_t* m, fs_node_t* node) {
+    if (!m->size) return NULL;
+    for (uint32_t i = fs_ptr_hash(node) & (m->size - 1); m->slots[i].node; i = (i + 1) & (m->size - 1))
+        if (m->slots[i].node == node) return &m->slots[i];
+    return NULL;
+}
+
+// Makes room for one more entry
+static bool fs_map_reserve(fs_map_t* m) {
+    if ((m->count + 1) * 2 <= m->size) return true;
+    uint32_t size = m->size ? m->size * 2 : 256;
+    fs_map_entry_t* slots = kmalloc(size * sizeof(fs_map_entry_t));
+    if (!slots) return false;
+    memset(slots, 0, size * sizeof(fs_map_entry_t));
+    for (uint32_t i = 0; i < m->size; i++) {
+        if (!m->slots[i].node) continue;
+        uint32_t j = fs_ptr_hash(m->slots[i].node) & (size - 1);
+        while (slots[j].node) j = (j + 1) & (size - 1);
+        slots[j] = m->slots[i];
+    }
+    kfree(m->slots);
+    m->slots = slots;
+    m->size = size;
+    return true;
+}
+
+// Adds a node that is not in the map yet; requires fs_map_reserve()
+static void fs_map_put(fs_map_t* m, fs_node_t* node, uint32_t value) {
+    uint32_t i = fs_ptr_hash(node) & (m->size - 1);
+    while (m->slots[i].node) i = (i + 1) & (m->size - 1);
+    m->slots[i].node = node;
+    m->slots[i].value = value;
+    m->count++;
+}
+
+// Removes an entry, shifting back the ones probed past it
+static void fs_map_remove(fs_map_t* m, fs_map_entry_t* e) {
+    uint32_t hole = e - m->slots, i = hole;
+    m->slots[hole].node = NULL;
+    m->count--;
+    for (;;) {
+        i = (i + 1) & (m->size - 1);
+        if (!m->slots[i].node) return;
+        uint32_t home = fs_ptr_hash(m->slots[i].node) & (m->size - 1);
+        if (((i - home) & (m->size - 1)) >= ((i - hole) & (m->size - 1))) {
+            m->slots[hole] = m->slots[i];
+            m->slots[i].node = NULL;
+            hole = i;
+        }
+    }
+}
+
+static void fs_map_clear(fs_map_t* m) {
+    kfree(m->slots);
+    m->slots = NULL;
+    m->size = m->count = 0;
+}
+
+// ==================== TRIGRAM INDEX ====================
+// Optional full-text index: each trigram (3 consecutive bytes) maps to the
+// sorted list of documents containing it, delta + varint encoded. A file
+// gets a fresh document id whenever it is (re)indexed, so lists only grow
+// at their end; its previous id goes stale and is dropped at query time,
+// and the index is rebuilt once stale ids outnumber live ones. Writes
+// only queue the file: the queue is drained in the background and before
+// every query, so results are always exact.
+#define IX_EMPTY 0xFFFFFFFF
+#define IX_MAX_QUERY 64
+
+typedef struct {
+    uint32_t count, last, used, capacity;
+    uint8_t data[];
+} ix_list_t;
+
+typedef struct { uint32_t trigram; ix_list_t* list; } ix_slot_t;
+
+static bool ix_enabled = false, ix_ok = false;
+static ix_slot_t* ix_table = NULL;           // trigram -> list, linear probing
+static uint32_t ix_table_size = 0, ix_trigrams = 0;
+static fs_node_t** ix_docs = NULL;           // document id -> file, NULL once stale
+static uint32_t ix_doc_count = 0, ix_doc_capacity = 0, ix_live = 0;
+static fs_map_t ix_refs;                     // file -> its live document id
+static fs_node_t** ix_queue = NULL;          // files changed since indexed
+static uint32_t ix_queue_count = 0, ix_queue_capacity = 0;
+static uint32_t ix_list_bytes = 0, ix_last_query_us = 0, ix_last_candidates = 0, ix_rebuilds = 0;
+
+// The file's document, if any, goes stale
+static void ix_forget(fs_node_t* file) {
+    fs_map_entry_t* ref = fs_map_find(&ix_refs, file);
+    if (!ref) return;
+    ix_docs[ref->value] = NULL;
+    ix_live--;
+    fs_map_remove(&ix_refs, ref);
+}
+
+static void ix_file_changed(fs_node_t* file) {
+    if (!ix_enabled || (file->flags & FS_NODE_UNINDEXED)) return;
+    if (ix_queue_count == ix_queue_capacity) {
+        uint32_t capacity = ix_queue_capacity ? ix_queue_capacity * 2 : 64;
+        fs_node_t** queue = krealloc(ix_queue, capacity * sizeof(fs_node_t*));
+        if (!queue) { ix_ok = false; return; }   // rebuilt before the next query
+        ix_queue = queue;
+        ix_queue_capacity = capacity;
+    }
+    file->flags |= FS_NODE_UNINDEXED;
+    ix_queue[ix_queue_count++] = file;
+}
+
+static ix_slot_t* ix_slot(uint32_t trigram) {
+    for (uint32_t i = (trigram * 2654435761u) & (ix_table_size - 1); ; i = (i + 1) & (ix_table_size - 1))
+        if (ix_table[i].trigram == trigram || ix_table[i].trigram == IX_EMPTY) return &ix_table[i];
+}
+
+static bool ix_table_grow() {
+    uint32_t old_size = ix_table_size;
+    ix_slot_t* old = ix_table;
+    uint32_t size = old_size ? old_size * 2 : 4096;
+    ix_slot_t* table = kmalloc(size * sizeof(ix_slot_t));
+    if (!table) return false;
+    memset(table, 0xFF, size * sizeof(ix_slot_t));
+    ix_table = table;
+    ix_table_size = size;
+    for (uint32_t i = 0; i < old_size; i++)
+        if (old[i].trigram != IX_EMPTY) *ix_slot(old[i].trigram) = old[i];
+    kfree(old);
+    return true;
+}
+
+static bool ix_add(uint32_t trigram, uint32_t id) {
+    if (ix_trigrams * 2 >= ix_table_size && !ix_table_grow()) return false;
+    ix_slot_t* slot = ix_slot(trigram);
+    ix_list_t* list = slot->trigram == IX_EMPTY ? NULL : slot->list;
+    if (list && list->count && list->last == id) return true;
+    if (!list || list->used + 5 > list->capacity) {
+        uint32_t capacity = list ? list->capacity * 2 : 8;
+        ix_list_t* grown = krealloc(list, sizeof(ix_list_t) + capacity);
+        if (!grown) return false;
+        if (!list) {
+            grown->count = grown->last = grown->used = 0;
+            slot->trigram = trigram;
+            ix_trigrams++;
+            ix_list_bytes += sizeof(ix_list_t);
+        }
+        ix_list_bytes += capacity - (list ? list->capacity : 0);
+        grown->capacity = capacity;
+        slot->list = list = grown;
+    }
+    uint32_t delta = id - (list->count ? list->last : 0);
+    while (delta >= 0x80) { list->data[list->used++] = delta | 0x80; delta >>= 7; }
+    list->data[list->used++] = delta;
+    list->count++;
+    list->last = id;
+    return true;
+}
+
+static bool ix_index_file(fs_node_t* file) {
+    ix_forget(file);
+    if (file->size < 3) return true;
+    if (ix_doc_count == ix_doc_capacity) {
+        uint32_t capacity = ix_doc_capacity ? ix_doc_capacity * 2 : 256;
+        fs_node_t** docs = krealloc(ix_docs, capacity * sizeof(fs_node_t*));
+        if (!docs) return false;
+        ix_docs = docs;
+        ix_doc_capacity = capacity;
+    }
+    if (!fs_map_reserve(&ix_refs)) return false;
+    uint8_t* copy;
+    const uint8_t* data = fs_view(file, &copy);
+    if (!data) return false;
+    uint32_t id = ix_doc_count++;
+    uint32_t trigram = data[0] << 8 | data[1] << 16;
+    bool ok = true;
+    for (uint32_t i = 2; i < file->size && ok; i++) {
+        trigram = trigram >> 8 | (uint32_t)data[i] << 16;
+        ok = ix_add(trigram, id);
+    }
+    kfree(copy);
+    ix_docs[id] = file;
+    ix_live++;
+    fs_map_put(&ix_refs, file, id);
+    return ok;
+}
+
+static void ix_clear() {
+    for (uint32_t i = 0; i < ix_table_size; i++) if (ix_table[i].trigram != IX_EMPTY) kfree(ix_table[i].list);
+    kfree(ix_table); kfree(ix_docs); kfree(ix_queue);
+    fs_map_clear(&ix_refs);
+    ix_table = NULL; ix_docs = NULL; ix_queue = NULL;
+    ix_table_size = ix_trigrams = ix_doc_count = ix_doc_capacity = ix_live = 0;
+    ix_queue_count = ix_queue_capacity = ix_list_bytes = 0;
+    for (uint32_t s = 0; s < fs_slab_count; s++)
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(fs_node_t); i++) fs_slabs[s][i].flags &= ~FS_NODE_UNINDEXED;
+}
+
+static void ix_rebuild() {
+    ix_clear();
+    ix_ok = true;
+    ix_rebuilds++;
+    for (uint32_t s = 0; s < fs_slab_count && ix_ok; s++)
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(fs_node_t) && ix_ok; i++)
+            if (fs_slabs[s][i].type == FS_FILE) ix_ok = ix_index_file(&fs_slabs[s][i]);
+}
+
+// Indexes up to `max` queued files; false if the index is unusable
+static bool ix_drain(uint32_t max) {
+    if (!ix_enabled) return false;
+    if (!ix_ok || ix_doc_count - ix_live > ix_live + 1024) ix_rebuild();
+    while (ix_ok && ix_queue_count && max--) {
+        fs_node_t* file = ix_queue[--ix_queue_count];
+        if (file->type != FS_FILE || !(file->flags & FS_NODE_UNINDEXED)) continue;
+        file->flags &= ~FS_NODE_UNINDEXED;
+        ix_ok = ix_index_file(file);
+    }
+    return ix_ok;
+}
+
+void ix_background() {
+    if (ix_enabled && ix_queue_count) ix_drain(8);
+}
+
+void ix_set_enabled(bool on) {
+    ix_enabled = on;
+    if (on) ix_rebuild();
+    else { ix_clear(); ix_ok = false; }
+}
+
+static const uint8_t* ix_decode(const uint8_t* p, uint32_t* value) {
+    uint32_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+        v |= (uint32_t)(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)) break;
+    }
+    *value += v;
+    return p;
+}
+
+// Files that may contain every trigram, in document order: the shortest
+// list is decoded and intersected with each of the others by a merge.
+// Returns NULL when the index cannot answer; the caller frees the array.
+fs_node_t** ix_candidates(const uint32_t* trigrams, uint32_t n, uint32_t* count) {
+    if (!n || !ix_drain(0xFFFFFFFF)) return NULL;
+    ix_list_t* lists[IX_MAX_QUERY];
+    for (uint32_t i = 0; i < n; i++) {
+        ix_slot_t* slot = ix_slot(trigrams[i]);
+        lists[i] = slot->trigram == IX_EMPTY ? NULL : slot->list;
+        if (!lists[i]) { *count = 0; return kmalloc(sizeof(fs_node_t*)); }
+        for (uint32_t j = i; j > 0 && lists[j]->count < lists[j - 1]->count; j--) {
+            ix_list_t* t = lists[j]; lists[j] = lists[j - 1]; lists[j - 1] = t;
+        }
+    }
+    uint32_t* ids = kmalloc(lists[0]->count * sizeof(uint32_t));
+    fs_node_t** files = kmalloc(lists[0]->count * sizeof(fs_node_t*));
+    if (!ids || !files) { kfree(ids); kfree(files); return NULL; }
+    uint32_t found = 0, id = 0;
+    const uint8_t* p = lists[0]->data;
+    for (uint32_t k = 0; k < lists[0]->count; k++) {
+        p = ix_decode(p, &id);
+        if (ix_docs[id]) ids[found++] = id;
+    }
+    for (uint32_t i = 1; i < n && found; i++) {
+        uint32_t kept = 0, other = 0, left = lists[i]->count - 1;
+        p = ix_decode(lists[i]->data, &other);
+        for (uint32_t k = 0; k < found; k++) {
+            while (other < ids[k] && left) { p = ix_decode(p, &other); left--; }
+            if (other == ids[k]) ids[kept++] = ids[k];
+            else if (other < ids[k]) break;
+        }
+        found = kept;
+    }
+    for (uint32_t k = 0; k < found; k++) files[k] = ix_docs[ids[k]];
+    kfree(ids);
+    *count = found;
+    return files;
+}
+
+// Trigrams every match must contain: those of the literal runs of a plain
+// string, or of a regex's top-level literals when it has no alternation.
+// 0 when unsure, grep then scans every file.
+uint32_t ix_query_trigrams(const char* pattern, bool regex, uint32_t* out) {
+    char run[SEARCH_MAX + 1];
+    uint32_t len = 0, n = 0;
+    int depth = 0;
+    if (regex && strchr(pattern, '|')) return 0;
+    for (const char* p = pattern; ; p++) {
+        char c = *p;
+        bool literal = c != 0, restart = false;
+        if (regex && c) {
+            literal = false;
+            if (c == '\\' && p[1]) {
+                literal = !strchr("dDwWsS", p[1]);
+                c = re_escape_char(*++p);
+            }
+            else if (c == '(') depth++;
+            else if (c == ')') depth--;
+            else if (c == '[') {          // as re_parse_class: ] first is literal, escapes
+                p += p[1] == '^' ? 2 : 1;
+                const char* first = p;
+                while (*p && (*p != ']' || p == first)) p += *p == '\\' && p[1] ? 2 : 1;
+                if (!*p) return 0;
+            }
+            else if (c == '{') {          // {m,n}: its digits are not text
+                while (*p && *p != '}') p++;
+                if (!*p) return 0;
+            }
+            else literal = !strchr(".^$*+?}", c);
+            if (depth > 0 || (p[1] && strchr("*?{", p[1]))) literal = false;
+            restart = literal && p[1] == '+';
+        }
+        if (literal && len < SEARCH_MAX) run[len++] = c;
+        if (!literal || restart) {
+            for (uint32_t i = 0; i + 2 < len && n < IX_MAX_QUERY; i++) {
+                uint32_t t = (uint8_t)run[i] | (uint8_t)run[i + 1] << 8 | (uint32_t)(uint8_t)run[i + 2] << 16, k = 0;
+                while (k < n && out[k] != t) k++;
+                if (k == n) out[n++] = t;
+            }
+            len = 0;
+            if (restart) run[len++] = c;
+        }
+        if (!*p) break;
+    }
+    return n;
+}
+
+// ==================== FILE SYSTEM ====================
+#define FS_HASH_SEED 2166136261u
+
+static uint32_t fs_hash_str(uint32_t hash, const char* str) {
+    while (*str) {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Name string table: every distinct name is stored once, refcounted
+typedef struct fs_name {
+    struct fs_name* next;
+    uint32_t hash;
+    uint32_t refs;
+    char str[];
+} fs_name_t;
+
+static fs_name_t** fs_names = NULL;
+static uint32_t fs_name_buckets = 0, fs_name_count = 0;
+
+#define FS_NAME(str) ((fs_name_t*)((str) - __builtin_offsetof(fs_name_t, str)))
+
+static void fs_names_grow() {
+    uint32_t buckets = fs_name_buckets ? fs_name_buckets * 2 : 256;
+    fs_name_t** table = kmalloc(buckets * sizeof(fs_name_t*));
+    if (!table) return;
+    memset(table, 0, buckets * sizeof(fs_name_t*));
+    for (uint32_t i = 0; i < fs_name_buckets; i++) {
+        fs_name_t* n = fs_names[i];
+        while (n) {
+            fs_name_t* next = n->next;
+            n->next = table[n->hash & (buckets - 1)];
+            table[n->hash & (buckets - 1)] = n;
+            n = next;
+        }
+    }
+    kfree(fs_names);
+    fs_names = table;
+    fs_name_buckets = buckets;
+}
+
+const char* fs_intern(const char* str) {
+    if (fs_name_count >= fs_name_buckets) fs_names_grow();
+    if (!fs_names) return NULL;
+    uint32_t hash = fs_hash_str(FS_HASH_SEED, str);
+    fs_name_t** bucket = &fs_names[hash & (fs_name_buckets - 1)];
+    for (fs_name_t* n = *bucket; n; n = n->next) {
+        if (n->hash == hash && strcmp(n->str, str) == 0) { n->refs++; return n->str; }
+    }
+    fs_name_t* n = kmalloc(sizeof(fs_name_t) + strlen(str) + 1);
+    if (!n) return NULL;
+    n->hash = hash; n->refs = 1;
+    strcpy(n->str, str);
+    n->next = *bucket;
+    *bucket = n;
+    fs_name_count++;
+    return n->str;
+}
+
+void fs_release_name(const char* str) {
+    if (!str) return;
+    fs_name_t* name = FS_NAME(str);
+    if (--name->refs > 0) return;
+    fs_name_t** link = &fs_names[name->hash & (fs_name_buckets - 1)];
+    while (*link != name) link = &(*link)->next;
+    *link = name->next;
+    fs_name_count--;
+    kfree(name);
+}
+
+static inline uint32_t fs_name_hash(const char* str) { return FS_NAME(str)->hash; }
+
+static inline uint32_t fs_child_count(fs_node_t* dir) {
+    return dir->type == FS_DIRECTORY && dir->entries ? dir->entries->count : 0;
+}
+
+static inline fs_node_t* fs_child(fs_node_t* dir, uint32_t i) { return dir->entries->nodes[i]; }
+
+fs_node_t* fs_find_child(fs_node_t* parent, const char* name) {
+    if (!parent || parent->type != FS_DIRECTORY || !parent->entries) return NULL;
+    fs_dir_t* dir = parent->entries;
+    uint32_t hash = fs_hash_str(FS_HASH_SEED, name);
+    for (uint32_t i = 0; i < dir->count; i++) {
+        if (dir->hashes[i] == hash && strcmp(dir->nodes[i]->name, name) == 0) return dir->nodes[i];
+    }
+    return NULL;
+}
+
+// ==================== PATH CACHE ====================
+// Two caches sit in front of the tree walk:
+//  - component cache: (parent, name) -> child, including negative entries
+//  - path cache: (base dir, full path string) -> node, so a hot path is one lookup
+// Entries are dropped precisely by fs_create_node / fs_unlink_child / fs_rename.
+#define DCACHE_SIZE 512
+#define PCACHE_SIZE 128
+
+typedef struct {
+    fs_node_t* parent;
+    fs_node_t* node;        // NULL = negative entry
+    uint32_t hash;
+    bool valid;
+    char name[MAX_FILENAME];
+} dcache_entry_t;
+
+typedef struct {
+    fs_node_t* base;        // fs_root for absolute paths, current_dir otherwise
+    fs_node_t* node;        // NULL = negative entry
+    fs_node_t* miss_dir;    // negative entry: node where the walk stopped
+    uint32_t miss_hash;     // negative entry: hash of the missing component
+    uint32_t hash;
+    bool valid;
+    char path[MAX_PATH];
+} pcache_entry_t;
+
+static dcache_entry_t dcache[DCACHE_SIZE];
+static pcache_entry_t pcache[PCACHE_SIZE];
+static uint32_t dcache_hits = 0, dcache_misses = 0;
+static uint32_t pcache_hits = 0, pcache_misses = 0;
+
+static uint32_t fs_hash_ptr(const void* ptr) {
+    uint32_t hash = FS_HASH_SEED ^ (uint32_t)(size_t)ptr;
+    return hash * 16777619u;
+}
+
+// True if node is ancestor or node itself
+static bool fs_is_within(fs_node_t* node, fs_node_t* ancestor) {
+    while (node) {
+        if (node == ancestor) return true;
+        node = node->parent;
+    }
+    return false;
+}
+
+void dcache_reset() {
+    memset(dcache, 0, sizeof(dcache));
+    memset(pcache, 0, sizeof(pcache));
+    dcache_hits = dcache_misses = pcache_hits = pcache_misses = 0;
+}
+
+static dcache_entry_t* dcache_slot(fs_node_t* parent, const char* name, uint32_t* hash) {
+    *hash = fs_hash_str(fs_hash_ptr(parent), name);
+    return &dcache[*hash & (DCACHE_SIZE - 1)];
+}
+
+// Cached fs_find_child()
+fs_node_t* fs_lookup(fs_node_t* parent, const char* name) {
+    if (!parent || parent->type != FS_DIRECTORY) return NULL;
+    uint32_t hash;
+    dcache_entry_t* e = dcache_slot(parent, name, &hash);
+    if (e->valid && e->hash == hash && e->parent == parent && strcmp(e->name, name) == 0) {
+        dcache_hits++;
+        return e->node;
+    }
+    dcache_misses++;
+    fs_node_t* node = fs_find_child(parent, name);
+    if (strlen(name) < MAX_FILENAME) {
+        e->parent = parent; e->node = node; e->hash = hash; e->valid = true;
+        strcpy(e->name, name);
+    }
+    return node;
+}
+
+// A name appeared in parent: refresh the component entry and drop
+// negative paths that stopped exactly on that name.
+static void dcache_node_added(fs_node_t* parent, fs_node_t* node) {
+    uint32_t hash;
+    dcache_entry_t* e = dcache_slot(parent, node->name, &hash);
+    e->parent = parent; e->node = node; e->hash = hash; e->valid = true;
+    strcpy(e->name, node->name);
+
+    uint32_t miss_hash = fs_name_hash(node->name);
+    for (int i = 0; i < PCACHE_SIZE; i++) {
+        pcache_entry_t* p = &pcache[i];
+        if (p->valid && !p->node && p->miss_dir == parent && p->miss_hash == miss_hash) p->valid = false;
+    }
+}
+
+// node is leaving its parent (remove or rename): every entry that
+// resolved through it, started from it or stopped under it is stale.
+static void dcache_node_removed(fs_node_t* node) {
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        dcache_entry_t* e = &dcache[i];
+        if (e->valid && (e->node == node || fs_is_within(e->parent, node))) e->valid = false;
+    }
+    for (int i = 0; i < PCACHE_SIZE; i++) {
+        pcache_entry_t* p = &pcache[i];
+        if (!p->valid) continue;
+        if (fs_is_within(p->base, node) ||
+            (p->node && fs_is_within(p->node, node)) ||
+            (!p->node && fs_is_within(p->miss_dir, node))) p->valid = false;
+    }
+}
+
+// Inodes come from page-sized slabs; freed ones go back on fs_free_nodes
+static fs_node_t* fs_alloc_node() {
+    if (!fs_free_nodes) {
+        fs_node_t** slabs = krealloc(fs_slabs, (fs_slab_count + 1) * sizeof(fs_node_t*));
+        if (!slabs) return NULL;
+        fs_slabs = slabs;
+        fs_node_t* slab = kpage_alloc(1);
+        if (!slab) return NULL;
+        memset(slab, 0, PAGE_SIZE);
+        fs_slabs[fs_slab_count++] = slab;
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(fs_node_t); i++) {
+            slab[i].parent = fs_free_nodes;
+            fs_free_nodes = &slab[i];
+        }
+    }
+    fs_node_t* node = fs_free_nodes;
+    fs_free_nodes = node->parent;
+    memset(node, 0, sizeof(fs_node_t));
+    fs_node_count++;
+    return node;
+}
+
+static void fs_free_node(fs_node_t* node) {
+    if (node->type == FS_DIRECTORY) kfree(node->entries);
+    else fs_truncate(node, 0);
+    fs_release_name(node->name);
+    ix_forget(node);
+    dk_forget(node);
+    node->type = 0;
+    node->parent = fs_free_nodes;
+    fs_free_nodes = node;
+    fs_node_count--;
+}
+
+// Entry arrays share one allocation: header, hashes[capacity], nodes[capacity]
+static bool fs_dir_reserve(fs_node_t* parent) {
+    fs_dir_t* dir = parent->entries;
+    if (dir && dir->count < dir->capacity) return true;
+    uint32_t capacity = dir ? dir->capacity * 2 : 4;
+    fs_dir_t* grown = kmalloc(sizeof(fs_dir_t) + capacity * (sizeof(uint32_t) + sizeof(fs_node_t*)));
+    if (!grown) return false;
+    grown->count = dir ? dir->count : 0;
+    grown->capacity = capacity;
+    grown->nodes = (fs_node_t**)(grown + 1);
+    grown->hashes = (uint32_t*)(grown->nodes + capacity);
+    if (dir) {
+        memcpy(grown->nodes, dir->nodes, dir->count * sizeof(fs_node_t*));
+        memcpy(grown->hashes, dir->hashes, dir->count * sizeof(uint32_t));
+        kfree(dir);
+    }
+    parent->entries = grown;
+    return true;
+}
+
+static void fs_dir_append(fs_node_t* parent, fs_node_t* node) {
+    fs_dir_t* dir = parent->entries;
+    dir->hashes[dir->count] = fs_name_hash(node->name);
+    dir->nodes[dir->count] = node;
+    dir->count++;
+}
+
+fs_node_t* fs_create_node(const char* name, fs_node_type type, fs_node_t* parent) {
+    if (strlen(name) >= MAX_FILENAME) return NULL;
+    if (parent && !fs_dir_reserve(parent)) return NULL;
+    fs_node_t* node = fs_alloc_node();
+    if (!node) return NULL;
+    node->name = fs_intern(name);
+    if (!node->name) { fs_free_node(node); return NULL; }
+    node->type = type; node->size = 0; node->extents = NULL;
+    if (type == FS_FILE) node->flags = FS_NODE_INLINE;
+    node->parent = parent; node->permissions = 0x75;
+    if (parent) {
+        fs_dir_append(parent, node);
+        dcache_node_added(parent, node);
+    }
+    fs_changed = true;
+    return node;
+}
+
+void fs_unlink_child(fs_node_t* parent, fs_node_t* node) {
+    fs_dir_t* dir = parent->entries;
+    for (uint32_t i = 0; i < fs_child_count(parent); i++) {
+        if (dir->nodes[i] == node) {
+            dcache_node_removed(node);
+            for (uint32_t j = i; j + 1 < dir->count; j++) {
+                dir->nodes[j] = dir->nodes[j + 1];
+                dir->hashes[j] = dir->hashes[j + 1];
+            }
+            dir->count--;
+            return;
+        }
+    }
+}
+
+bool fs_rename(fs_node_t* node, fs_node_t* new_parent, const char* new_name) {
+    if (!node || node == fs_root || !new_parent || new_parent->type != FS_DIRECTORY) return false;
+    if (strlen(new_name) >= MAX_FILENAME || fs_find_child(new_parent, new_name)) return false;
+    if (fs_is_within(new_parent, node)) return false;  // can't move a dir under itself
+    if (!fs_dir_reserve(new_parent)) return false;
+    const char* name = fs_intern(new_name);
+    if (!name) return false;
+    fs_unlink_child(node->parent, node);
+    fs_release_name(node->name);
+    node->name = name;
+    node->parent = new_parent;
+    fs_dir_append(new_parent, node);
+    dcache_node_added(new_parent, node);
+    fs_changed = true;
+    return true;
+}
+
+// Removes a file or an empty directory and recycles its inode
+bool fs_remove_node(fs_node_t* node) {
+    if (!node || node == fs_root || !node->parent) return false;
+    if (fs_child_count(node) > 0) return false;
+    if (fs_is_within(current_dir, node)) return false;
+    fs_unlink_child(node->parent, node);
+    fs_free_node(node);
+    return true;
+}
+
+fs_node_t* fs_resolve_path(const char* path) {
+    if (!path || !*path) return current_dir;
+    fs_node_t* base = path[0] == '/' ? fs_root : current_dir;
+    uint32_t hash = fs_hash_str(fs_hash_ptr(base), path);
+    pcache_entry_t* e = &pcache[hash & (PCACHE_SIZE - 1)];
+    if (e->valid && e->hash == hash && e->base == base && strcmp(e->path, path) == 0) {
+        pcache_hits++;
+        return e->node;
+    }
+    pcache_misses++;
+
+    // Walk component by component through the component cache
+    fs_node_t* node = base;
+    fs_node_t* miss_dir = NULL;
+    uint32_t miss_hash = 0;
+    bool cacheable = strlen(path) < MAX_PATH;
+    char name[MAX_FILENAME];
+    const char* p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        size_t len = 0;
+        while (p[len] && p[len] != '/') len++;
+        if (len >= MAX_FILENAME) { node = NULL; cacheable = false; break; }
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+
+        if (strcmp(name, ".") == 0) continue;
+        if (strcmp(name, "..") == 0) {
+            // Result depends on where nodes currently live; keep it out of the path cache
+            cacheable = false;
+            if (node->parent) node = node->parent;
+            continue;
+        }
+        fs_node_t* child = fs_lookup(node, name);
+        if (!child) {
+            miss_dir = node;
+            miss_hash = fs_hash_str(FS_HASH_SEED, name);
+            node = NULL;
+            break;
+        }
+        node = child;
+    }
+
+    if (cacheable) {
+        e->base = base; e->node = node; e->hash = hash; e->valid = true;
+        e->miss_dir = miss_dir; e->miss_hash = miss_hash;
+        strcpy(e->path, path);
+    }
+    return node;
+}
+
+// Parent directory of path, with the last component copied into name
+fs_node_t* fs_resolve_parent(const char* path, char* name) {
+    const char* slash = NULL;
+    for (const char* p = path; *p; p++) if (*p == '/') slash = p;
+    const char* last = slash ? slash + 1 : path;
+    if (strlen(last) >= MAX_FILENAME) return NULL;
+    strcpy(name, last);
+    if (!slash) return current_dir;
+    if (slash == path) return fs_root;
+    char dir[MAX_PATH];
+    size_t len = slash - path;
+    if (len >= MAX_PATH) return NULL;
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    return fs_resolve_path(dir);
+}
+
+// The node at path, or a new empty file there; NULL when its directory
+// does not exist
+fs_node_t* fs_open_file(const char* path) {
+    fs_node_t* node = fs_resolve_path(path);
+    char name[MAX_FILENAME];
+    fs_node_t* dir = node ? NULL : fs_resolve_parent(path, name);
+    if (dir && dir->type == FS_DIRECTORY && name[0]) node = fs_create_node(name, FS_FILE, dir);
+    return node;
+}
+
+void cmd_dcache() {
+    term_setcolor(0x0F);
+    term_write("Path cache:      ");
+    term_setcolor(0x07);
+    term_write_dec(pcache_hits); term_write(" hits, ");
+    term_write_dec(pcache_misses); term_write(" misses\n");
+    term_setcolor(0x0F);
+    term_write("Component cache: ");
+    term_setcolor(0x07);
+    term_write_dec(dcache_hits); term_write(" hits, ");
+    term_write_dec(dcache_misses); term_write(" misses\n");
+}
+
+void fs_get_path(fs_node_t* node, char* buffer) {
+    if (!node || node == fs_root) { strcpy(buffer, "/"); return; }
+    char temp[MAX_PATH];
+    char* p = temp + MAX_PATH - 1;
+    *p = '\0';
+    while (node && node != fs_root) {
+        size_t len = strlen(node->name);
+        if ((size_t)(p - temp) < len + 1) break;   // deeper than MAX_PATH: keep the tail
+        p -= len; memcpy(p, node->name, len);
+        p--; *p = '/';
+        node = node->parent;
+    }
+    strcpy(buffer, p);
+}
+
+// Preorder walk of a subtree with an explicit stack, so depth is bounded
+// by memory rather than the kernel stack
+typedef struct { fs_node_t* dir; uint32_t next; } fs_walk_frame_t;
+typedef struct {
+    fs_walk_frame_t* stack;
+    uint32_t depth, capacity;
+    fs_node_t* pending;
+} fs_walk_t;
+
+void fs_walk_begin(fs_walk_t* w, fs_node_t* root) {
+    w->stack = NULL;
+    w->depth = w->capacity = 0;
+    w->pending = root;
+}
+
+// Subtrees that cannot be pushed for lack of memory are skipped
+static fs_node_t* fs_walk_enter(fs_walk_t* w, fs_node_t* node) {
+    if (!fs_child_count(node)) return node;
+    if (w->depth == w->capacity) {
+        uint32_t capacity = w->capacity ? w->capacity * 2 : 16;
+        fs_walk_frame_t* stack = krealloc(w->stack, capacity * sizeof(fs_walk_frame_t));
+        if (!stack) return node;
+        w->stack = stack;
+        w->capacity = capacity;
+    }
+    w->stack[w->depth].dir = node;
+    w->stack[w->depth].next = 0;
+    w->depth++;
+    return node;
+}
+
+fs_node_t* fs_walk_next(fs_walk_t* w) {
+    if (w->pending) {
+        fs_node_t* node = w->pending;
+        w->pending = NULL;
+        return fs_walk_enter(w, node);
+    }
+    while (w->depth) {
+        fs_walk_frame_t* top = &w->stack[w->depth - 1];
+        if (top->next < fs_child_count(top->dir)) return fs_walk_enter(w, fs_child(top->dir, top->next++));
+        w->depth--;
+    }
+    return NULL;
+}
+
+void fs_walk_end(fs_walk_t* w) { kfree(w->stack); w->stack = NULL; }
+
+void fs_init() {
+    fs_node_count = 0;
+    dcache_reset();
+    fs_root = fs_create_node("/", FS_DIRECTORY, NULL);
+    current_dir = fs_root;
     
     // Standard directories
     fs_create_node("home", FS_DIRECTORY, fs_root);
@@ -433,99 +2940,1772 @@ void fs_init() {
     fs_node_t* etc = fs_find_child(fs_root, "etc");
     if (etc) {
         fs_node_t* motd = fs_create_node("motd", FS_FILE, etc);
-        if (motd && (size_t)file_data_used + 100 < sizeof(file_data_pool)) {
+        if (motd) {
             const char* content = "🎉 Welcome to HybridOS Ultimate v2.0!\n🚀 The Complete Operating System Experience\n\n✨ Features loaded:\n- FileSystem with full Unix commands\n- Integrated text editor\n- Graphics mode and games\n- Process management\n- Network stack\n- BASIC interpreter and C compiler\n- Real-time clock\n- Command history and autocompletion\n\nType 'help' to see all commands!\n";
-            motd->content = &file_data_pool[file_data_used];
-            strcpy(motd->content, content);
-            motd->size = strlen(content);
-            file_data_used += motd->size + 1;
+            fs_write(motd, 0, content, strlen(content));
+        }
+        
+        fs_node_t* version = fs_create_node("version", FS_FILE, etc);
+        if (version) {
+            const char* content = "HybridOS Ultimate v2.0\nKernel: 5.0-hybrid-ultimate\nBuild: Complete Edition\nFeatures: ALL\n";
+            fs_write(version, 0, content, strlen(content));
+        }
+    }
+    
+    // User home - CORRIGÉ: casts pour éviter warnings  
+    fs_node_t* home = fs_find_child(fs_root, "home");
+    if (home) {
+        fs_node_t* user = fs_create_node("user", FS_DIRECTORY, home);
+        if (user) {
+            fs_node_t* readme = fs_create_node("readme.txt", FS_FILE, user);
+            if (readme) {
+                const char* content = "🎯 HybridOS Ultimate v2.0 - COMPLETE FEATURES GUIDE\n"
+                "================================================================\n\n"
+                "📁 FILE SYSTEM COMMANDS:\n"
+                "  ls [path]         - List files and directories\n"
+                "  cd <path>         - Change directory (try 'cd ..' or 'cd /')\n"
+                "  pwd               - Show current directory\n"
+                "  mkdir <name>      - Create directory\n"
+                "  touch <name>      - Create empty file\n"
+                "  cat <file>        - Display file contents\n"
+                "  cp <src> <dest>   - Copy file\n"
+                "  mv <old> <new>    - Move/rename file\n"
+                "  rm <file>         - Remove file\n"
+                "  find [dir] <glob> - Search for files by name\n"
+                "  grep [-rcn] <text> <path> - Search in files\n\n"
+                "✍️ TEXT EDITOR:\n"
+                "  edit <file> [line] - Open built-in editor\n"
+                "  Arrows, Home/End, PgUp/PgDn - Move around\n"
+                "  Ctrl+S           - Save file\n"
+                "  Ctrl+X           - Exit editor\n\n"
+                "🎮 GAMES & GRAPHICS:\n"
+                "  snake            - Snake game (WASD to move, Q to quit)\n"
+                "  pong             - Pong game (WS for paddle)\n"
+                "  graphics         - VGA graphics mode demo\n"
+                "  matrix           - Matrix digital rain effect\n\n"
+                "🔧 SYSTEM MANAGEMENT:\n"
+                "  ps               - List running processes\n"
+                "  kill <pid>       - Terminate process\n"
+                "  reboot           - Restart system\n"
+                "  clear            - Clear screen\n\n"
+                "🌐 NETWORK TOOLS:\n"
+                "  ping <host>      - Ping a host\n"
+                "  http             - Start HTTP server\n\n"
+                "💻 DEVELOPMENT:\n"
+                "  compile <file.c> - C compiler\n"
+                "  basic <code>     - BASIC interpreter\n"
+                "  run <program>    - Execute program\n\n"
+                "⌨️ INTERFACE FEATURES:\n"
+                "  ↑↓ Arrow keys   - Command history\n"
+                "  Tab             - Command autocompletion\n"
+                "  Real-time clock - Top right corner\n"
+                "  Colored output  - Full VGA colors\n\n"
+                "🎯 TRY THESE DEMOS:\n"
+                "  cd /etc && cat motd\n"
+                "  edit hello.c\n"
+                "  snake\n"
+                "  graphics\n"
+                "  matrix\n\n"
+                "💡 This file was created by the filesystem!\n"
+                "Edit it with: edit readme.txt\n";
+                fs_write(readme, 0, content, strlen(content));
+            }
+            
+            fs_node_t* demo = fs_create_node("demo.c", FS_FILE, user);
+            if (demo) {
+                const char* content = "#include <stdio.h>\n\nint main() {\n    printf(\"Hello from HybridOS!\\n\");\n    printf(\"This C code runs on our hybrid kernel!\\n\");\n    \n    // Features demo\n    for (int i = 0; i < 5; i++) {\n        printf(\"Loop %d: Windows + Linux = HybridOS\\n\", i);\n    }\n    \n    return 0;\n}\n\n// Try: compile demo.c\n//      run demo\n";
+                fs_write(demo, 0, content, strlen(content));
+            }
+        }
+    }
+}
+
+// ==================== BOOT IMAGE ====================
+// Filesystem images passed by GRUB as multiboot modules (built on the host
+// by mkfsimage.py). Mounting reads only the entry table: the data area is
+// adopted as block groups right where GRUB loaded it, and each file is a
+// single extent into it, so the first write to a block copies it and the
+// image itself is never modified.
+#define FSIMG_MAGIC 0x53465948     // "HYFS"
+#define FSIMG_VERSION 1
+#define BOOT_MAX_MODULES 4
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t entry_count;          // entry 0 stands for the mount point
+    uint32_t entries_offset;
+    uint32_t names_offset, names_size;
+    uint32_t data_offset, data_blocks;
+    uint32_t mount;                // name table offset of the mount path
+} fsimg_header_t;
+
+typedef struct {
+    uint32_t parent;               // index of an earlier directory entry
+    uint32_t name;                 // name table offset
+    uint32_t type;                 // FS_FILE or FS_DIRECTORY
+    uint32_t size;
+    uint32_t block;                // first data block, the rest follow it
+} fsimg_entry_t;
+
+typedef struct { uint32_t start, end; } boot_module_t;
+
+static boot_module_t boot_modules[BOOT_MAX_MODULES];
+static uint32_t boot_module_count = 0;
+static uint32_t fsimg_first[BOOT_MAX_MODULES], fsimg_blocks[BOOT_MAX_MODULES];
+static uint32_t fsimg_count = 0, fsimg_files = 0;
+
+// Saves the module list before kmem_init can overwrite it; returns the
+// end of the highest module so the page allocator starts above them all
+static size_t boot_save_modules(multiboot_info_t* mbi, size_t end) {
+    const uint32_t* mod = (const uint32_t*)(size_t)mbi->mods_addr;   // start, end, string, reserved
+    for (uint32_t i = 0; i < mbi->mods_count; i++, mod += 4) {
+        if (boot_module_count < BOOT_MAX_MODULES) {
+            boot_modules[boot_module_count].start = mod[0];
+            boot_modules[boot_module_count].end = mod[1];
+            boot_module_count++;
+        }
+        if (mod[1] > end) end = mod[1];
+    }
+    return end;
+}
+
+static const char* fsimg_string(const uint8_t* image, const fsimg_header_t* h, uint32_t offset) {
+    if (offset >= h->names_size) return NULL;
+    const uint8_t* s = image + h->names_offset + offset;
+    return mem_find_byte(s, image + h->names_offset + h->names_size, 0) ? (const char*)s : NULL;
+}
+
+static bool fsimg_valid_name(const char* name) {
+    if (!name[0] || strlen(name) >= MAX_FILENAME) return false;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return false;
+    for (const char* p = name; *p; p++) if (*p == '/') return false;
+    return true;
+}
+
+// Directory at path, creating missing components
+static fs_node_t* fs_make_dirs(const char* path) {
+    fs_node_t* dir = fs_root;
+    char name[MAX_FILENAME];
+    while (*path) {
+        while (*path == '/') path++;
+        if (!*path) break;
+        size_t len = 0;
+        while (path[len] && path[len] != '/') len++;
+        if (len >= MAX_FILENAME) return NULL;
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+        fs_node_t* child = fs_find_child(dir, name);
+        if (!child) child = fs_create_node(name, FS_DIRECTORY, dir);
+        if (!child || child->type != FS_DIRECTORY) return NULL;
+        dir = child;
+    }
+    return dir;
+}
+
+// Points an empty file at `size` bytes of image blocks starting at `block`
+static bool fsimg_attach(fs_node_t* file, uint32_t block, uint32_t size) {
+    if (size <= FS_INLINE_MAX) return !size || fs_write(file, 0, fs_block_data(block), size);
+    uint32_t blocks = fs_blocks_for(size);
+    fs_extents_t* ext = kmalloc(sizeof(fs_extents_t) + sizeof(fs_extent_t));
+    if (!ext) return false;
+    ext->count = ext->capacity = ext->refs = 1;
+    ext->runs[0].start = block;
+    ext->runs[0].count = blocks;
+    for (uint32_t b = 0; b < blocks; b++) (*fs_block_refs(block + b))++;
+    file->flags &= ~FS_NODE_INLINE;
+    file->extents = ext;
+    file->size = size;
+    fs_file_changed(file);
+    return true;
+}
+
+// Mounts one image over the tree: directories merge with existing ones,
+// files replace existing files. Returns the number of files, or -1 if the
+// image is not valid.
+int fs_mount_image(uint8_t* image, uint32_t size) {
+    const fsimg_header_t* h = (const fsimg_header_t*)image;
+    if (size < sizeof(fsimg_header_t) || h->magic != FSIMG_MAGIC || h->version != FSIMG_VERSION) return -1;
+    if (h->entries_offset > size || !h->entry_count ||
+        h->entry_count > (size - h->entries_offset) / sizeof(fsimg_entry_t)) return -1;
+    if (h->names_offset > size || h->names_size > size - h->names_offset) return -1;
+    if (h->data_offset > size || h->data_blocks > (size - h->data_offset) / FS_BLOCK_SIZE) return -1;
+    const char* mount = fsimg_string(image, h, h->mount);
+    fs_node_t* at = mount ? fs_make_dirs(mount) : NULL;
+    if (!at || fsimg_count == BOOT_MAX_MODULES) return -1;
+
+    fs_node_t** nodes = kmalloc(h->entry_count * sizeof(fs_node_t*));
+    if (!nodes) return -1;
+    uint32_t first = h->data_blocks ? fs_block_adopt(image + h->data_offset, h->data_blocks) : 0;
+    if (first == FS_NO_BLOCK) { kfree(nodes); return -1; }
+    fsimg_first[fsimg_count] = first;
+    fsimg_blocks[fsimg_count] = h->data_blocks;
+    fsimg_count++;
+
+    const fsimg_entry_t* e = (const fsimg_entry_t*)(image + h->entries_offset);
+    int files = 0;
+    nodes[0] = at;
+    for (uint32_t i = 1; i < h->entry_count; i++) {
+        nodes[i] = NULL;
+        fs_node_t* parent = e[i].parent < i ? nodes[e[i].parent] : NULL;
+        const char* name = fsimg_string(image, h, e[i].name);
+        if (!parent || parent->type != FS_DIRECTORY || !name || !fsimg_valid_name(name)) continue;
+        fs_node_t* node = fs_find_child(parent, name);
+        if (e[i].type == FS_DIRECTORY) {
+            nodes[i] = node ? node : fs_create_node(name, FS_DIRECTORY, parent);
+            continue;
         }
-        
-        fs_node_t* version = fs_create_node("version", FS_FILE, etc);
-        if (version && (size_t)file_data_used + 50 < sizeof(file_data_pool)) {
-            const char* content = "HybridOS Ultimate v2.0\nKernel: 5.0-hybrid-ultimate\nBuild: Complete Edition\nFeatures: ALL\n";
-            version->content = &file_data_pool[file_data_used];
-            strcpy(version->content, content);
-            version->size = strlen(content);
-            file_data_used += version->size + 1;
+        uint32_t blocks = fs_blocks_for(e[i].size);
+        if (e[i].type != FS_FILE || e[i].block > h->data_blocks || blocks > h->data_blocks - e[i].block) continue;
+        if (node && (node->type != FS_FILE || !fs_truncate(node, 0))) continue;
+        if (!node && !(node = fs_create_node(name, FS_FILE, parent))) continue;
+        if (fsimg_attach(node, first + e[i].block, e[i].size)) files++;
+    }
+    kfree(nodes);
+    fsimg_files += files;
+    return files;
+}
+
+void boot_mount_modules() {
+    for (uint32_t i = 0; i < boot_module_count; i++) {
+        if (fs_mount_image((uint8_t*)(size_t)boot_modules[i].start, boot_modules[i].end - boot_modules[i].start) >= 0) continue;
+        term_setcolor(0x0C);
+        term_write("Boot module "); term_write_dec(i); term_write(": not a filesystem image\n");
+        term_setcolor(0x07);
+    }
+}
+
+// Image blocks still shared with the image, i.e. never written
+static uint32_t fsimg_blocks_mapped() {
+    uint32_t mapped = 0;
+    for (uint32_t i = 0; i < fsimg_count; i++)
+        for (uint32_t b = 0; b < fsimg_blocks[i]; b++)
+            if (*fs_block_refs(fsimg_first[i] + b) > 1) mapped++;
+    return mapped;
+}
+
+// ==================== FW_CFG ====================
+// QEMU's firmware configuration device. Blobs passed with
+// -fw_cfg name=opt/<path>,file=<host file> are imported at boot into
+// FW_CFG_IMPORT_DIR/<path>. fs_fill() allocates the file's blocks and
+// each contiguous run (up to a block group) is one DMA request; without
+// DMA support the data port is read a byte at a time.
+#define FW_CFG_PORT_SEL 0x510
+#define FW_CFG_PORT_DATA 0x511
+#define FW_CFG_PORT_DMA 0x514      // address, big endian: high word, then low word
+#define FW_CFG_SIGNATURE 0x0000
+#define FW_CFG_ID 0x0001
+#define FW_CFG_FILE_DIR 0x0019
+#define FW_CFG_VERSION_DMA 0x02
+#define FW_CFG_DMA_ERROR 0x01
+#define FW_CFG_DMA_READ 0x02
+#define FW_CFG_DMA_SELECT 0x08
+#define FW_CFG_IMPORT_DIR "/import"
+
+typedef struct {
+    uint32_t control, length;      // big endian, like the whole structure
+    uint32_t address_hi, address_lo;
+} __attribute__((packed, aligned(16))) fw_cfg_dma_t;
+
+typedef struct {
+    uint32_t size;
+    uint16_t select;
+    char name[56];
+} fw_cfg_file_t;
+
+static bool fw_cfg_present = false, fw_cfg_has_dma = false;
+static fw_cfg_file_t* fw_cfg_files = NULL;
+static uint32_t fw_cfg_file_count = 0;
+static volatile fw_cfg_dma_t fw_cfg_dma;
+
+// Reads len bytes from the selected item; select is the item to switch
+// to first, or -1 to continue where the previous read stopped
+static bool fw_cfg_read(int select, void* buf, uint32_t len) {
+    if (!fw_cfg_has_dma) {
+        if (select >= 0) outw(FW_CFG_PORT_SEL, (uint16_t)select);
+        for (uint32_t i = 0; i < len; i++) ((uint8_t*)buf)[i] = inb(FW_CFG_PORT_DATA);
+        return true;
+    }
+    uint32_t control = FW_CFG_DMA_READ;
+    if (select >= 0) control |= FW_CFG_DMA_SELECT | ((uint32_t)select << 16);
+    fw_cfg_dma.control = bswap32(control);
+    fw_cfg_dma.length = bswap32(len);
+    fw_cfg_dma.address_hi = 0;
+    fw_cfg_dma.address_lo = bswap32((uint32_t)(size_t)buf);
+    outl(FW_CFG_PORT_DMA, 0);
+    outl(FW_CFG_PORT_DMA + 4, bswap32((uint32_t)(size_t)&fw_cfg_dma));   // starts the transfer
+    uint32_t status;
+    while ((status = bswap32(fw_cfg_dma.control)) & ~FW_CFG_DMA_ERROR) ;
+    return !(status & FW_CFG_DMA_ERROR);
+}
+
+void fw_cfg_init() {
+    char signature[4];
+    outw(FW_CFG_PORT_SEL, FW_CFG_SIGNATURE);
+    for (int i = 0; i < 4; i++) signature[i] = inb(FW_CFG_PORT_DATA);
+    if (memcmp(signature, "QEMU", 4) != 0) return;
+    fw_cfg_present = true;
+    uint32_t features;
+    fw_cfg_read(FW_CFG_ID, &features, 4);
+    fw_cfg_has_dma = (features & FW_CFG_VERSION_DMA) != 0;
+
+    uint32_t count;
+    if (!fw_cfg_read(FW_CFG_FILE_DIR, &count, 4)) return;
+    count = bswap32(count);
+    fw_cfg_files = kmalloc(count * sizeof(fw_cfg_file_t));
+    if (!fw_cfg_files) return;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t entry[64];          // size (BE32), select (BE16), reserved, name
+        if (!fw_cfg_read(-1, entry, sizeof(entry))) break;
+        fw_cfg_file_t* f = &fw_cfg_files[fw_cfg_file_count++];
+        f->size = bswap32(*(uint32_t*)entry);
+        f->select = (uint16_t)(entry[4] << 8 | entry[5]);
+        memcpy(f->name, entry + 8, sizeof(f->name));
+        f->name[sizeof(f->name) - 1] = '\0';
+    }
+}
+
+static fw_cfg_file_t* fw_cfg_find(const char* name) {
+    for (uint32_t i = 0; i < fw_cfg_file_count; i++) {
+        const char* n = fw_cfg_files[i].name;
+        if (strcmp(n, name) == 0 || (starts_with(n, "opt/") && strcmp(n + 4, name) == 0)) return &fw_cfg_files[i];
+    }
+    return NULL;
+}
+
+static bool fw_cfg_fill(void* ctx, uint8_t* buf, uint32_t len) {
+    int* select = ctx;
+    bool ok = fw_cfg_read(*select, buf, len);
+    *select = -1;
+    return ok;
+}
+
+// Replaces the content of file with a fw_cfg blob
+static bool fw_cfg_import_file(fw_cfg_file_t* f, fs_node_t* file) {
+    int select = f->select;
+    return fs_fill(file, f->size, fw_cfg_fill, &select);
+}
+
+// Imports a blob to path, by default FW_CFG_IMPORT_DIR/<name without opt/>
+// with any missing directory created
+static bool fw_cfg_import(fw_cfg_file_t* f, const char* path) {
+    char target[MAX_PATH], name[MAX_FILENAME];
+    if (!path) {
+        strcpy(target, FW_CFG_IMPORT_DIR "/");
+        strcat(target, starts_with(f->name, "opt/") ? f->name + 4 : f->name);
+        char* last = target;
+        for (char* p = target; *p; p++) if (*p == '/') last = p;
+        *last = '\0';
+        if (!fs_make_dirs(target)) return false;
+        *last = '/';
+        path = target;
+    }
+    fs_node_t* parent = fs_resolve_parent(path, name);
+    if (!parent || parent->type != FS_DIRECTORY || !name[0]) return false;
+    fs_node_t* file = fs_find_child(parent, name);
+    if (!file) file = fs_create_node(name, FS_FILE, parent);
+    return file && file->type == FS_FILE && fw_cfg_import_file(f, file);
+}
+
+static void fw_cfg_write_rate(uint64_t bytes, uint64_t us) {
+    // bytes per microsecond is MB/s
+    uint32_t tenths = us ? (uint32_t)udiv64(bytes * 10, us) : 0;
+    term_write_dec(tenths / 10); term_putchar('.'); term_write_dec(tenths % 10);
+    term_write(" MB/s");
+}
+
+// Imports every opt/ blob; returns the number of files and adds up their
+// bytes and transfer time
+static uint32_t fw_cfg_import_all(uint64_t* bytes, uint64_t* us, bool verbose) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < fw_cfg_file_count; i++) {
+        fw_cfg_file_t* f = &fw_cfg_files[i];
+        if (!starts_with(f->name, "opt/")) continue;
+        uint64_t start = time_us();
+        bool ok = fw_cfg_import(f, NULL);
+        uint64_t elapsed = time_us() - start;
+        if (verbose) {
+            term_setcolor(ok ? 0x07 : 0x0C);
+            term_write(f->name + 4); term_write(": ");
+            term_write_dec(f->size); term_write(" bytes");
+            if (ok) { term_write(", "); fw_cfg_write_rate(f->size, elapsed); }
+            else term_write(", import failed");
+            term_putchar('\n');
+            term_setcolor(0x07);
+        }
+        if (!ok) continue;
+        count++;
+        *bytes += f->size;
+        *us += elapsed;
+    }
+    return count;
+}
+
+void boot_import_fw_cfg() {
+    fw_cfg_init();
+    uint64_t bytes = 0, us = 0;
+    uint32_t count = fw_cfg_import_all(&bytes, &us, false);
+    if (!count) return;
+    term_write("fw_cfg: "); term_write_dec(count); term_write(" files, ");
+    term_write_dec((uint32_t)((bytes + 1023) >> 10)); term_write(" KB imported to " FW_CFG_IMPORT_DIR " (");
+    fw_cfg_write_rate(bytes, us);
+    term_write(fw_cfg_has_dma ? ", DMA)\n" : ", port I/O)\n");
+}
+
+// ==================== ATA DISK ====================
+// PIO driver for the primary master disk (QEMU -hda), polled with its
+// interrupt disabled (nIEN): every command is synchronous and the CPU moves
+// the data itself anyway. LBA28, up to ATA_MAX_SECTORS per command; the
+// data of a command moves one sector at a time.
+#define ATA_IO 0x1F0
+#define ATA_CTRL 0x3F6
+#define ATA_REG_DATA 0
+#define ATA_REG_COUNT 2
+#define ATA_REG_LBA0 3
+#define ATA_REG_LBA1 4
+#define ATA_REG_LBA2 5
+#define ATA_REG_DRIVE 6
+#define ATA_REG_STATUS 7           // read
+#define ATA_REG_COMMAND 7          // write
+#define ATA_SR_ERR 0x01
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_DF 0x20
+#define ATA_SR_BSY 0x80
+#define ATA_CMD_READ 0x20
+#define ATA_CMD_WRITE 0x30
+#define ATA_CMD_FLUSH 0xE7
+#define ATA_CMD_IDENTIFY 0xEC
+#define ATA_SECTOR 512
+#define ATA_MAX_SECTORS 256
+
+static bool ata_present = false;
+static uint32_t ata_sectors = 0;
+static char ata_model[41];
+
+// Waits until the drive is idle (and, with drq, ready to move data)
+static bool ata_wait(bool drq) {
+    for (uint32_t spin = 0; spin < 10000000; spin++) {
+        uint8_t status = inb(ATA_IO + ATA_REG_STATUS);
+        if (status & ATA_SR_BSY) continue;
+        if (status & (ATA_SR_ERR | ATA_SR_DF)) return false;
+        if (!drq || (status & ATA_SR_DRQ)) return true;
+    }
+    return false;
+}
+
+void ata_init() {
+    outb(ATA_CTRL, 0x02);                                  // nIEN: polled
+    if (inb(ATA_IO + ATA_REG_STATUS) == 0xFF) return;      // floating bus
+    outb(ATA_IO + ATA_REG_DRIVE, 0xA0);
+    for (int i = 0; i < 4; i++) inb(ATA_CTRL);             // 400 ns settle
+    outb(ATA_IO + ATA_REG_COUNT, 0);
+    outb(ATA_IO + ATA_REG_LBA0, 0);
+    outb(ATA_IO + ATA_REG_LBA1, 0);
+    outb(ATA_IO + ATA_REG_LBA2, 0);
+    outb(ATA_IO + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    if (inb(ATA_IO + ATA_REG_STATUS) == 0 || !ata_wait(false)) return;
+    if (inb(ATA_IO + ATA_REG_LBA1) || inb(ATA_IO + ATA_REG_LBA2)) return;   // ATAPI or SATA
+    if (!ata_wait(true)) return;
+    uint16_t id[256];
+    insw(ATA_IO + ATA_REG_DATA, id, 256);
+    ata_sectors = id[60] | (uint32_t)id[61] << 16;
+    for (int i = 0; i < 20; i++) {
+        ata_model[2 * i] = (char)(id[27 + i] >> 8);
+        ata_model[2 * i + 1] = (char)id[27 + i];
+    }
+    int len = 40;
+    while (len > 0 && ata_model[len - 1] == ' ') len--;
+    ata_model[len] = '\0';
+    ata_present = ata_sectors > 0;
+}
+
+// Starts a transfer of count sectors (1..ATA_MAX_SECTORS) at lba
+static bool ata_command(uint8_t command, uint32_t lba, uint32_t count) {
+    if (!ata_wait(false)) return false;
+    outb(ATA_IO + ATA_REG_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(ATA_IO + ATA_REG_COUNT, (uint8_t)count);          // 0 means 256
+    outb(ATA_IO + ATA_REG_LBA0, (uint8_t)lba);
+    outb(ATA_IO + ATA_REG_LBA1, (uint8_t)(lba >> 8));
+    outb(ATA_IO + ATA_REG_LBA2, (uint8_t)(lba >> 16));
+    outb(ATA_IO + ATA_REG_COMMAND, command);
+    return true;
+}
+
+static bool ata_read_sector(void* buf) {
+    if (!ata_wait(true)) return false;
+    insw(ATA_IO + ATA_REG_DATA, buf, ATA_SECTOR / 2);
+    return true;
+}
+
+static bool ata_write_sector(const void* buf) {
+    if (!ata_wait(true)) return false;
+    outsw(ATA_IO + ATA_REG_DATA, buf, ATA_SECTOR / 2);
+    return true;
+}
+
+// Empties the drive's own write cache
+static bool ata_flush() {
+    if (!ata_wait(false)) return false;
+    outb(ATA_IO + ATA_REG_DRIVE, 0xE0);
+    outb(ATA_IO + ATA_REG_COMMAND, ATA_CMD_FLUSH);
+    return ata_wait(false);
+}
+
+// ==================== PCI ====================
+// Configuration mechanism #1. The buses are scanned once at boot and the
+// functions found are kept in pci_devices.
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+#define PCI_MAX_DEVICES 32
+#define PCI_COMMAND 0x04
+#define PCI_COMMAND_IO 0x0001
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_MASTER 0x0004
+
+typedef struct {
+    uint8_t bus, slot, func, irq;
+    uint16_t vendor, device;
+    uint8_t class_code, subclass, prog_if;
+    uint32_t bar[6];
+} pci_device_t;
+
+static pci_device_t pci_devices[PCI_MAX_DEVICES];
+static uint32_t pci_device_count = 0;
+
+static inline uint32_t pci_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    return 0x80000000u | (uint32_t)bus << 16 | (uint32_t)slot << 11 | (uint32_t)func << 8 | (offset & 0xFC);
+}
+
+uint32_t pci_read32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_write16(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+    outw(PCI_CONFIG_DATA + (offset & 2), value);
+}
+
+void pci_init() {
+    pci_device_count = 0;
+    for (uint32_t bus = 0; bus < 256; bus++)
+        for (uint8_t slot = 0; slot < 32; slot++)
+            for (uint8_t func = 0; func < 8; func++) {
+                uint32_t id = pci_read32(bus, slot, func, 0x00);
+                if ((id & 0xFFFF) == 0xFFFF) {
+                    if (func == 0) break;
+                    continue;
+                }
+                if (pci_device_count < PCI_MAX_DEVICES) {
+                    pci_device_t* d = &pci_devices[pci_device_count++];
+                    uint32_t class_reg = pci_read32(bus, slot, func, 0x08);
+                    d->bus = bus; d->slot = slot; d->func = func;
+                    d->vendor = id & 0xFFFF;
+                    d->device = id >> 16;
+                    d->class_code = class_reg >> 24;
+                    d->subclass = class_reg >> 16;
+                    d->prog_if = class_reg >> 8;
+                    d->irq = pci_read32(bus, slot, func, 0x3C) & 0xFF;
+                    for (int i = 0; i < 6; i++) d->bar[i] = pci_read32(bus, slot, func, 0x10 + 4 * i);
+                }
+                if (func == 0 && !(pci_read32(bus, slot, func, 0x0C) & 0x00800000)) break;   // single function
+            }
+}
+
+pci_device_t* pci_find(uint16_t vendor, uint16_t device) {
+    for (uint32_t i = 0; i < pci_device_count; i++)
+        if (pci_devices[i].vendor == vendor && pci_devices[i].device == device) return &pci_devices[i];
+    return NULL;
+}
+
+// Turns on port and memory decoding and lets the device master the bus (DMA)
+void pci_enable(pci_device_t* d) {
+    uint16_t command = pci_read32(d->bus, d->slot, d->func, PCI_COMMAND) & 0xFFFF;
+    pci_write16(d->bus, d->slot, d->func, PCI_COMMAND, command | PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+}
+
+static const char* pci_class_name(uint8_t class_code) {
+    static const char* names[] = {"unclassified", "storage", "network", "display", "multimedia", "memory", "bridge", "communication", "system", "input"};
+    return class_code < sizeof(names) / sizeof(names[0]) ? names[class_code] : "other";
+}
+
+// ==================== VIRTIO-BLK ====================
+// Legacy (transitional) virtio-blk over port I/O: QEMU -drive if=virtio.
+// A request is a chain of descriptors: header, the caller's scatter-gather
+// buffers, status byte. blk_submit() only queues the chain; blk_kick()
+// publishes everything queued since the previous kick to the device with
+// a single notification, skipped when the device says it is still busy
+// with the ring. blk_poll() reaps the used ring and calls each request's
+// done callback: from the device's PCI interrupt (blk_irq) when it could be
+// installed, else from blk_wait() and kernel_idle. Waiters also poll when
+// no interrupt came for BLK_IRQ_TIMEOUT_US, in case the line is misrouted.
+#define VIRTIO_VENDOR 0x1AF4
+#define VIRTIO_DEV_BLK 0x1001
+#define VIRTIO_REG_DEVICE_FEATURES 0x00
+#define VIRTIO_REG_GUEST_FEATURES 0x04
+#define VIRTIO_REG_QUEUE_PFN 0x08
+#define VIRTIO_REG_QUEUE_SIZE 0x0C
+#define VIRTIO_REG_QUEUE_SELECT 0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY 0x10
+#define VIRTIO_REG_STATUS 0x12
+#define VIRTIO_REG_ISR 0x13            // read to acknowledge the interrupt
+#define VIRTIO_REG_CONFIG 0x14         // device config, without MSI-X
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED 0x80
+#define VIRTIO_BLK_F_RO (1u << 5)
+#define VIRTIO_BLK_F_FLUSH (1u << 9)
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2           // device writes the buffer
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY 1
+#define VIRTQ_ALIGN 4096
+#define BLK_READ 0                     // VIRTIO_BLK_T_IN
+#define BLK_WRITE 1                    // VIRTIO_BLK_T_OUT
+#define BLK_FLUSH 4
+#define BLK_SECTOR 512
+#define BLK_IRQ_TIMEOUT_US 10000
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags, next;
+} virtq_desc_t;
+
+typedef struct {
+    uint16_t flags, idx;
+    uint16_t ring[];
+} virtq_avail_t;
+
+typedef struct {
+    uint16_t flags, idx;
+    struct { uint32_t id, len; } ring[];
+} virtq_used_t;
+
+typedef struct {
+    void* data;
+    uint32_t len;                      // a multiple of BLK_SECTOR
+} blk_sg_t;
+
+typedef struct blk_request {
+    uint32_t type;                     // BLK_READ, BLK_WRITE or BLK_FLUSH
+    uint64_t sector;
+    const blk_sg_t* sg;
+    uint32_t sg_count;
+    void (*done)(struct blk_request* req);   // from blk_poll(), maybe in the interrupt, may be NULL
+    void* ctx;
+    volatile bool complete;
+    bool ok;
+    // Read by the device
+    struct { uint32_t type, reserved; uint64_t sector; } header;
+    volatile uint8_t status;
+} blk_request_t;
+
+static bool blk_present = false, blk_readonly = false;
+static uint16_t blk_io = 0;
+static uint64_t blk_capacity = 0;      // sectors
+static uint32_t blk_features = 0;
+static virtq_desc_t* vq_desc = NULL;
+static virtq_avail_t* vq_avail = NULL;
+static volatile virtq_used_t* vq_used = NULL;
+static blk_request_t** vq_requests = NULL;   // by head descriptor
+static uint16_t vq_size = 0, vq_free_head = 0, vq_free_count = 0;
+static uint16_t vq_next_avail = 0, vq_last_used = 0;
+static uint32_t blk_inflight = 0, blk_submitted = 0, blk_kicks = 0;
+static volatile uint32_t blk_completed = 0, blk_irqs = 0;
+static bool blk_irq_driven = false;
+static uint8_t blk_irq_line = 0;
+
+extern void blk_isr(void);
+
+static inline uint32_t vq_align(uint32_t n) { return (n + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1); }
+
+void blk_init() {
+    pci_device_t* d = pci_find(VIRTIO_VENDOR, VIRTIO_DEV_BLK);
+    if (!d || !(d->bar[0] & 1)) return;
+    pci_enable(d);
+    blk_io = d->bar[0] & 0xFFFC;
+    outb(blk_io + VIRTIO_REG_STATUS, 0);                           // reset
+    outb(blk_io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(blk_io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    blk_features = inl(blk_io + VIRTIO_REG_DEVICE_FEATURES) & (VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH);
+    outl(blk_io + VIRTIO_REG_GUEST_FEATURES, blk_features);
+    outw(blk_io + VIRTIO_REG_QUEUE_SELECT, 0);
+    uint16_t size = inw(blk_io + VIRTIO_REG_QUEUE_SIZE);
+    uint32_t used_offset = vq_align(size * sizeof(virtq_desc_t) + 6 + 2 * size);
+    uint32_t pages = (used_offset + vq_align(6 + 8 * size)) / PAGE_SIZE;
+    uint8_t* ring = size ? kpage_alloc(pages) : NULL;
+    vq_requests = ring ? kmalloc(size * sizeof(blk_request_t*)) : NULL;
+    if (!vq_requests) {
+        if (ring) kpage_free(ring, pages);
+        outb(blk_io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+    memset(ring, 0, pages * PAGE_SIZE);
+    vq_size = size;
+    vq_desc = (virtq_desc_t*)ring;
+    vq_avail = (virtq_avail_t*)(ring + size * sizeof(virtq_desc_t));
+    vq_used = (virtq_used_t*)(ring + used_offset);
+    for (uint16_t i = 0; i < size; i++) vq_desc[i].next = i + 1;
+    vq_free_head = 0;
+    vq_free_count = size;
+    vq_next_avail = vq_last_used = 0;
+    vq_avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    outl(blk_io + VIRTIO_REG_QUEUE_PFN, (uint32_t)(size_t)ring / VIRTQ_ALIGN);
+    blk_capacity = inl(blk_io + VIRTIO_REG_CONFIG) | (uint64_t)inl(blk_io + VIRTIO_REG_CONFIG + 4) << 32;
+    blk_readonly = blk_features & VIRTIO_BLK_F_RO;
+    outb(blk_io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    blk_present = true;
+    blk_irq_line = d->irq;
+    blk_irq_driven = d->irq > 2 && d->irq < 16 && irq_install(d->irq, blk_isr);
+    if (blk_irq_driven) vq_avail->flags = 0;
+}
+
+static uint16_t vq_take_desc() {
+    uint16_t i = vq_free_head;
+    vq_free_head = vq_desc[i].next;
+    vq_free_count--;
+    return i;
+}
+
+// Queues a request without telling the device (see blk_kick). Fails when
+// the ring lacks descriptors for it: poll, then retry.
+bool blk_submit(blk_request_t* req) {
+    if (!blk_present || req->sg_count + 2 > vq_free_count) return false;
+    uint64_t sectors = 0;
+    for (uint32_t i = 0; i < req->sg_count; i++) sectors += req->sg[i].len / BLK_SECTOR;
+    if (req->type != BLK_FLUSH && (req->sector > blk_capacity || sectors > blk_capacity - req->sector)) return false;
+    if (req->type == BLK_WRITE && blk_readonly) return false;
+    req->header.type = req->type;
+    req->header.reserved = 0;
+    req->header.sector = req->sector;
+    req->status = 0xFF;
+    req->complete = false;
+
+    uint32_t flags = irq_save();                  // blk_poll() returns descriptors from the interrupt
+    uint16_t head = vq_take_desc(), d = head;
+    vq_desc[d].addr = (uint32_t)(size_t)&req->header;
+    vq_desc[d].len = sizeof(req->header);
+    vq_desc[d].flags = VIRTQ_DESC_F_NEXT;
+    for (uint32_t i = 0; i < req->sg_count; i++) {
+        uint16_t next = vq_take_desc();
+        vq_desc[d].next = next;
+        d = next;
+        vq_desc[d].addr = (uint32_t)(size_t)req->sg[i].data;
+        vq_desc[d].len = req->sg[i].len;
+        vq_desc[d].flags = VIRTQ_DESC_F_NEXT | (req->type == BLK_READ ? VIRTQ_DESC_F_WRITE : 0);
+    }
+    uint16_t status = vq_take_desc();
+    vq_desc[d].next = status;
+    vq_desc[status].addr = (uint32_t)(size_t)&req->status;
+    vq_desc[status].len = 1;
+    vq_desc[status].flags = VIRTQ_DESC_F_WRITE;
+
+    vq_requests[head] = req;
+    vq_avail->ring[vq_next_avail++ % vq_size] = head;
+    blk_inflight++;
+    blk_submitted++;
+    irq_restore(flags);
+    return true;
+}
+
+// Hands every request queued since the last kick to the device at once
+void blk_kick() {
+    if (!blk_present || vq_avail->idx == vq_next_avail) return;
+    __asm__ volatile ("" ::: "memory");           // ring entries before the index
+    vq_avail->idx = vq_next_avail;
+    __sync_synchronize();                         // index visible before reading the flags
+    if (!(vq_used->flags & VIRTQ_USED_F_NO_NOTIFY)) {
+        outw(blk_io + VIRTIO_REG_QUEUE_NOTIFY, 0);
+        blk_kicks++;
+    }
+}
+
+// Completes the requests the device is done with; returns how many
+uint32_t blk_poll() {
+    uint32_t count = 0, flags = irq_save();
+    while (blk_present && vq_last_used != vq_used->idx) {
+        __asm__ volatile ("" ::: "memory");       // index before the entry
+        uint16_t head = vq_used->ring[vq_last_used++ % vq_size].id;
+        blk_request_t* req = vq_requests[head];
+        uint16_t i = head;
+        vq_free_count++;
+        while (vq_desc[i].flags & VIRTQ_DESC_F_NEXT) { i = vq_desc[i].next; vq_free_count++; }
+        vq_desc[i].next = vq_free_head;
+        vq_free_head = head;
+        blk_inflight--;
+        blk_completed++;
+        req->ok = req->status == 0;
+        req->complete = true;
+        if (req->done) req->done(req);
+        count++;
+    }
+    irq_restore(flags);
+    return count;
+}
+
+// Called by blk_isr. Reading the ISR register lowers the PCI line.
+void blk_irq() {
+    blk_irqs++;
+    inb(blk_io + VIRTIO_REG_ISR);
+    blk_poll();
+    if (blk_irq_line >= 8) outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+}
+
+// Waits for a completion after the seen-th one
+static void blk_wait_completion(uint32_t seen) {
+    uint64_t start = time_us();
+    while (blk_completed == seen) {
+        if (blk_irq_driven && time_us() - start < BLK_IRQ_TIMEOUT_US) __asm__ volatile ("pause");
+        else blk_poll();
+    }
+}
+
+bool blk_wait(blk_request_t* req) {
+    blk_kick();
+    while (!req->complete) blk_wait_completion(blk_completed);
+    return req->ok;
+}
+
+// Synchronous request, waiting for ring space if needed
+bool blk_transfer(uint32_t type, uint64_t sector, const blk_sg_t* sg, uint32_t sg_count) {
+    if (!blk_present || sg_count + 2 > vq_size) return false;
+    if (type == BLK_FLUSH && !(blk_features & VIRTIO_BLK_F_FLUSH)) return true;   // no write cache
+    blk_request_t req = {0};
+    req.type = type;
+    req.sector = sector;
+    req.sg = sg;
+    req.sg_count = sg_count;
+    while (!blk_submit(&req)) {
+        if (!blk_inflight) return false;
+        blk_kick();
+        blk_poll();
+    }
+    return blk_wait(&req);
+}
+
+// ==================== BUFFER CACHE ====================
+// Write-back cache of 4 KB disk clusters with LRU eviction. A miss while
+// reading sequentially reads ahead in the same command, the window
+// doubling up to one full command. Dirty clusters are written lowest
+// first, runs of contiguous ones in a single command, by bc_flush() (sync,
+// the background flush, or when the oldest cluster is dirty at eviction).
+// Clusters below bc_meta_clusters hold metadata pointing into the others:
+// they go last, between two disk flushes, once no other cluster is dirty.
+// The disk below is virtio-blk when QEMU provides one, else the ATA disk.
+#define BC_SECTORS 8                  // per cluster
+#define BC_CLUSTER (BC_SECTORS * ATA_SECTOR)
+#define BC_ENTRIES 256                // 1 MB
+#define BC_BUCKETS 512
+#define BC_RUN_MAX (ATA_MAX_SECTORS / BC_SECTORS)
+#define BC_NONE 0xFFFFFFFF
+
+typedef struct bc_entry {
+    uint32_t cluster;                 // BC_NONE while unused
+    bool dirty;
+    uint8_t* data;
+    struct bc_entry *newer, *older;   // LRU list
+    struct bc_entry* next;            // hash chain
+} bc_entry_t;
+
+static bc_entry_t* bc_entries = NULL;
+static bc_entry_t* bc_buckets[BC_BUCKETS];
+static bc_entry_t *bc_newest = NULL, *bc_oldest = NULL;
+static uint32_t bc_clusters = 0, bc_dirty = 0;
+static uint32_t bc_next = BC_NONE, bc_window = 1;   // read-ahead state
+static uint32_t bc_hits = 0, bc_misses = 0, bc_readahead = 0;
+static uint32_t bc_meta_clusters = 0;
+static bool bc_meta_synced = true;                  // no metadata waiting in the cache or the disk's
+static bool disk_present = false;
+static uint32_t disk_sectors = 0;
+static const char* disk_model = "";
+static uint32_t disk_reads = 0, disk_writes = 0;    // sectors
+
+void disk_init() {
+    pci_init();
+    blk_init();
+    if (blk_present) {
+        disk_sectors = blk_capacity > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)blk_capacity;
+        disk_model = "virtio-blk";
+    } else {
+        ata_init();
+        disk_sectors = ata_sectors;
+        disk_model = ata_model;
+    }
+    disk_present = disk_sectors > 0;
+}
+
+// Moves sectors at lba from or to the data of consecutive cache entries,
+// in one command
+static bool disk_io(bool write, uint32_t lba, uint32_t sectors, bc_entry_t** run) {
+    bool ok;
+    if (blk_present) {
+        blk_sg_t sg[BC_RUN_MAX];
+        uint32_t n = 0;
+        for (uint32_t left = sectors; left; n++) {
+            uint32_t count = left < BC_SECTORS ? left : BC_SECTORS;
+            sg[n].data = run[n]->data;
+            sg[n].len = count * ATA_SECTOR;
+            left -= count;
+        }
+        ok = blk_transfer(write ? BLK_WRITE : BLK_READ, lba, sg, n);
+    } else {
+        ok = ata_command(write ? ATA_CMD_WRITE : ATA_CMD_READ, lba, sectors);
+        for (uint32_t s = 0; s < sectors && ok; s++) {
+            uint8_t* data = run[s / BC_SECTORS]->data + (s % BC_SECTORS) * ATA_SECTOR;
+            ok = write ? ata_write_sector(data) : ata_read_sector(data);
+        }
+        if (ok && write) ok = ata_wait(false);
+    }
+    if (ok && write) disk_writes += sectors;
+    else if (ok) disk_reads += sectors;
+    return ok;
+}
+
+// Empties the disk's own write cache
+static bool disk_flush() {
+    return blk_present ? blk_transfer(BLK_FLUSH, 0, NULL, 0) : ata_flush();
+}
+
+static void bc_unlink(bc_entry_t* e) {
+    if (e->newer) e->newer->older = e->older; else bc_newest = e->older;
+    if (e->older) e->older->newer = e->newer; else bc_oldest = e->newer;
+}
+
+static void bc_touch(bc_entry_t* e) {
+    bc_unlink(e);
+    e->newer = NULL;
+    e->older = bc_newest;
+    if (bc_newest) bc_newest->newer = e; else bc_oldest = e;
+    bc_newest = e;
+}
+
+static void bc_set_dirty(bc_entry_t* e) {
+    if (e->dirty) return;
+    e->dirty = true;
+    bc_dirty++;
+    if (e->cluster < bc_meta_clusters) bc_meta_synced = false;
+}
+
+static bc_entry_t* bc_find(uint32_t cluster) {
+    bc_entry_t* e = bc_buckets[cluster % BC_BUCKETS];
+    while (e && e->cluster != cluster) e = e->next;
+    return e;
+}
+
+static void bc_hash_remove(bc_entry_t* e) {
+    bc_entry_t** link = &bc_buckets[e->cluster % BC_BUCKETS];
+    while (*link != e) link = &(*link)->next;
+    *link = e->next;
+    e->cluster = BC_NONE;
+}
+
+static void bc_hash_insert(bc_entry_t* e, uint32_t cluster) {
+    e->cluster = cluster;
+    e->next = bc_buckets[cluster % BC_BUCKETS];
+    bc_buckets[cluster % BC_BUCKETS] = e;
+}
+
+static bool bc_init() {
+    if (bc_entries) return true;
+    bc_entries = kmalloc(BC_ENTRIES * sizeof(bc_entry_t));
+    uint8_t* data = kpage_alloc(BC_ENTRIES * BC_CLUSTER / PAGE_SIZE);
+    if (!bc_entries || !data) {
+        kfree(bc_entries);
+        bc_entries = NULL;
+        if (data) kpage_free(data, BC_ENTRIES * BC_CLUSTER / PAGE_SIZE);
+        return false;
+    }
+    memset(bc_buckets, 0, sizeof(bc_buckets));
+    bc_newest = bc_oldest = NULL;
+    for (uint32_t i = 0; i < BC_ENTRIES; i++) {
+        bc_entry_t* e = &bc_entries[i];
+        e->cluster = BC_NONE;
+        e->dirty = false;
+        e->data = data + i * BC_CLUSTER;
+        e->newer = e->older = NULL;
+        if (bc_newest) { bc_newest->newer = e; e->older = bc_newest; } else bc_oldest = e;
+        bc_newest = e;
+    }
+    bc_clusters = (disk_sectors + BC_SECTORS - 1) / BC_SECTORS;
+    return true;
+}
+
+// Writes list[0..count), sorted by cluster, one command per contiguous run
+static bool bc_write_sorted(bc_entry_t** list, uint32_t count) {
+    for (uint32_t i = 0; i < count; ) {
+        uint32_t n = 1;
+        while (i + n < count && n < BC_RUN_MAX && list[i + n]->cluster == list[i]->cluster + n) n++;
+        uint32_t lba = list[i]->cluster * BC_SECTORS;
+        uint32_t sectors = n * BC_SECTORS;
+        if (sectors > disk_sectors - lba) sectors = disk_sectors - lba;
+        if (!disk_io(true, lba, sectors, list + i)) return false;
+        for (uint32_t k = 0; k < n; k++) list[i + k]->dirty = false;
+        bc_dirty -= n;
+        i += n;
+    }
+    return true;
+}
+
+// Writes back up to max dirty clusters, lowest first, data before metadata
+bool bc_flush(uint32_t max) {
+    bc_entry_t* list[BC_ENTRIES];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < BC_ENTRIES; i++) {
+        bc_entry_t* e = &bc_entries[i];
+        if (!e->dirty) continue;
+        uint32_t j = count++;
+        while (j > 0 && list[j - 1]->cluster > e->cluster) { list[j] = list[j - 1]; j--; }
+        list[j] = e;
+    }
+    uint32_t meta = 0, data;
+    while (meta < count && list[meta]->cluster < bc_meta_clusters) meta++;
+    data = count - meta;
+    if (!bc_write_sorted(list + meta, data < max ? data : max)) return false;
+    if (data >= max || bc_meta_synced) return true;
+    max -= data;
+    if (meta) {
+        if (!disk_flush() || !bc_write_sorted(list, meta < max ? meta : max)) return false;
+        if (meta > max) return true;
+    }
+    if (!disk_flush()) return false;
+    bc_meta_synced = true;
+    return true;
+}
+
+// Recycles the least recently used entry as the most recent one
+static bc_entry_t* bc_take() {
+    bc_entry_t* e = bc_oldest;
+    if (e->dirty && !bc_flush(BC_ENTRIES)) return NULL;
+    if (e->cluster != BC_NONE) bc_hash_remove(e);
+    bc_touch(e);
+    return e;
+}
+
+// Cached cluster; read only when its old content matters
+static bc_entry_t* bc_get(uint32_t cluster, bool read) {
+    bool sequential = cluster == bc_next;
+    bc_next = cluster + 1;
+    bc_entry_t* e = bc_find(cluster);
+    if (e) {
+        bc_hits++;
+        bc_touch(e);
+        return e;
+    }
+    bc_misses++;
+    if (!read) {
+        if (!(e = bc_take())) return NULL;
+        bc_hash_insert(e, cluster);
+        bc_set_dirty(e);             // the caller overwrites all of it
+        return e;
+    }
+    bc_window = sequential ? (bc_window * 2 < BC_RUN_MAX ? bc_window * 2 : BC_RUN_MAX) : 1;
+    uint32_t n = 1;
+    while (n < bc_window && cluster + n < bc_clusters && !bc_find(cluster + n)) n++;
+    bc_entry_t* run[BC_RUN_MAX];
+    for (uint32_t k = 0; k < n; k++) {
+        if (!(run[k] = bc_take())) return NULL;
+    }
+    uint32_t lba = cluster * BC_SECTORS, sectors = n * BC_SECTORS;
+    if (sectors > disk_sectors - lba) sectors = disk_sectors - lba;
+    if (!disk_io(false, lba, sectors, run)) return NULL;
+    for (uint32_t k = n; k-- > 0; ) bc_hash_insert(run[k], cluster + k);
+    bc_touch(run[0]);
+    bc_readahead += n - 1;
+    return run[0];
+}
+
+bool bc_read(uint32_t sector, void* buf, uint32_t len) {
+    uint8_t* out = buf;
+    uint32_t cluster = sector / BC_SECTORS, offset = (sector % BC_SECTORS) * ATA_SECTOR;
+    while (len) {
+        bc_entry_t* e = bc_get(cluster++, true);
+        if (!e) return false;
+        uint32_t chunk = BC_CLUSTER - offset < len ? BC_CLUSTER - offset : len;
+        memcpy(out, e->data + offset, chunk);
+        out += chunk; len -= chunk; offset = 0;
+    }
+    return true;
+}
+
+// Clusters only become dirty when their content actually changes
+bool bc_write(uint32_t sector, const void* buf, uint32_t len) {
+    const uint8_t* in = buf;
+    uint32_t cluster = sector / BC_SECTORS, offset = (sector % BC_SECTORS) * ATA_SECTOR;
+    while (len) {
+        uint32_t chunk = BC_CLUSTER - offset < len ? BC_CLUSTER - offset : len;
+        bc_entry_t* e = bc_get(cluster++, chunk < BC_CLUSTER);
+        if (!e) return false;
+        if (memcmp(e->data + offset, in, chunk) != 0) {
+            memcpy(e->data + offset, in, chunk);
+            bc_set_dirty(e);
+        }
+        in += chunk; len -= chunk; offset = 0;
+    }
+    return true;
+}
+
+// Writes everything back and forgets every cluster (cold cache)
+static bool bc_drop() {
+    if (!bc_flush(BC_ENTRIES)) return false;
+    for (uint32_t i = 0; i < BC_ENTRIES; i++)
+        if (bc_entries[i].cluster != BC_NONE) bc_hash_remove(&bc_entries[i]);
+    bc_next = BC_NONE;
+    return true;
+}
+
+// ==================== DISK FILESYSTEM ====================
+// Persistent copy of the tree on the disk, through the buffer cache:
+//   sector 0       superblock
+//   inode table    64-byte inodes, DK_ROOT is the root directory
+//   bitmap         one bit per data block
+//   data           512-byte blocks, each file in one contiguous run
+// At boot the disk's tree replaces the built-in one, before the boot image
+// and fw_cfg files are added, and file contents stay on disk until first
+// used (FS_NODE_ONDISK). A checkpoint writes what
+// changed since the previous one into the cache: the content of dirty
+// files to newly allocated runs, then the inode and bitmap sectors that
+// differ. Checkpoints run in the background and at sync; there is no
+// journal, but the cache writes data before the metadata pointing to it
+// and a replaced or deleted run is only reused once no inode on the disk
+// points to it, so a crash loses recent changes and leaves the older
+// tree intact. The bitmap is rebuilt from the inodes at mount.
+#define DK_MAGIC 0x4B445948           // "HYDK"
+#define DK_VERSION 1
+#define DK_ROOT 1
+#define DK_MAX_INODES 16384
+#define DK_CHECKPOINT_MS 5000
+#define DK_FLUSH_MS 200
+#define DK_FLUSH_BATCH 32             // clusters per background flush
+#define DK_BENCH_BYTES (768 * 1024)   // default bench span, fits the cache
+#define DK_FREEING_MAX 256            // runs waiting for their inodes to reach the disk
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t sectors;
+    uint32_t inode_count, inode_start;
+    uint32_t bitmap_start, bitmap_sectors;
+    uint32_t data_start, data_blocks;
+} dk_super_t;
+
+typedef struct {
+    uint32_t parent;                  // inode number, 0 for the root
+    uint32_t size;
+    uint32_t start, blocks;           // data run
+    uint32_t created_time;
+    uint8_t type;                     // 0 for a free inode
+    uint8_t permissions;
+    uint16_t reserved;
+    uint32_t spare[2];
+    char name[MAX_FILENAME];
+} dk_inode_t;
+
+#define DK_INODES_PER_SECTOR (ATA_SECTOR / sizeof(dk_inode_t))
+#define DK_BITS_PER_SECTOR (ATA_SECTOR * 8)
+
+static bool dk_mounted = false;
+static dk_super_t dk_super;
+static dk_inode_t* dk_table = NULL;           // the whole inode table
+static uint32_t* dk_bitmap = NULL;
+static uint8_t* dk_meta_dirty = NULL;         // per metadata sector, to write at checkpoint
+static fs_map_t dk_inos;                      // node -> inode number
+static uint32_t dk_ino_hint = DK_ROOT + 1, dk_block_hint = 0;
+static uint32_t dk_free_blocks = 0, dk_used_inodes = 0, dk_loads = 0;
+static uint32_t dk_last_checkpoint = 0, dk_last_flush = 0;
+static uint32_t dk_sync_us = 0, dk_sync_sectors = 0;
+// Freed runs, tagged with the checkpoint count when they were freed: a
+// run is reusable once a later checkpoint's metadata is on the disk
+static struct { uint32_t start, blocks, epoch; } dk_freeing[DK_FREEING_MAX];
+static uint32_t dk_freeing_count = 0, dk_epoch = 0;
+
+static inline bool dk_block_used(uint32_t block) { return dk_bitmap[block / 32] & (1u << (block % 32)); }
+
+static void dk_blocks_mark(uint32_t start, uint32_t count, bool used) {
+    for (uint32_t b = start; b < start + count; b++) {
+        if (used) dk_bitmap[b / 32] |= 1u << (b % 32);
+        else dk_bitmap[b / 32] &= ~(1u << (b % 32));
+        if (b == start || b % DK_BITS_PER_SECTOR == 0) dk_meta_dirty[dk_super.bitmap_start + b / DK_BITS_PER_SECTOR] = 1;
+    }
+    if (used) dk_free_blocks -= count; else dk_free_blocks += count;
+}
+
+// Frees a run once no inode on the disk references it. When too many are
+// waiting the run stays allocated until the next mount rebuilds the bitmap.
+static void dk_defer_free(uint32_t start, uint32_t blocks) {
+    if (!blocks || dk_freeing_count == DK_FREEING_MAX) return;
+    dk_freeing[dk_freeing_count].start = start;
+    dk_freeing[dk_freeing_count].blocks = blocks;
+    dk_freeing[dk_freeing_count].epoch = dk_epoch;
+    dk_freeing_count++;
+}
+
+// After a flush: releases the runs freed before the metadata now on the disk
+static void dk_release() {
+    if (!bc_meta_synced) return;
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < dk_freeing_count; i++) {
+        if (dk_freeing[i].epoch < dk_epoch) dk_blocks_mark(dk_freeing[i].start, dk_freeing[i].blocks, false);
+        else dk_freeing[kept++] = dk_freeing[i];
+    }
+    dk_freeing_count = kept;
+}
+
+// Data blocks sharing a cache cluster with the bitmap: never allocated, the
+// cluster is written with the metadata
+static uint32_t dk_reserved_blocks(const dk_super_t* super) {
+    uint32_t n = (BC_SECTORS - super->data_start % BC_SECTORS) % BC_SECTORS;
+    return n < super->data_blocks ? n : super->data_blocks;
+}
+
+// First fit for count contiguous data blocks
+static uint32_t dk_alloc_run(uint32_t count) {
+    if (!count) return 0;
+    if (count > dk_free_blocks) return FS_NO_BLOCK;
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t run = 0;
+        for (uint32_t b = pass ? 0 : dk_block_hint; b < dk_super.data_blocks; b++) {
+            if (!(b % 32) && dk_bitmap[b / 32] == 0xFFFFFFFF) { run = 0; b += 31; continue; }
+            run = dk_block_used(b) ? 0 : run + 1;
+            if (run == count) {
+                dk_blocks_mark(b + 1 - count, count, true);
+                dk_block_hint = b + 1;
+                return b + 1 - count;
+            }
+        }
+    }
+    return FS_NO_BLOCK;
+}
+
+static void dk_inode_changed(uint32_t ino) {
+    dk_meta_dirty[dk_super.inode_start + ino / DK_INODES_PER_SECTOR] = 1;
+}
+
+static uint32_t dk_alloc_inode() {
+    for (uint32_t n = 0; n < dk_super.inode_count; n++) {
+        uint32_t ino = (dk_ino_hint + n) % dk_super.inode_count;
+        if (ino > DK_ROOT && !dk_table[ino].type) {
+            dk_ino_hint = ino + 1;
+            dk_used_inodes++;
+            return ino;
+        }
+    }
+    return 0;
+}
+
+static void dk_free_inode(uint32_t ino) {
+    dk_inode_t* d = &dk_table[ino];
+    if (d->type == FS_FILE && d->start <= dk_super.data_blocks && d->blocks <= dk_super.data_blocks - d->start)
+        dk_defer_free(d->start, d->blocks);
+    memset(d, 0, sizeof(dk_inode_t));
+    dk_inode_changed(ino);
+    dk_used_inodes--;
+}
+
+// A removed node's inode is free for the next checkpoint, its blocks once
+// that checkpoint is on the disk
+static void dk_forget(fs_node_t* node) {
+    fs_map_entry_t* e = fs_map_find(&dk_inos, node);
+    if (!e) return;
+    dk_free_inode(e->value);
+    fs_map_remove(&dk_inos, e);
+}
+
+static bool dk_fill(void* ctx, uint8_t* buf, uint32_t len) {
+    uint32_t* sector = ctx;
+    if (!bc_read(*sector, buf, len)) return false;
+    *sector += (len + ATA_SECTOR - 1) / ATA_SECTOR;
+    return true;
+}
+
+// Reads a mounted file's content the first time it is needed
+static bool fs_file_load(fs_node_t* file) {
+    if (!(file->flags & FS_NODE_ONDISK)) return true;
+    fs_map_entry_t* e = fs_map_find(&dk_inos, file);
+    if (!e) return false;
+    const dk_inode_t* d = &dk_table[e->value];
+    uint32_t sector = dk_super.data_start + d->start;
+    bool changed = fs_changed;
+    file->flags = (file->flags & ~FS_NODE_ONDISK) | FS_NODE_INLINE;
+    file->size = 0;
+    bool ok = fs_fill(file, d->size, dk_fill, &sector);
+    if (!ok) {
+        fs_truncate(file, 0);
+        file->flags = (file->flags & ~FS_NODE_INLINE) | FS_NODE_ONDISK;
+        file->extents = NULL;
+        file->size = d->size;
+    } else {
+        dk_loads++;
+    }
+    file->flags &= ~FS_NODE_DIRTY;   // same as on disk
+    fs_changed = changed;
+    return ok;
+}
+
+// Allocates empty in-memory tables for a layout
+static bool dk_alloc_tables(const dk_super_t* super) {
+    kfree(dk_table); kfree(dk_bitmap); kfree(dk_meta_dirty);
+    dk_table = kmalloc(super->inode_count * sizeof(dk_inode_t));
+    dk_bitmap = kmalloc(super->bitmap_sectors * ATA_SECTOR);
+    dk_meta_dirty = kmalloc(super->data_start);
+    if (!dk_table || !dk_bitmap || !dk_meta_dirty) {
+        kfree(dk_table); kfree(dk_bitmap); kfree(dk_meta_dirty);
+        dk_table = NULL; dk_bitmap = NULL; dk_meta_dirty = NULL;
+        return false;
+    }
+    memset(dk_table, 0, super->inode_count * sizeof(dk_inode_t));
+    memset(dk_bitmap, 0, super->bitmap_sectors * ATA_SECTOR);
+    memset(dk_meta_dirty, 0, super->data_start);
+    dk_super = *super;
+    fs_map_clear(&dk_inos);
+    dk_ino_hint = DK_ROOT + 1;
+    dk_block_hint = 0;
+    dk_used_inodes = 1;
+    dk_free_blocks = super->data_blocks;
+    dk_freeing_count = 0;
+    bc_meta_clusters = (super->data_start + BC_SECTORS - 1) / BC_SECTORS;
+    return true;
+}
+
+// Marks exactly the blocks of the attached files, the reserved ones and
+// those past the end; sectors that change are written at the next checkpoint
+static bool dk_rebuild_bitmap() {
+    uint32_t words = dk_super.bitmap_sectors * ATA_SECTOR / 4;
+    uint32_t* bitmap = kmalloc(words * 4);
+    if (!bitmap) return false;
+    memset(bitmap, 0, words * 4);
+    uint32_t reserved = dk_reserved_blocks(&dk_super);
+    for (uint32_t b = 0; b < words * 32; b++)
+        if (b < reserved || b >= dk_super.data_blocks) bitmap[b / 32] |= 1u << (b % 32);
+    for (uint32_t ino = DK_ROOT + 1; ino < dk_super.inode_count; ino++) {
+        const dk_inode_t* d = &dk_table[ino];
+        if (d->type != FS_FILE) continue;
+        for (uint32_t b = d->start; b < d->start + d->blocks; b++) bitmap[b / 32] |= 1u << (b % 32);
+    }
+    for (uint32_t w = 0; w < words; w++)
+        if (bitmap[w] != dk_bitmap[w]) dk_meta_dirty[dk_super.bitmap_start + w * 4 / ATA_SECTOR] = 1;
+    kfree(dk_bitmap);
+    dk_bitmap = bitmap;
+    dk_free_blocks = 0;
+    for (uint32_t b = 0; b < dk_super.data_blocks; b++) if (!dk_block_used(b)) dk_free_blocks++;
+    dk_freeing_count = 0;
+    return true;
+}
+
+// Checks a node read from disk and attaches it to the tree
+static fs_node_t* dk_attach(uint32_t ino, fs_node_t* parent) {
+    dk_inode_t* d = &dk_table[ino];
+    d->name[MAX_FILENAME - 1] = '\0';
+    if (!parent || parent->type != FS_DIRECTORY || !fsimg_valid_name(d->name)) return NULL;
+    if (d->type == FS_FILE && (d->start > dk_super.data_blocks || d->blocks > dk_super.data_blocks - d->start ||
+                               d->blocks < fs_blocks_for(d->size))) return NULL;
+    if ((d->type != FS_FILE && d->type != FS_DIRECTORY) || fs_find_child(parent, d->name)) return NULL;
+    fs_node_t* node;
+    if (!fs_map_reserve(&dk_inos) || !(node = fs_create_node(d->name, d->type, parent))) return NULL;
+    if (d->type == FS_FILE) {
+        node->flags = FS_NODE_ONDISK;
+        node->extents = NULL;
+        node->size = d->size;
+        ix_file_changed(node);
+    }
+    node->created_time = d->created_time;
+    node->permissions = d->permissions;
+    fs_map_put(&dk_inos, node, ino);
+    return node;
+}
+
+// Builds the tree from the loaded inode table. Inodes come in any order,
+// so each pass attaches those whose parent is already attached; inodes
+// that are invalid or never reachable are freed.
+static bool dk_build_tree() {
+    uint32_t count = dk_super.inode_count;
+    fs_node_t** nodes = kmalloc(count * sizeof(fs_node_t*));
+    if (!nodes || !fs_map_reserve(&dk_inos)) { kfree(nodes); return false; }
+    memset(nodes, 0, count * sizeof(fs_node_t*));
+    nodes[DK_ROOT] = fs_root;
+    fs_map_put(&dk_inos, fs_root, DK_ROOT);
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (uint32_t ino = DK_ROOT + 1; ino < count; ino++) {
+            dk_inode_t* d = &dk_table[ino];
+            if (!d->type || nodes[ino] || d->parent >= count || !nodes[d->parent]) continue;
+            if (!(nodes[ino] = dk_attach(ino, nodes[d->parent]))) dk_free_inode(ino);
+            else progress = true;
         }
     }
-    
-    // User home - CORRIGÉ: casts pour éviter warnings  
-    fs_node_t* home = fs_find_child(fs_root, "home");
-    if (home) {
-        fs_node_t* user = fs_create_node("user", FS_DIRECTORY, home);
-        if (user) {
-            fs_node_t* readme = fs_create_node("readme.txt", FS_FILE, user);
-            if (readme && (size_t)file_data_used + 1000 < sizeof(file_data_pool)) {
-                const char* content = "🎯 HybridOS Ultimate v2.0 - COMPLETE FEATURES GUIDE\n"
-                "================================================================\n\n"
-                "📁 FILE SYSTEM COMMANDS:\n"
-                "  ls [path]         - List files and directories\n"
-                "  cd <path>         - Change directory (try 'cd ..' or 'cd /')\n"
-                "  pwd               - Show current directory\n"
-                "  mkdir <name>      - Create directory\n"
-                "  touch <name>      - Create empty file\n"
-                "  cat <file>        - Display file contents\n"
-                "  cp <src> <dest>   - Copy file\n"
-                "  mv <old> <new>    - Move/rename file\n"
-                "  rm <file>         - Remove file\n"
-                "  find <pattern>    - Search for files\n"
-                "  grep <text> <file> - Search in file\n\n"
-                "✍️ TEXT EDITOR:\n"
-                "  edit <filename>   - Open built-in editor\n"
-                "  Ctrl+S           - Save file\n"
-                "  Ctrl+X           - Exit editor\n\n"
-                "🎮 GAMES & GRAPHICS:\n"
-                "  snake            - Snake game (WASD to move, Q to quit)\n"
-                "  pong             - Pong game (WS for paddle)\n"
-                "  graphics         - VGA graphics mode demo\n"
-                "  matrix           - Matrix digital rain effect\n\n"
-                "🔧 SYSTEM MANAGEMENT:\n"
-                "  ps               - List running processes\n"
-                "  kill <pid>       - Terminate process\n"
-                "  reboot           - Restart system\n"
-                "  clear            - Clear screen\n\n"
-                "🌐 NETWORK TOOLS:\n"
-                "  ping <host>      - Ping a host\n"
-                "  http             - Start HTTP server\n\n"
-                "💻 DEVELOPMENT:\n"
-                "  compile <file.c> - C compiler\n"
-                "  basic <code>     - BASIC interpreter\n"
-                "  run <program>    - Execute program\n\n"
-                "⌨️ INTERFACE FEATURES:\n"
-                "  ↑↓ Arrow keys   - Command history\n"
-                "  Tab             - Command autocompletion\n"
-                "  Real-time clock - Top right corner\n"
-                "  Colored output  - Full VGA colors\n\n"
-                "🎯 TRY THESE DEMOS:\n"
-                "  cd /etc && cat motd\n"
-                "  edit hello.c\n"
-                "  snake\n"
-                "  graphics\n"
-                "  matrix\n\n"
-                "💡 This file was created by the filesystem!\n"
-                "Edit it with: edit readme.txt\n";
-                readme->content = &file_data_pool[file_data_used];
-                strcpy(readme->content, content);
-                readme->size = strlen(content);
-                file_data_used += readme->size + 1;
-            }
-            
-            fs_node_t* demo = fs_create_node("demo.c", FS_FILE, user);
-            if (demo && (size_t)file_data_used + 300 < sizeof(file_data_pool)) {
-                const char* content = "#include <stdio.h>\n\nint main() {\n    printf(\"Hello from HybridOS!\\n\");\n    printf(\"This C code runs on our hybrid kernel!\\n\");\n    \n    // Features demo\n    for (int i = 0; i < 5; i++) {\n        printf(\"Loop %d: Windows + Linux = HybridOS\\n\", i);\n    }\n    \n    return 0;\n}\n\n// Try: compile demo.c\n//      run demo\n";
-                demo->content = &file_data_pool[file_data_used];
-                strcpy(demo->content, content);
-                demo->size = strlen(content);
-                file_data_used += demo->size + 1;
-            }
+    for (uint32_t ino = DK_ROOT + 1; ino < count; ino++)
+        if (dk_table[ino].type && !nodes[ino]) dk_free_inode(ino);
+    kfree(nodes);
+    return true;
+}
+
+// Empties the tree, deepest nodes first
+static void dk_clear_tree() {
+    current_dir = fs_root;
+    while (fs_child_count(fs_root)) {
+        fs_node_t* node = fs_root;
+        while (fs_child_count(node)) node = fs_child(node, fs_child_count(node) - 1);
+        fs_remove_node(node);
+    }
+}
+
+// Replaces the tree with the one on the disk
+bool dk_mount() {
+    if (!disk_present || !bc_init()) return false;
+    dk_super_t super;
+    if (!bc_read(0, &super, sizeof(super)) || super.magic != DK_MAGIC || super.version != DK_VERSION) return false;
+    if (super.sectors > disk_sectors || super.inode_start != 1 || super.inode_count <= DK_ROOT ||
+        super.inode_count > DK_MAX_INODES || super.inode_count % DK_INODES_PER_SECTOR ||
+        super.bitmap_start != super.inode_start + super.inode_count / DK_INODES_PER_SECTOR ||
+        super.data_start != super.bitmap_start + super.bitmap_sectors ||
+        super.data_start > super.sectors || super.data_blocks > super.sectors - super.data_start ||
+        super.bitmap_sectors * DK_BITS_PER_SECTOR < super.data_blocks) return false;
+    if (!dk_alloc_tables(&super)) return false;
+    if (!bc_read(super.inode_start, dk_table, super.inode_count * sizeof(dk_inode_t)) ||
+        !bc_read(super.bitmap_start, dk_bitmap, super.bitmap_sectors * ATA_SECTOR)) return false;
+    dk_used_inodes = 1;
+    for (uint32_t ino = DK_ROOT + 1; ino < super.inode_count; ino++) if (dk_table[ino].type) dk_used_inodes++;
+    dk_clear_tree();
+    if (!dk_build_tree() || !dk_rebuild_bitmap()) return false;
+    fs_changed = false;
+    dk_mounted = true;
+    return true;
+}
+
+// Writes a file's content to a new run; the old run is freed once the
+// inode pointing to the new one is on the disk
+static bool dk_save_data(fs_node_t* file, dk_inode_t* d) {
+    uint32_t blocks = fs_blocks_for(file->size);
+    uint32_t start = dk_alloc_run(blocks);
+    if (start == FS_NO_BLOCK) return false;
+    uint8_t* copy;
+    const uint8_t* data = fs_view(file, &copy);
+    bool ok = data && bc_write(dk_super.data_start + start, data, file->size);
+    kfree(copy);
+    if (!ok) { dk_blocks_mark(start, blocks, false); return false; }   // referenced by nothing yet
+    dk_defer_free(d->start, d->blocks);
+    d->start = start;
+    d->blocks = blocks;
+    return true;
+}
+
+static bool dk_save_node(fs_node_t* node) {
+    fs_map_entry_t* e = fs_map_find(&dk_inos, node);
+    bool fresh = !e;
+    uint32_t ino;
+    if (e) {
+        ino = e->value;
+    } else {
+        if (!fs_map_reserve(&dk_inos) || !(ino = dk_alloc_inode())) return false;
+        fs_map_put(&dk_inos, node, ino);
+    }
+    dk_inode_t d = dk_table[ino];
+    d.parent = node == fs_root ? 0 : fs_map_find(&dk_inos, node->parent)->value;
+    d.type = node->type;
+    d.permissions = node->permissions;
+    d.created_time = node->created_time;
+    memset(d.name, 0, sizeof(d.name));
+    strcpy(d.name, node->name);
+    if (node->type == FS_FILE) {
+        d.size = node->size;
+        if ((fresh || (node->flags & FS_NODE_DIRTY)) && !(node->flags & FS_NODE_ONDISK) && !dk_save_data(node, &d))
+            return false;
+        node->flags &= ~FS_NODE_DIRTY;
+    }
+    if (memcmp(&d, &dk_table[ino], sizeof(d)) != 0) {
+        dk_table[ino] = d;
+        dk_inode_changed(ino);
+    }
+    return true;
+}
+
+// Writes the changes since the last checkpoint into the buffer cache
+static bool dk_checkpoint() {
+    if (!dk_mounted) return true;
+    fs_changed = false;
+    fs_walk_t w;
+    fs_walk_begin(&w, fs_root);
+    fs_node_t* node;
+    bool ok = true;
+    while (ok && (node = fs_walk_next(&w))) ok = dk_save_node(node);
+    fs_walk_end(&w);
+    for (uint32_t s = dk_super.inode_start; ok && s < dk_super.data_start; s++) {
+        if (!dk_meta_dirty[s]) continue;
+        const uint8_t* src = s < dk_super.bitmap_start
+            ? (const uint8_t*)dk_table + (s - dk_super.inode_start) * ATA_SECTOR
+            : (const uint8_t*)dk_bitmap + (s - dk_super.bitmap_start) * ATA_SECTOR;
+        if ((ok = bc_write(s, src, ATA_SECTOR))) dk_meta_dirty[s] = 0;
+    }
+    if (!ok) fs_changed = true;
+    else dk_epoch++;
+    return ok;
+}
+
+// Makes every file resident, e.g. before the disk is reformatted
+static bool dk_load_all() {
+    fs_walk_t w;
+    fs_walk_begin(&w, fs_root);
+    fs_node_t* node;
+    bool ok = true;
+    while (ok && (node = fs_walk_next(&w))) ok = node->type != FS_FILE || fs_file_load(node);
+    fs_walk_end(&w);
+    return ok;
+}
+
+// Creates an empty filesystem over the whole disk and writes the tree to it
+bool dk_format() {
+    if (!disk_present || !bc_init() || (dk_mounted && !dk_load_all())) return false;
+    dk_super_t super = {0};
+    super.magic = DK_MAGIC;
+    super.version = DK_VERSION;
+    super.sectors = disk_sectors;
+    super.inode_count = disk_sectors / 8;    // one inode per 4 KB
+    if (super.inode_count < 64) super.inode_count = 64;
+    if (super.inode_count > DK_MAX_INODES) super.inode_count = DK_MAX_INODES;
+    super.inode_count -= super.inode_count % DK_INODES_PER_SECTOR;
+    super.inode_start = 1;
+    super.bitmap_start = super.inode_start + super.inode_count / DK_INODES_PER_SECTOR;
+    if (super.bitmap_start + 64 > disk_sectors) return false;
+    uint32_t rest = disk_sectors - super.bitmap_start;
+    super.bitmap_sectors = (rest + DK_BITS_PER_SECTOR) / (DK_BITS_PER_SECTOR + 1);
+    super.data_start = super.bitmap_start + super.bitmap_sectors;
+    super.data_blocks = disk_sectors - super.data_start;
+    dk_mounted = false;
+    if (!dk_alloc_tables(&super)) return false;
+    for (uint32_t b = super.data_blocks; b < super.bitmap_sectors * DK_BITS_PER_SECTOR; b++)
+        dk_bitmap[b / 32] |= 1u << (b % 32);     // past the end of the disk
+    dk_blocks_mark(0, dk_reserved_blocks(&super), true);
+    memset(dk_meta_dirty, 1, super.data_start);
+    dk_table[DK_ROOT].type = FS_DIRECTORY;
+    if (!fs_map_reserve(&dk_inos)) return false;
+    fs_map_put(&dk_inos, fs_root, DK_ROOT);
+    // The superblock goes last: a format that fails leaves no filesystem
+    dk_super_t none = {0};
+    if (!bc_write(0, &none, sizeof(none))) return false;
+    dk_mounted = true;
+    if (!dk_checkpoint() || !bc_write(0, &super, sizeof(super))) { dk_mounted = false; return false; }
+    return bc_flush(BC_ENTRIES) && disk_flush();
+}
+
+// Checkpoint, then everything to the platter; records the latency
+bool dk_sync() {
+    uint64_t start = time_us();
+    uint32_t written = disk_writes;
+    bool ok = dk_checkpoint() && bc_flush(BC_ENTRIES) && disk_flush();
+    dk_release();
+    dk_sync_us = (uint32_t)(time_us() - start);
+    dk_sync_sectors = disk_writes - written;
+    return ok;
+}
+
+// Idle work: checkpoints changes now and then, and trickles dirty
+// clusters to the disk a batch at a time
+void dk_background() {
+    if (!dk_mounted) return;
+    uint32_t now = time_ms();
+    if (fs_changed && now - dk_last_checkpoint >= DK_CHECKPOINT_MS) {
+        dk_last_checkpoint = now;
+        dk_checkpoint();
+    }
+    if (bc_dirty && now - dk_last_flush >= DK_FLUSH_MS) {
+        dk_last_flush = now;
+        bc_flush(DK_FLUSH_BATCH);
+    }
+    dk_release();
+}
+
+void boot_mount_disk() {
+    disk_init();
+    if (!disk_present) return;
+    term_write("Disk: "); term_write(disk_model); term_write(", ");
+    term_write_dec(disk_sectors / 2048); term_write(" MB, ");
+    if (dk_mount()) {
+        term_write_dec(dk_used_inodes); term_write(" inodes mounted\n");
+    } else {
+        term_write("no filesystem (disk format)\n");
+    }
+}
+
+// ==================== SERIAL ====================
+// COM1 16550: a second console for headless runs (QEMU -nographic). The
+// screen is mirrored into a TX ring and received bytes become keys. IRQ 4
+// moves bytes between the rings and the FIFOs; writers never wait, a full
+// TX ring drops bytes and counts them, a full RX ring leaves them in the
+// chip. kernel_idle() also polls the chip, in case the interrupt never
+// comes.
+#define COM1 0x3F8
+#define SERIAL_TX_SIZE 8192      // powers of two
+#define SERIAL_RX_SIZE 1024
+#define SERIAL_FIFO 16
+
+static bool serial_present = false, serial_irq_driven = false;
+static uint8_t serial_ier = 0;
+static volatile bool serial_tx_busy = false;     // THR empty interrupt armed
+static char serial_tx[SERIAL_TX_SIZE], serial_rx[SERIAL_RX_SIZE];
+static volatile uint32_t serial_tx_head = 0, serial_tx_tail = 0;
+static volatile uint32_t serial_rx_head = 0, serial_rx_tail = 0;
+static volatile uint32_t serial_irqs = 0, serial_tx_dropped = 0, serial_rx_dropped = 0;
+static uint32_t serial_tx_bytes = 0, serial_rx_bytes = 0;
+#define SERIAL_ESC_US 50000     // an ESC alone that long is the Escape key
+static char serial_escape = 0;      // ESC, '[', the digit of a sequence read so far, 1 to skip one
+static uint64_t serial_escape_us = 0;
+
+extern void serial_isr(void);
+
+// Moves bytes between the chip and the rings, with interrupts off. While
+// the RX ring is full, received bytes wait in the FIFO with the RX
+// interrupt off; what overruns the FIFO is lost and counted.
+static void serial_service() {
+    uint8_t status = inb(COM1 + 5);
+    while ((status & 0x01) && serial_rx_tail - serial_rx_head < SERIAL_RX_SIZE) {
+        serial_rx[serial_rx_tail++ & (SERIAL_RX_SIZE - 1)] = inb(COM1);
+        if (status & 0x02) serial_rx_dropped++;
+        status = inb(COM1 + 5);
+    }
+    int n = 0;
+    if (status & 0x20)
+        for (; n < SERIAL_FIFO && serial_tx_head != serial_tx_tail; n++)
+            outb(COM1, serial_tx[serial_tx_head++ & (SERIAL_TX_SIZE - 1)]);
+    // Interrupt once the FIFO is empty, to refill it or go idle
+    bool busy = n > 0 || (!(status & 0x20) && serial_tx_head != serial_tx_tail);
+    uint8_t ier = (serial_rx_tail - serial_rx_head < SERIAL_RX_SIZE ? 0x01 : 0) | (busy ? 0x02 : 0);
+    if (ier != serial_ier) outb(COM1 + 1, ier);
+    serial_ier = ier;
+    serial_tx_busy = busy;
+}
+
+// Called by serial_isr, until the chip has nothing pending: the PIC is
+// edge triggered and would not see a new interrupt otherwise
+void serial_irq() {
+    serial_irqs++;
+    while (!(inb(COM1 + 2) & 0x01)) serial_service();
+    outb(0x20, 0x20);
+}
+
+static void serial_poll() {
+    if (!serial_present) return;
+    uint32_t flags = irq_save();
+    serial_service();
+    irq_restore(flags);
+}
+
+void serial_init() {
+    outb(COM1 + 1, 0x00);        // no interrupts
+    outb(COM1 + 3, 0x80);        // divisor latch
+    outb(COM1 + 0, 0x01);        // 115200 baud
+    outb(COM1 + 1, 0x00);
+    outb(COM1 + 3, 0x03);        // 8N1
+    outb(COM1 + 2, 0xC7);        // FIFOs on and cleared, RX interrupt at 14 bytes
+    outb(COM1 + 4, 0x1E);        // loopback, to check the chip is there
+    outb(COM1, 0xAE);
+    if (inb(COM1) != 0xAE) return;
+    outb(COM1 + 4, 0x0B);        // DTR, RTS, OUT2 routes the interrupt
+    serial_present = true;
+    outb(COM1 + 1, 0x01);        // received data; THR empty while sending
+    serial_ier = 0x01;
+    serial_irq_driven = irq_install(4, serial_isr);
+}
+
+void serial_putchar(char c) {
+    if (!serial_present) return;
+    const char* bytes = c == '\n' ? "\r\n" : c == '\b' ? "\b \b" : &c;
+    size_t len = c == '\n' ? 2 : c == '\b' ? 3 : 1;
+    if (SERIAL_TX_SIZE - (serial_tx_tail - serial_tx_head) < len) { serial_tx_dropped += len; return; }
+    for (size_t k = 0; k < len; k++) serial_tx[serial_tx_tail++ & (SERIAL_TX_SIZE - 1)] = bytes[k];
+    serial_tx_bytes += len;
+    // An idle transmitter needs a first write to start interrupting;
+    // without the IRQ every write pushes the FIFO
+    if (!serial_tx_busy || !serial_irq_driven) serial_poll();
+}
+
+static bool serial_key_ready() {
+    return serial_rx_head != serial_rx_tail || (serial_escape == 27 && time_us() - serial_escape_us >= SERIAL_ESC_US);
+}
+
+// The next received byte as a key (see read_key): CR is Enter, DEL
+// backspace, ESC [ A-D the arrows, ESC [ H / F Home and End, ESC [ 5 ~ /
+// 6 ~ Page Up and Down. Other ESC [ sequences are skipped up to their final
+// byte (@ to ~); an ESC followed by anything else, or by nothing for
+// SERIAL_ESC_US, is Escape. 0 while a sequence is incomplete.
+static char serial_key() {
+    if (serial_escape == 27 && (serial_rx_head == serial_rx_tail || serial_rx[serial_rx_head & (SERIAL_RX_SIZE - 1)] != '[')) {
+        serial_escape = 0;
+        return 27;                   // what follows stays for the next call
+    }
+    char c = serial_rx[serial_rx_head++ & (SERIAL_RX_SIZE - 1)];
+    serial_rx_bytes++;
+    if (!(serial_ier & 0x01)) serial_poll();     // room again for what waits in the FIFO
+    static const char arrows[] = "ABDCHF";
+    if (serial_escape && c >= 0x20) {
+        char seq = serial_escape;
+        if (seq == 27) { serial_escape = '['; return 0; }
+        if (c < 0x40) {              // parameter: keeps a first digit, anything longer is unknown
+            serial_escape = seq == '[' && c >= '0' && c <= '9' ? c : 1;
+            return 0;
         }
+        serial_escape = 0;
+        if (c == 0x7F) return 0;
+        if (seq == '[') {
+            const char* at = strchr(arrows, c);
+            return at ? (char)(at - arrows + 1) : 0;
+        }
+        return c == '~' && (seq == '5' || seq == '6') ? (seq == '5' ? 11 : 12) : 0;
     }
+    serial_escape = 0;               // a control byte cuts a sequence short
+    if (c == 27) { serial_escape = c; serial_escape_us = time_us(); return 0; }
+    if (c == '\r') return '\n';
+    if (c == 0x7F) return '\b';
+    return c;
+}
+
+void cmd_serial() {
+    if (!serial_present) { term_write("No serial port on COM1\n"); return; }
+    term_write("COM1: 115200 8N1, 16-byte FIFOs, "); term_write_dec(serial_irqs); term_write(" interrupts\n");
+    term_write("  sent "); term_write_dec(serial_tx_bytes); term_write(" bytes, dropped "); term_write_dec(serial_tx_dropped);
+    term_write("\n  received "); term_write_dec(serial_rx_bytes); term_write(" bytes, dropped "); term_write_dec(serial_rx_dropped); term_write("\n");
 }
 
 // ==================== KEYBOARD INPUT ====================
-char read_key() {
+static bool input_replaying;     // see Record and replay
+
+// Background work, run while waiting for a key
+static void kernel_idle() {
+    fs_background();
+    ix_background();
+    blk_poll();
+    dk_background();
+    serial_poll();
+#ifdef HOSTED
+    hosted_idle(serial_key_ready() || input_replaying);
+#endif
+}
+
+// ---- Record and replay ----
+// read_key() can log every key with its time, to be fed back later at the
+// recorded pace or as fast as the keys are consumed. A key's latency runs
+// from when it was available (its due time in a replay) to the next time a
+// program asks for input, its echo drawn: a keystroke to screen benchmark
+// for the shell, the editor and the games.
+#define INPUT_MAGIC 0x5359454B   // "KEYS", then the count and the events
+#define INPUT_SAMPLES 1024
+
+typedef struct {
+    uint32_t time_us;            // since the recording started
+    uint32_t key;
+} input_event_t;
+
+static input_event_t* input_events = NULL;
+static uint32_t input_count = 0, input_capacity = 0, input_next = 0;
+static bool input_recording = false, input_replaying = false, input_fast = false;
+static uint64_t input_start = 0;
+static uint64_t input_pending = 0;       // when the last key came, 0 once echoed
+static char input_path[MAX_PATH];
+static uint32_t input_replay_keys = 0, input_replay_ms = 0;    // last replay
+static uint32_t input_latency[INPUT_SAMPLES], input_samples = 0;
+
+static char scancode_key(uint8_t scancode) {
     static const char scancode_ascii[] = {
         0, 27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
         '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
@@ -534,14 +4714,15 @@ char read_key() {
         '*', 0, ' '
     };
     
-    while (!(inb(0x64) & 1));
-    uint8_t scancode = inb(0x60);
-    
     // Special keys
     if (scancode == 0x48) return 1; // Up arrow
     if (scancode == 0x50) return 2; // Down arrow
     if (scancode == 0x4B) return 3; // Left arrow
     if (scancode == 0x4D) return 4; // Right arrow
+    if (scancode == 0x47) return 5; // Home
+    if (scancode == 0x4F) return 6; // End
+    if (scancode == 0x49) return 11; // Page Up
+    if (scancode == 0x51) return 12; // Page Down
     if (scancode == 0x0F) return '\t'; // Tab
     
     if (scancode & 0x80) return 0; // Key release
@@ -549,153 +4730,628 @@ char read_key() {
     return 0;
 }
 
-void get_input_with_history(char* buffer, int max_len) {
-    int pos = 0;
-    char c;
-    
-    while (pos < max_len - 1) {
-        c = read_key();
-        
-        if (c == '\n') {
-            buffer[pos] = '\0';
-            term_putchar('\n');
-            
-            if (pos > 0 && history_count < 10) {
-                strcpy(command_history[history_count], buffer);
-                history_count++;
-            }
-            history_pos = history_count;
-            break;
-        } else if (c == '\b' && pos > 0) {
-            pos--;
-            term_putchar('\b');
-        } else if (c == 1) { // Up arrow
-            if (history_pos > 0) {
-                history_pos--;
-                while (pos > 0) { pos--; term_putchar('\b'); }
-                strcpy(buffer, command_history[history_pos]);
-                pos = strlen(buffer);
-                term_write(buffer);
-            }
-        } else if (c == 2) { // Down arrow
-            if (history_pos < history_count - 1) {
-                history_pos++;
-                while (pos > 0) { pos--; term_putchar('\b'); }
-                strcpy(buffer, command_history[history_pos]);
-                pos = strlen(buffer);
-                term_write(buffer);
-            }
-        } else if (c == '\t') { // Tab completion
-            if (pos > 0) {
-                const char* commands[] = {"ls", "cd", "pwd", "mkdir", "touch", "cat", "echo", "rm", "cp", "mv", "find", "grep", "edit", "help", "clear", "tree", "about", "ps", "kill", "snake", "pong", "graphics", "matrix", "ping", "http", "compile", "run", "basic", "reboot", NULL};
-                for (int i = 0; commands[i]; i++) {
-                    if (starts_with(commands[i], buffer)) {
-                        while (pos > 0) { pos--; term_putchar('\b'); }
-                        strcpy(buffer, commands[i]);
-                        pos = strlen(buffer);
-                        term_write(buffer);
-                        break;
-                    }
-                }
-            }
-        } else if (c && c > 31) {
-            buffer[pos++] = c;
-            term_putchar(c);
-        }
+static void input_echoed() {
+    if (!input_pending) return;
+    input_latency[input_samples++ % INPUT_SAMPLES] = (uint32_t)(time_us() - input_pending);
+    input_pending = 0;
+}
+
+static void input_record(char key, uint64_t now) {
+    if (input_count == input_capacity) {
+        uint32_t capacity = input_capacity ? input_capacity * 2 : 256;
+        input_event_t* grown = krealloc(input_events, capacity * sizeof(input_event_t));
+        if (!grown) return;
+        input_events = grown;
+        input_capacity = capacity;
+    }
+    input_events[input_count].time_us = (uint32_t)(now - input_start);
+    input_events[input_count++].key = (uint8_t)key;
+}
+
+static void input_replay_end() {
+    input_replay_keys = input_next;
+    input_replay_ms = (uint32_t)udiv64(time_us() - input_start, 1000);
+    input_replaying = false;
+    kfree(input_events);
+    input_events = NULL;
+    input_count = input_capacity = 0;
+}
+
+// Pressing a key on the keyboard ends a replay
+static bool input_replay_due() {
+    if ((inb(0x64) & 1) && !(inb(0x60) & 0x80)) input_replay_end();
+    if (!input_replaying) return false;
+    return input_fast || time_us() >= input_start + input_events[input_next].time_us;
+}
+
+// For loops that poll instead of waiting in read_key()
+bool key_ready() {
+    input_echoed();
+    if (input_replaying) return input_replay_due();
+    return (inb(0x64) & 1) || serial_key_ready();
+}
+
+// The next key, 0 for a release or an unmapped key
+char read_key() {
+    input_echoed();
+    char key;
+    uint64_t now;
+    while (input_replaying && !input_replay_due()) kernel_idle();
+    if (input_replaying) {
+        input_event_t* event = &input_events[input_next++];
+        key = (char)event->key;
+        now = input_fast ? time_us() : input_start + event->time_us;
+        if (input_next == input_count) input_replay_end();
+    } else {
+        while (!(inb(0x64) & 1) && !serial_key_ready()) kernel_idle();
+        if (!(key = (inb(0x64) & 1) ? scancode_key(inb(0x60)) : serial_key())) return 0;
+        now = time_us();
+        if (input_recording) input_record(key, now);
+    }
+    input_pending = now;
+    return key;
+}
+
+bool input_record_start(const char* path) {
+    fs_node_t* file = fs_open_file(path);
+    if (!file || file->type != FS_FILE || !fs_truncate(file, 0)) return false;
+    fs_get_path(file, input_path);
+    input_count = 0;
+    input_recording = true;
+    input_start = time_us();
+    return true;
+}
+
+// Writes the recording, without the keys that typed the command stopping
+// it; the number of keys saved, -1 when the file can't be written
+int input_record_stop() {
+    uint32_t n = input_count;
+    if (n && input_events[n - 1].key == '\n') n--;
+    while (n && input_events[n - 1].key != '\n') n--;
+    input_recording = false;
+    fs_node_t* file = fs_open_file(input_path);
+    uint32_t header[2] = { INPUT_MAGIC, n };
+    bool ok = file && file->type == FS_FILE && fs_truncate(file, 0) && fs_write(file, 0, header, sizeof(header)) &&
+              fs_write(file, sizeof(header), input_events, n * sizeof(input_event_t));
+    kfree(input_events);
+    input_events = NULL;
+    input_count = input_capacity = 0;
+    return ok ? (int)n : -1;
+}
+
+// Loads a recording and starts feeding it to read_key(); fast ignores the
+// recorded times
+const char* input_replay_start(const char* path, bool fast) {
+    fs_node_t* file = fs_resolve_path(path);
+    uint32_t header[2];
+    if (!file || file->type != FS_FILE) return "No such file";
+    if (fs_read(file, 0, header, sizeof(header)) != sizeof(header) || header[0] != INPUT_MAGIC ||
+        (file->size - sizeof(header)) / sizeof(input_event_t) != header[1]) return "Not a key recording";
+    if (!header[1]) return "No keys recorded";
+    if (!(input_events = kmalloc(header[1] * sizeof(input_event_t)))) return "Out of memory";
+    fs_read(file, sizeof(header), input_events, header[1] * sizeof(input_event_t));
+    input_count = input_capacity = header[1];
+    input_next = 0;
+    input_fast = fast;
+    input_replaying = true;
+    input_start = time_us();
+    return NULL;
+}
+
+int shell_complete(char* buffer, int pos, int max_len);
+
+void shell_prompt() {
+    term_setcolor(0x0A);
+    term_write("[");
+    term_setcolor(0x0E);
+    term_write(current_path);
+    term_setcolor(0x0A);
+    term_write("] ");
+    term_setcolor(0x0B);
+    term_write("HybridOS");
+    term_setcolor(0x0D);
+    term_write(">");
+    term_setcolor(0x07);
+    term_write(" ");
+}
+
+void get_input_with_history(char* buffer, int max_len) {
+    int pos = 0;
+    char c;
+    
+    while (pos < max_len - 1) {
+        c = read_key();
+        
+        if (c == '\n') {
+            buffer[pos] = '\0';
+            term_putchar('\n');
+            
+            if (pos > 0 && history_count < 10) {
+                strcpy(command_history[history_count], buffer);
+                history_count++;
+            }
+            history_pos = history_count;
+            break;
+        } else if (c == '\b' && pos > 0) {
+            pos--;
+            term_putchar('\b');
+        } else if (c == 1) { // Up arrow
+            if (history_pos > 0) {
+                history_pos--;
+                while (pos > 0) { pos--; term_putchar('\b'); }
+                strcpy(buffer, command_history[history_pos]);
+                pos = strlen(buffer);
+                term_write(buffer);
+            }
+        } else if (c == 2) { // Down arrow
+            if (history_pos < history_count - 1) {
+                history_pos++;
+                while (pos > 0) { pos--; term_putchar('\b'); }
+                strcpy(buffer, command_history[history_pos]);
+                pos = strlen(buffer);
+                term_write(buffer);
+            }
+        } else if (c == '\t') { // Tab completion
+            pos = shell_complete(buffer, pos, max_len);
+        } else if (c && c > 31) {
+            buffer[pos++] = c;
+            term_putchar(c);
+        }
+    }
+}
+
+// ==================== EDITOR ====================
+// The text is a gap buffer: [0, gap_start) and [gap_end, capacity) hold it,
+// the gap between them is free space left where the last edit happened.
+// Typing or deleting at the cursor only moves an edge of the gap; moving
+// the cursor does nothing until the next edit, which first slides the gap
+// there at the cost of the distance, not of the file size. A full gap
+// doubles the buffer.
+// Line starts are indexed in a second gap buffer, kept at the cursor's
+// line: starts before its gap are offsets, starts after it are distances
+// from the end of the text, which edits before them leave unchanged. A
+// line's start is one lookup, so jumps and scrolling cost nothing, and
+// typing a newline or joining two lines is an insertion at the gap.
+// The screen is redrawn incrementally: edits mark the text rows they
+// change in editor.dirty and a frame rewrites only those rows and the
+// status bar, then moves the hardware cursor. Each row starts straight at
+// its indexed line, so a frame costs a screenful however large the file is.
+// C files are highlighted by a small lexer whose only state across lines
+// is being inside a /* comment. The state each line starts in is cached
+// next to its index entry. An edit only marks its line: the next frame
+// re-lexes from there until a line ends in the state the following one
+// already had, past which nothing changed, or until the bottom of the view.
+#define EDITOR_GAP_MIN 4096
+#define EDITOR_LINES_MIN 1024
+#define EDITOR_TOP 2                        // first text row on screen
+#define EDITOR_ROWS (VGA_HEIGHT - 4)
+#define EDITOR_ALL_ROWS ((1u << EDITOR_ROWS) - 1)
+#define EDITOR_HEADER (1u << 31)
+#define LEX_CODE 0
+#define LEX_COMMENT 1                       // inside /* */
+
+static inline size_t editor_length() { return editor.capacity - (editor.gap_end - editor.gap_start); }
+
+static inline char editor_char(size_t pos) {
+    return editor.text[pos < editor.gap_start ? pos : pos + (editor.gap_end - editor.gap_start)];
+}
+
+static inline size_t editor_line_count() { return editor.line_capacity - (editor.line_gap_end - editor.line_gap_start); }
+
+static inline uint8_t* editor_line_state(size_t line) {
+    return editor.line_state + (line < editor.line_gap_start ? line : line + (editor.line_gap_end - editor.line_gap_start));
+}
+
+static inline size_t editor_line_start(size_t line) {
+    if (line < editor.line_gap_start) return editor.lines[line];
+    return editor_length() - editor.lines[line + (editor.line_gap_end - editor.line_gap_start)];
+}
+
+// Offset of the line's newline, or the length on the last line
+static inline size_t editor_line_end(size_t line) {
+    return line + 1 < editor_line_count() ? editor_line_start(line + 1) - 1 : editor_length();
+}
+
+// Edits at the cursor: the rows they change, the whole view when the
+// cursor's line is above it (lines renumbered under the top one)
+static void editor_mark(bool below) {
+    if (editor.line < editor.top) { editor.dirty |= EDITOR_ALL_ROWS; return; }
+    size_t row = editor.line - editor.top;
+    if (row < EDITOR_ROWS) editor.dirty |= below ? EDITOR_ALL_ROWS & ~((1u << row) - 1) : 1u << row;
+}
+
+static void editor_move_gap(size_t pos) {
+    if (pos < editor.gap_start) {
+        size_t n = editor.gap_start - pos;
+        memmove(editor.text + editor.gap_end - n, editor.text + pos, n);
+        editor.gap_start -= n;
+        editor.gap_end -= n;
+    } else if (pos > editor.gap_start) {
+        size_t n = pos - editor.gap_start;
+        memmove(editor.text + editor.gap_start, editor.text + editor.gap_end, n);
+        editor.gap_start += n;
+        editor.gap_end += n;
+    }
+}
+
+// Puts lines [0, line) before the index gap; the text is not edited yet
+static void editor_move_line_gap(size_t line) {
+    size_t length = editor_length();
+    while (editor.line_gap_start > line) {
+        editor.line_state[--editor.line_gap_end] = editor.line_state[--editor.line_gap_start];
+        editor.lines[editor.line_gap_end] = length - editor.lines[editor.line_gap_start];
+    }
+    while (editor.line_gap_start < line) {
+        editor.line_state[editor.line_gap_start] = editor.line_state[editor.line_gap_end];
+        editor.lines[editor.line_gap_start++] = length - editor.lines[editor.line_gap_end++];
+    }
+}
+
+static bool editor_grow() {
+    size_t tail = editor.capacity - editor.gap_end;
+    size_t capacity = editor.capacity * 2 > EDITOR_GAP_MIN ? editor.capacity * 2 : EDITOR_GAP_MIN;
+    char* text = krealloc(editor.text, capacity);
+    if (!text) return false;
+    memmove(text + capacity - tail, text + editor.gap_end, tail);
+    editor.text = text;
+    editor.gap_end = capacity - tail;
+    editor.capacity = capacity;
+    return true;
+}
+
+static bool editor_grow_lines() {
+    size_t tail = editor.line_capacity - editor.line_gap_end;
+    size_t capacity = editor.line_capacity * 2 > EDITOR_LINES_MIN ? editor.line_capacity * 2 : EDITOR_LINES_MIN;
+    // States first: if the index can't grow, a larger state array is harmless
+    uint8_t* states = krealloc(editor.line_state, capacity);
+    if (!states) return false;
+    editor.line_state = states;
+    size_t* lines = krealloc(editor.lines, capacity * sizeof(size_t));
+    if (!lines) return false;
+    memmove(lines + capacity - tail, lines + editor.line_gap_end, tail * sizeof(size_t));
+    memmove(states + capacity - tail, states + editor.line_gap_end, tail);
+    editor.lines = lines;
+    editor.line_gap_end = capacity - tail;
+    editor.line_capacity = capacity;
+    return true;
+}
+
+// The line's text changed: states after it are suspect until they meet
+// the cached ones again, which can't happen before the changed lines
+static void editor_lex_changed(size_t line) {
+    if (editor.lex_valid >= editor.lex_end || editor.lex_resume < line + 1) editor.lex_resume = line + 1;
+    if (editor.lex_valid > line + 1) editor.lex_valid = line + 1;
+}
+
+// Index entries move along with the lines after a split or a join
+static inline void editor_lex_shift(size_t after, int delta) {
+    if (editor.lex_valid > after) editor.lex_valid += delta;
+    if (editor.lex_resume > after) editor.lex_resume += delta;
+    if (editor.lex_end > after) editor.lex_end += delta;
+}
+
+static inline void editor_keep_column() { editor.column = editor.cursor_x - editor_line_start(editor.line); }
+
+bool editor_insert(char c) {
+    if (editor.gap_start == editor.gap_end && !editor_grow()) return false;
+    if (c == '\n' && editor.line_gap_start == editor.line_gap_end && !editor_grow_lines()) return false;
+    editor_move_gap(editor.cursor_x);
+    editor_move_line_gap(editor.line + 1);
+    editor.text[editor.gap_start++] = c;
+    editor.cursor_x++;
+    editor.modified = true;
+    if (c == '\n') {
+        editor_mark(true);
+        editor.line_state[editor.line_gap_start] = 0;
+        editor.lines[editor.line_gap_start++] = editor.cursor_x;
+        editor_lex_shift(editor.line + 1, 1);
+        editor_lex_changed(editor.line);
+        editor_lex_changed(++editor.line);
+    } else {
+        editor_mark(false);
+        editor_lex_changed(editor.line);
+    }
+    editor_keep_column();
+    return true;
+}
+
+void editor_backspace() {
+    if (!editor.cursor_x) return;
+    editor_move_gap(editor.cursor_x);
+    editor_move_line_gap(editor.line + 1);
+    char c = editor.text[--editor.gap_start];
+    editor.cursor_x--;
+    editor.modified = true;
+    if (c == '\n') {
+        editor.line_gap_start--;            // the cursor's line joins the one above
+        editor_lex_shift(editor.line, -1);
+        editor.line--;
+        editor_mark(true);
+    } else {
+        editor_mark(false);
+    }
+    editor_lex_changed(editor.line);
+    editor_keep_column();
+}
+
+void editor_left() {
+    if (!editor.cursor_x) return;
+    if (editor_char(--editor.cursor_x) == '\n') editor.line--;
+    editor_keep_column();
+}
+
+void editor_right() {
+    if (editor.cursor_x >= editor_length()) return;
+    if (editor_char(editor.cursor_x++) == '\n') editor.line++;
+    editor_keep_column();
+}
+
+// Moves to a line, at the column the cursor last had if it is long enough
+void editor_goto_line(size_t line) {
+    if (line >= editor_line_count()) line = editor_line_count() - 1;
+    size_t start = editor_line_start(line), end = editor_line_end(line);
+    editor.line = line;
+    editor.cursor_x = start + (editor.column < end - start ? editor.column : end - start);
+}
+
+void editor_home() {
+    editor.cursor_x = editor_line_start(editor.line);
+    editor.column = 0;
+}
+
+void editor_end() {
+    editor.cursor_x = editor_line_end(editor.line);
+    editor_keep_column();
+}
+
+// A screenful up or down, the view moving along with the cursor
+void editor_page(bool down) {
+    size_t last = editor_line_count() - 1;
+    if (down) {
+        editor.top = editor.top + EDITOR_ROWS < last ? editor.top + EDITOR_ROWS : last;
+        editor_goto_line(editor.line + EDITOR_ROWS);
+    } else {
+        editor.top = editor.top > EDITOR_ROWS ? editor.top - EDITOR_ROWS : 0;
+        editor_goto_line(editor.line > EDITOR_ROWS ? editor.line - EDITOR_ROWS : 0);
     }
+    editor.dirty |= EDITOR_ALL_ROWS;
 }
 
-// ==================== EDITOR ====================
+void editor_close();
+
 void editor_init(const char* filename) {
     memset(&editor, 0, sizeof(editor));
     strcpy(editor.filename, filename);
-    editor.capacity = 4096;
-    editor.content = &file_data_pool[file_data_used];
-    file_data_used += editor.capacity;
     
     fs_node_t* file = fs_resolve_path(filename);
-    if (file && file->type == FS_FILE && file->content) {
-        memcpy(editor.content, file->content, file->size);
-        editor.size = file->size;
+    size_t size = file && file->type == FS_FILE ? file->size : 0;
+    editor.text = kmalloc(size + EDITOR_GAP_MIN);
+    if (!editor.text) return;
+    editor.capacity = kmalloc_size(editor.text);
+    // Text after the gap, the cursor being at the start
+    if (size) size = fs_read(file, 0, editor.text + editor.capacity - size, size);
+    editor.gap_end = editor.capacity - size;
+
+    // Every line start, from the end of the text
+    const uint8_t* text = (const uint8_t*)editor.text + editor.gap_end;
+    const uint8_t* end = text + size;
+    size_t lines = mem_count_byte(text, end, '\n') + 1;
+    editor.lines = kmalloc((lines + EDITOR_LINES_MIN) * sizeof(size_t));
+    editor.line_capacity = editor.lines ? kmalloc_size(editor.lines) / sizeof(size_t) : 0;
+    editor.line_state = kmalloc(editor.line_capacity);
+    if (!editor.lines || !editor.line_state) { editor_close(); return; }
+    editor.line_gap_end = editor.line_capacity - lines;
+    size_t* line = editor.lines + editor.line_gap_end;
+    *line++ = size;
+    for (const uint8_t* p = text; (p = mem_find_byte(p, end, '\n')); p++) *line++ = end - p - 1;
+
+    size_t name = strlen(filename);
+    editor.syntax = name > 2 && filename[name - 2] == '.' && (filename[name - 1] == 'c' || filename[name - 1] == 'h');
+    *editor_line_state(0) = LEX_CODE;
+    editor.lex_valid = editor.lex_end = 1;
+    editor.dirty = EDITOR_HEADER;
+}
+
+void editor_close() {
+    kfree(editor.text);
+    kfree(editor.lines);
+    kfree(editor.line_state);
+    editor.text = NULL;
+    editor.lines = NULL;
+    editor.line_state = NULL;
+    editor.capacity = editor.gap_start = editor.gap_end = 0;
+    editor.line_capacity = editor.line_gap_start = editor.line_gap_end = 0;
+}
+
+// Copies the text around the gap straight into the file's blocks
+static bool editor_fill(void* ctx, uint8_t* buf, uint32_t len) {
+    size_t* pos = ctx;
+    if (*pos < editor.gap_start) {
+        size_t n = editor.gap_start - *pos < len ? editor.gap_start - *pos : len;
+        memcpy(buf, editor.text + *pos, n);
+        buf += n; len -= n; *pos += n;
     }
+    memcpy(buf, editor.text + *pos + (editor.gap_end - editor.gap_start), len);
+    *pos += len;
+    return true;
 }
 
 void editor_save() {
     fs_node_t* file = fs_resolve_path(editor.filename);
     if (!file) file = fs_create_node(editor.filename, FS_FILE, current_dir);
-    if (file) {
-        if (!file->content) {
-            file->content = &file_data_pool[file_data_used];
-            file_data_used += editor.size + 1;
-        }
-        memcpy(file->content, editor.content, editor.size);
-        file->size = editor.size;
+    size_t pos = 0;
+    if (file && file->type == FS_FILE && fs_fill(file, editor_length(), editor_fill, &pos)) {
         editor.modified = false;
     }
 }
 
-void editor_display() {
-    term_clear();
-    term_setcolor(0x0F);
-    term_write("================== HybridOS Ultimate Editor ==================\n");
-    term_setcolor(0x0E);
-    term_write("File: ");
-    term_write(editor.filename);
-    if (editor.modified) {
-        term_setcolor(0x0C);
-        term_write(" [MODIFIED]");
+// Scrolls to keep the cursor on screen; a scrolled view is redrawn whole
+static void editor_follow_cursor() {
+    if (editor.line < editor.top) {
+        editor.top = editor.line;
+        editor.dirty |= EDITOR_ALL_ROWS;
+    } else if (editor.line >= editor.top + EDITOR_ROWS) {
+        editor.top = editor.line - EDITOR_ROWS + 1;
+        editor.dirty |= EDITOR_ALL_ROWS;
     }
-    term_setcolor(0x07);
-    term_write("\n");
-    
-    // Display content with cursor - CORRIGÉ: comparaisons de types
-    int line = 0, col = 0;
-    for (size_t i = 0; i < editor.size && line < VGA_HEIGHT - 4; i++) {
-        if (i == editor.cursor_x) {
-            term_setcolor(0x70); // Highlight cursor position
-        }
-        term_putchar(editor.content[i]);
-        if (i == editor.cursor_x) {
-            term_setcolor(0x07);
-        }
-        
-        if (editor.content[i] == '\n') {
-            line++;
-            col = 0;
+    size_t col = editor.cursor_x - editor_line_start(editor.line);
+    if (col < editor.left || col >= editor.left + VGA_WIDTH) {
+        editor.left = col < VGA_WIDTH ? 0 : col - VGA_WIDTH / 2;
+        editor.dirty |= EDITOR_ALL_ROWS;
+    }
+}
+
+// Colors of the visible part of [from, to) on a row starting at start
+static void editor_paint(uint16_t* cell, size_t start, size_t from, size_t to, uint8_t color) {
+    if (from < start + editor.left) from = start + editor.left;
+    if (to > start + editor.left + VGA_WIDTH) to = start + editor.left + VGA_WIDTH;
+    for (; from < to; from++) {
+        char c = editor_char(from);
+        cell[from - start - editor.left] = vga_entry(c == '\t' ? ' ' : c, color);
+    }
+}
+
+static bool editor_keyword(size_t from, size_t to) {
+    static const char* const keywords[] = {
+        "auto", "bool", "break", "case", "char", "const", "continue", "default", "do", "double",
+        "else", "enum", "extern", "false", "float", "for", "goto", "if", "inline", "int", "long",
+        "NULL", "register", "return", "short", "signed", "size_t", "sizeof", "static", "struct",
+        "switch", "true", "typedef", "uint8_t", "uint16_t", "uint32_t", "uint64_t", "union",
+        "unsigned", "void", "volatile", "while", NULL
+    };
+    char word[12];
+    if (to - from >= sizeof(word)) return false;
+    for (size_t i = 0; from + i < to; i++) word[i] = editor_char(from + i);
+    word[to - from] = '\0';
+    for (int i = 0; keywords[i]; i++) if (strcmp(word, keywords[i]) == 0) return true;
+    return false;
+}
+
+static inline bool editor_word_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Lexes a line from the state it starts in and returns the state the next
+// one starts in; with cell, draws its visible columns on the way
+static uint8_t editor_lex_line(size_t line, uint8_t state, uint16_t* cell) {
+    size_t start = editor_line_start(line), end = editor_line_end(line), pos = start;
+    bool first = true;
+    while (pos < end) {
+        size_t from = pos;
+        char c = editor_char(pos), next = pos + 1 < end ? editor_char(pos + 1) : 0;
+        uint8_t color = 0x07;
+        if (state == LEX_COMMENT || (c == '/' && next == '*')) {
+            if (state == LEX_CODE) { state = LEX_COMMENT; pos += 2; }
+            for (; pos < end; pos++) {
+                if (editor_char(pos) == '*' && pos + 1 < end && editor_char(pos + 1) == '/') { pos += 2; state = LEX_CODE; break; }
+            }
+            color = 0x08;
+        } else if (c == '/' && next == '/') {
+            pos = end;
+            color = 0x08;
+        } else if (c == '"' || c == '\'') {
+            for (pos++; pos < end && editor_char(pos) != c; pos++) if (editor_char(pos) == '\\') pos++;
+            if (pos < end) pos++;
+            color = 0x0A;
+        } else if (c == '#' && first) {
+            for (pos++; pos < end && (editor_char(pos) == ' ' || editor_word_char(editor_char(pos))); pos++);
+            color = 0x0E;
+        } else if (c >= '0' && c <= '9') {
+            for (pos++; pos < end && (editor_word_char(editor_char(pos)) || editor_char(pos) == '.'); pos++);
+            color = 0x0D;
+        } else if (editor_word_char(c)) {
+            for (pos++; pos < end && editor_word_char(editor_char(pos)); pos++);
+            if (editor_keyword(from, pos)) color = 0x0B;
         } else {
-            col++;
+            pos++;
         }
+        if (pos > end) pos = end;             // an escaped newline
+        if (c != ' ' && c != '\t') first = false;
+        if (cell) editor_paint(cell, start, from, pos, color);
     }
-    
-    // Show cursor if at end
-    if (editor.cursor_x >= editor.size) {
-        term_setcolor(0x70);
-        term_putchar(' ');
-        term_setcolor(0x07);
+    return state;
+}
+
+// Makes the cached states right as far as line, marking the rows whose
+// state changed
+static void editor_lex_to(size_t line) {
+    if (!editor.syntax) return;
+    while (editor.lex_valid <= line) {
+        size_t n = editor.lex_valid;
+        uint8_t state = editor_lex_line(n - 1, *editor_line_state(n - 1), NULL);
+        uint8_t* cached = editor_line_state(n);
+        if (n < editor.lex_end && *cached == state && n >= editor.lex_resume) {
+            editor.lex_valid = editor.lex_end;
+            continue;
+        }
+        if ((n >= editor.lex_end || *cached != state) && n >= editor.top && n < editor.top + EDITOR_ROWS) {
+            editor.dirty |= 1u << (n - editor.top);
+        }
+        *cached = state;
+        editor.lex_valid = n + 1;
+        if (editor.lex_end < editor.lex_valid) editor.lex_end = editor.lex_valid;
+        // A rewritten state says nothing about the stale ones after it
+        if (editor.lex_resume < editor.lex_valid) editor.lex_resume = editor.lex_valid;
     }
-    
-    // Status line
+}
+
+// Draws the visible columns of a line, or a blank row past the last one
+static void editor_draw_row(int row) {
+    uint16_t* cell = VGA_MEMORY + (EDITOR_TOP + row) * VGA_WIDTH;
+    size_t line = editor.top + row, col = 0;
+    if (line < editor_line_count()) {
+        size_t start = editor_line_start(line), end = editor_line_end(line);
+        if (editor.syntax) editor_lex_line(line, *editor_line_state(line), cell);
+        else editor_paint(cell, start, start, end, 0x07);
+        col = end - start > editor.left ? end - start - editor.left : 0;
+    }
+    for (; col < VGA_WIDTH; col++) cell[col] = vga_entry(' ', 0x07);
+}
+
+static void editor_draw_status() {
     term_row = VGA_HEIGHT - 2;
     term_col = 0;
     term_setcolor(0x1F);
-    term_write("Ctrl+S: Save | Ctrl+X: Exit | Size: ");
-    char size_str[16];
-    int idx = 15;
-    size_str[idx--] = '\0';
-    size_t size = editor.size;
-    if (size == 0) size_str[idx--] = '0';
-    else while (size > 0 && idx >= 0) {
-        size_str[idx--] = '0' + (size % 10);
-        size /= 10;
-    }
-    term_write(&size_str[idx + 1]);
+    term_write("Ctrl+S: Save | Ctrl+X: Exit | Ln ");
+    term_write_dec(editor.line + 1);
+    term_write("/");
+    term_write_dec(editor_line_count());
+    term_write(", Col ");
+    term_write_dec(editor.cursor_x - editor_line_start(editor.line) + 1);
+    term_write(" | ");
+    term_write_dec(editor_length());
     term_write(" bytes");
-    
-    // Fill rest of status line
-    while (term_col < VGA_WIDTH) term_putchar(' ');
+    if (editor.modified) term_write(" [MODIFIED]");
+    // Padded in place: term_putchar would wrap onto the next row
+    for (size_t col = term_col; col < VGA_WIDTH; col++) VGA_MEMORY[term_row * VGA_WIDTH + col] = vga_entry(' ', 0x1F);
     term_setcolor(0x07);
 }
 
+void editor_display() {
+    editor_follow_cursor();
+    if (editor.dirty & EDITOR_HEADER) {
+        term_clear();
+        term_setcolor(0x0F);
+        term_write("================== HybridOS Ultimate Editor ==================\n");
+        term_setcolor(0x0E);
+        term_write("File: ");
+        term_write(editor.filename);
+        term_setcolor(0x07);
+        editor.dirty = EDITOR_ALL_ROWS;
+    }
+    size_t last = editor.top + EDITOR_ROWS < editor_line_count() ? editor.top + EDITOR_ROWS : editor_line_count();
+    editor_lex_to(last - 1);
+    for (int row = 0; row < EDITOR_ROWS; row++) {
+        if (editor.dirty & (1u << row)) editor_draw_row(row);
+    }
+    editor.dirty = 0;
+
+    editor_draw_status();
+    term_row = EDITOR_TOP + (editor.line - editor.top);
+    term_col = editor.cursor_x - editor_line_start(editor.line) - editor.left;
+    update_cursor();
+}
+
 // ==================== GAMES ====================
 void game_snake() {
     if (!graphics_mode) init_graphics();
@@ -741,7 +5397,7 @@ void game_snake() {
         }
         
         // Get input
-        if (inb(0x64) & 1) {
+        if (key_ready()) {
             char key = read_key();
             // CORRIGÉ: utilisation de 'dir' au lieu de 'direction'
             if (key == 'w') snake.dir = 1;
@@ -825,7 +5481,7 @@ void game_pong() {
         draw_rect(302, ai_paddle_y, 8, 25, 12);
         
         // Get input
-        if (inb(0x64) & 1) {
+        if (key_ready()) {
             char key = read_key();
             if (key == 'w' && paddle_y > 0) paddle_y -= 8;
             if (key == 's' && paddle_y < 175) paddle_y += 8;
@@ -907,7 +5563,7 @@ void matrix_effect() {
         }
         
         // Check for quit
-        if (inb(0x64) & 1) {
+        if (key_ready()) {
             char key = read_key();
             if (key == 'q' || key == 27) break;
         }
@@ -1015,7 +5671,7 @@ void http_server() {
         // Simulate requests
         for (volatile int j = 0; j < 8000000; j++);
         
-        if (inb(0x64) & 1) {
+        if (key_ready()) {
             char key = read_key();
             if (key == 'q') break;
         }
@@ -1034,7 +5690,7 @@ void http_server() {
 }
 
 // ==================== COMPILER & INTERPRETER ====================
-void compile_c(const char* filename) {
+void compile_c(char* filename) {
     if (!filename || !*filename) {
         term_setcolor(0x0C);
         term_write("compile: missing filename\n");
@@ -1080,7 +5736,7 @@ void compile_c(const char* filename) {
     term_write(".exe\n");
 }
 
-void interpret_basic(const char* code) {
+void interpret_basic(char* code) {
     term_setcolor(0x0E);
     term_write("🔵 HybridOS BASIC Interpreter v1.0\n");
     term_setcolor(0x07);
@@ -1120,83 +5776,768 @@ void interpret_basic(const char* code) {
             term_write("\n");
         }
     } else {
-        term_setcolor(0x0C);
-        term_write("Syntax error in BASIC code\n");
-        term_setcolor(0x07);
+        term_setcolor(0x0C);
+        term_write("Syntax error in BASIC code\n");
+        term_setcolor(0x07);
+    }
+}
+
+// ==================== STREAMS ====================
+// Shell pipes and redirections. A pipe is a fixed ring between two stages:
+// when the writer fills it, the reading stage runs on what is buffered,
+// with its own output pointed at the next stage, then the writer resumes.
+// Stages run as nested calls, so a pipeline streams in bounded memory.
+#define PIPE_SIZE 4096           // power of two
+#define FILE_STREAM_BUFFER (8 * FS_BLOCK_SIZE)
+
+typedef struct pipe pipe_t;
+
+// A command that reads its input from a pipe; feed consumes what it can
+// and is called a last time with eof once the writer is done
+typedef struct {
+    size_t state_size;
+    bool (*begin)(void* state, char* args);     // false: not reading input
+    void (*feed)(void* state, pipe_t* in, bool eof);
+} filter_t;
+
+struct pipe {
+    stream_t stream;
+    char ring[PIPE_SIZE];
+    uint32_t head, tail;         // bytes read and written so far
+    const filter_t* filter;      // NULL drops the input
+    void* state;
+    stream_t* out;               // the reading stage's output
+};
+
+typedef struct {
+    stream_t stream;
+    fs_node_t* file;
+    bool failed;
+    uint32_t len;
+    char buf[FILE_STREAM_BUFFER];
+} file_stream_t;
+
+// Writes to the current output, a block at a time when it is a stream
+static void stream_write(const char* data, size_t len) {
+    if (term_out) term_out->write(term_out, data, len);
+    else while (len--) term_putchar(*data++);
+}
+
+static void pipe_drain(pipe_t* p, bool eof) {
+    stream_t* saved = term_out;
+    term_out = p->out;
+    if (p->filter) p->filter->feed(p->state, p, eof);
+    else p->head = p->tail;
+    term_out = saved;
+}
+
+static void pipe_write(stream_t* s, const char* data, size_t len) {
+    pipe_t* p = (pipe_t*)s;
+    while (len) {
+        if (p->tail - p->head == PIPE_SIZE) pipe_drain(p, false);
+        uint32_t at = p->tail & (PIPE_SIZE - 1);
+        size_t chunk = PIPE_SIZE - (p->tail - p->head);
+        if (chunk > PIPE_SIZE - at) chunk = PIPE_SIZE - at;
+        if (chunk > len) chunk = len;
+        memcpy(p->ring + at, data, chunk);
+        p->tail += chunk; data += chunk; len -= chunk;
+    }
+}
+
+// Copies the next line without its '\n' into line (PIPE_SIZE bytes);
+// -1 until a whole line is buffered. A line filling the ring comes out in
+// pieces, the last line of the input may lack its '\n'.
+static int pipe_read_line(pipe_t* p, char* line, bool eof) {
+    uint32_t n = p->tail - p->head, len = 0;
+    while (len < n && p->ring[(p->head + len) & (PIPE_SIZE - 1)] != '\n') len++;
+    if (len == n && !(eof && n) && n < PIPE_SIZE) return -1;
+    for (uint32_t k = 0; k < len; k++) line[k] = p->ring[(p->head + k) & (PIPE_SIZE - 1)];
+    p->head += len < n ? len + 1 : len;
+    return len;
+}
+
+// Hands everything buffered to the current output
+static void pipe_pass(pipe_t* p) {
+    while (p->head != p->tail) {
+        uint32_t at = p->head & (PIPE_SIZE - 1), chunk = p->tail - p->head;
+        if (chunk > PIPE_SIZE - at) chunk = PIPE_SIZE - at;
+        p->head += chunk;
+        stream_write(p->ring + at, chunk);
+    }
+}
+
+static void file_stream_flush(file_stream_t* f) {
+    if (f->len && !f->failed && !fs_write(f->file, f->file->size, f->buf, f->len)) {
+        f->failed = true;
+        term_setcolor(0x0C); term_write("shell: "); term_write(f->file->name); term_write(": No space left on device\n"); term_setcolor(0x07);
+    }
+    f->len = 0;
+}
+
+static void file_stream_write(stream_t* s, const char* data, size_t len) {
+    file_stream_t* f = (file_stream_t*)s;
+    while (len) {
+        if (f->len == FILE_STREAM_BUFFER) file_stream_flush(f);
+        size_t chunk = FILE_STREAM_BUFFER - f->len;
+        if (chunk > len) chunk = len;
+        memcpy(f->buf + f->len, data, chunk);
+        f->len += chunk; data += chunk; len -= chunk;
+    }
+}
+
+// Opens path for a > (append false) or >> redirection, creating the file
+static file_stream_t* file_stream_open(const char* path, bool append) {
+    fs_node_t* file = fs_open_file(path);
+    const char* error = NULL;
+    if (!file) error = ": No such file or directory\n";
+    else if (file->type != FS_FILE) error = ": Is a directory\n";
+    else if (!append && !fs_truncate(file, 0)) error = ": Cannot truncate\n";
+    file_stream_t* f = error ? NULL : kmalloc(sizeof(file_stream_t));
+    if (!f) {
+        term_setcolor(0x0C); term_write("shell: "); term_write(path); term_write(error ? error : ": Out of memory\n"); term_setcolor(0x07);
+        return NULL;
+    }
+    f->stream.write = file_stream_write;
+    f->file = file;
+    f->failed = false;
+    f->len = 0;
+    return f;
+}
+
+// ==================== COMMAND FUNCTIONS ====================
+void cmd_ls(char* path) {
+    fs_node_t* dir = path && *path ? fs_resolve_path(path) : current_dir;
+    if (!dir) {
+        term_setcolor(0x0C);
+        term_write("ls: cannot access '"); term_write(path); term_write("': No such file or directory\n");
+        term_setcolor(0x07);
+        return;
+    }
+    
+    if (dir->type != FS_DIRECTORY) {
+        term_setcolor(0x0F); term_write(dir->name); term_write("\n"); term_setcolor(0x07);
+        return;
+    }
+    
+    for (uint32_t i = 0; i < fs_child_count(dir); i++) {
+        fs_node_t* child = fs_child(dir, i);
+        if (child->type == FS_DIRECTORY) {
+            term_setcolor(0x09); term_write(child->name); term_write("/");
+        } else {
+            term_setcolor(0x0F); term_write(child->name);
+        }
+        
+        if (child->type == FS_FILE) {
+            term_setcolor(0x08);
+            term_write("  (");
+            char size_str[16];
+            int idx = 15;
+            size_str[idx--] = '\0';
+            size_t size = child->size;
+            if (size == 0) size_str[idx--] = '0';
+            else while (size > 0 && idx >= 0) {
+                size_str[idx--] = '0' + (size % 10);
+                size /= 10;
+            }
+            term_write(&size_str[idx + 1]);
+            term_write("B)");
+        }
+        term_write("  ");
+    }
+    if (fs_child_count(dir) > 0) term_write("\n");
+    term_setcolor(0x07);
+}
+
+// Copies a file or directory tree; file data is shared, not duplicated
+static fs_node_t* fs_copy_node(fs_node_t* src, fs_node_t* dest_dir, const char* name) {
+    fs_node_t* copy = fs_create_node(name, src->type, dest_dir);
+    if (!copy) return NULL;
+    copy->permissions = src->permissions;
+    if (src->type == FS_FILE) {
+        fs_share_content(copy, src);
+    } else {
+        for (uint32_t i = 0; i < fs_child_count(src); i++) {
+            fs_node_t* child = fs_child(src, i);
+            if (!fs_copy_node(child, copy, child->name)) return NULL;
+        }
+    }
+    return copy;
+}
+
+void cmd_cp(char* args) {
+    bool recursive = false;
+    if (starts_with(args, "-r ")) {
+        recursive = true;
+        args += 3;
+        while (*args == ' ') args++;
+    }
+    char* dest = strchr(args, ' ');
+    if (dest) { *dest++ = '\0'; while (*dest == ' ') dest++; }
+    if (!args[0] || !dest || !*dest) { term_setcolor(0x0C); term_write("cp: missing operand\n"); term_setcolor(0x07); return; }
+
+    fs_node_t* src = fs_resolve_path(args);
+    if (!src) { term_setcolor(0x0C); term_write("cp: "); term_write(args); term_write(": No such file or directory\n"); term_setcolor(0x07); return; }
+    if (src->type == FS_DIRECTORY && !recursive) {
+        term_setcolor(0x0C); term_write("cp: -r not specified; omitting directory '"); term_write(args); term_write("'\n"); term_setcolor(0x07);
+        return;
+    }
+
+    char name[MAX_FILENAME];
+    fs_node_t* target = fs_resolve_path(dest);
+    fs_node_t* dest_dir;
+    if (target && target->type == FS_DIRECTORY) {
+        dest_dir = target;
+        strcpy(name, src == fs_root ? "root" : src->name);
+        target = fs_lookup(dest_dir, name);
+    } else {
+        dest_dir = fs_resolve_parent(dest, name);
+    }
+    if (!dest_dir || !name[0] || dest_dir->type != FS_DIRECTORY) {
+        term_setcolor(0x0C); term_write("cp: cannot create '"); term_write(dest); term_write("'\n"); term_setcolor(0x07);
+        return;
+    }
+    if (src->type == FS_DIRECTORY && fs_is_within(dest_dir, src)) {
+        term_setcolor(0x0C); term_write("cp: cannot copy a directory into itself\n"); term_setcolor(0x07);
+        return;
+    }
+
+    bool ok;
+    if (target && target->type == FS_FILE && src->type == FS_FILE) ok = fs_share_content(target, src);
+    else if (target) ok = false;
+    else ok = fs_copy_node(src, dest_dir, name) != NULL;
+    if (!ok) { term_setcolor(0x0C); term_write("cp: cannot copy '"); term_write(args); term_write("' to '"); term_write(dest); term_write("'\n"); term_setcolor(0x07); }
+}
+
+// Splits off the next word of a command line; "double quotes" keep
+// spaces and \" is a literal quote (other backslashes are kept for regex)
+static char* shell_next_arg(char** line) {
+    char* p = *line;
+    while (*p == ' ') p++;
+    if (!*p) { *line = p; return NULL; }
+    char *arg = p, *out = p;
+    bool quoted = false;
+    for (; *p && (quoted || *p != ' '); p++) {
+        if (*p == '\\' && p[1] == '"') *out++ = *++p;
+        else if (*p == '"') quoted = !quoted;
+        else *out++ = *p;
+    }
+    *line = *p ? p + 1 : p;
+    *out = '\0';
+    return arg;
+}
+
+typedef struct {
+    const char* pattern;
+    search_t search;
+    regex_t* re;                 // NULL for a literal pattern
+    bool recursive, count_only, line_numbers;
+} grep_t;
+
+static bool is_regex(const char* pattern) {
+    for (; *pattern; pattern++) if (strchr(".[]()*+?{}|^$\\", *pattern)) return true;
+    return false;
+}
+
+// Start of the next matching line at or after p, a line start
+static const uint8_t* grep_next_line(grep_t* g, const uint8_t* p, const uint8_t* end) {
+    if (g->re) return regex_find_line(g->re, p, end);
+    const uint8_t* m = search_find(&g->search, p, end);
+    if (m) while (m > p && m[-1] != '\n') m--;
+    return m;
+}
+
+static void grep_print_line(grep_t* g, const char* label, uint32_t line, const uint8_t* p, const uint8_t* stop) {
+    if (label) { term_setcolor(0x0D); term_write(label); term_setcolor(0x07); term_putchar(':'); }
+    if (g->line_numbers) { term_setcolor(0x0A); term_write_dec(line); term_setcolor(0x07); term_putchar(':'); }
+    const uint8_t* m;
+    while (!g->re && !term_out && (m = search_find(&g->search, p, stop))) {
+        while (p < m) term_putchar(*p++);
+        term_setcolor(0x0C);
+        for (uint32_t k = 0; k < g->search.len; k++) term_putchar(*p++);
+        term_setcolor(0x07);
+    }
+    while (p < stop) term_putchar(*p++);
+    term_putchar('\n');
+}
+
+// Searches one file; matching lines are found by searching the whole
+// content, not line by line
+static void grep_file(grep_t* g, fs_node_t* file, const char* label) {
+    uint8_t* copy;
+    const uint8_t* data = fs_view(file, &copy);
+    if (!data) {
+        term_setcolor(0x0C); term_write("grep: "); term_write(label ? label : file->name); term_write(": Out of memory\n"); term_setcolor(0x07);
+        return;
+    }
+    const uint8_t *end = data + file->size, *p = data, *counted = data, *start;
+    bool binary = mem_find_byte(data, end, 0) != NULL;
+    uint32_t line = 1, hits = 0;
+    while ((start = grep_next_line(g, p, end))) {
+        const uint8_t* stop = mem_find_byte(start, end, '\n');
+        if (!stop) stop = end;
+        hits++;
+        if (binary && !g->count_only) break;
+        if (!g->count_only) {
+            if (g->line_numbers) { line += mem_count_byte(counted, start, '\n'); counted = start; }
+            grep_print_line(g, label, line, start, stop);
+        }
+        p = stop < end ? stop + 1 : end;
+    }
+    if (g->count_only && (hits || !g->recursive)) {
+        if (label) { term_setcolor(0x0D); term_write(label); term_setcolor(0x07); term_putchar(':'); }
+        term_write_dec(hits); term_write("\n");
+    } else if (binary && hits) {
+        term_write("Binary file "); term_write(label ? label : file->name); term_write(" matches\n");
+    }
+    kfree(copy);
+}
+
+// Options and pattern of a grep command line; path is the operand after
+// the pattern, NULL without one
+static bool grep_begin(grep_t* g, char* args, char** path) {
+    memset(g, 0, sizeof(*g));
+    char *arg, *pattern = NULL;
+    bool fixed = false;
+    *path = NULL;
+    while ((arg = shell_next_arg(&args))) {
+        if (arg[0] == '-' && arg[1] && !pattern) {
+            for (char* f = arg + 1; *f; f++) {
+                if (*f == 'r') g->recursive = true;
+                else if (*f == 'c') g->count_only = true;
+                else if (*f == 'n') g->line_numbers = true;
+                else if (*f == 'F') fixed = true;
+                else if (*f == 'E') fixed = false;
+                else { term_setcolor(0x0C); term_write("grep: invalid option -- '"); term_putchar(*f); term_write("'\n"); term_setcolor(0x07); return false; }
+            }
+        }
+        else if (!pattern) pattern = arg;
+        else if (!*path) *path = arg;
+    }
+    if (!pattern || !pattern[0]) { term_setcolor(0x0C); term_write("Usage: grep [-rcnFE] <pattern> [path]\n"); term_setcolor(0x07); return false; }
+    g->pattern = pattern;
+    search_init(&g->search, pattern);
+    if (!fixed && is_regex(pattern)) {
+        const char* error;
+        if (!(g->re = regex_compile(pattern, &error))) {
+            term_setcolor(0x0C); term_write("grep: "); term_write(error); term_write("\n"); term_setcolor(0x07);
+            return false;
+        }
+    }
+    return true;
+}
+
+void cmd_grep(char* args) {
+    grep_t g;
+    char* path;
+    if (!grep_begin(&g, args, &path)) return;
+    fs_node_t* node = path ? fs_resolve_path(path) : current_dir;
+    const char* error = NULL;
+    if (!path && !g.recursive) error = "missing file operand";
+    else if (!node) error = "No such file or directory";
+    else if (node->type == FS_DIRECTORY && !g.recursive) error = "Is a directory";
+    if (error) {
+        term_setcolor(0x0C); term_write("grep: ");
+        if (path) { term_write(path); term_write(": "); }
+        term_write(error); term_write("\n"); term_setcolor(0x07);
+        regex_free(g.re);
+        return;
+    }
+    if (node->type == FS_FILE) { grep_file(&g, node, g.recursive ? path : NULL); regex_free(g.re); return; }
+
+    char label[MAX_PATH];
+    uint32_t trigrams[IX_MAX_QUERY], count;
+    uint32_t n = ix_enabled ? ix_query_trigrams(g.pattern, g.re != NULL, trigrams) : 0;
+    uint64_t start = time_us();
+    fs_node_t** candidates = ix_candidates(trigrams, n, &count);
+    if (candidates) {
+        // Only files holding every trigram of the pattern can match
+        for (uint32_t i = 0; i < count; i++) {
+            if (!fs_is_within(candidates[i], node)) continue;
+            fs_get_path(candidates[i], label);
+            grep_file(&g, candidates[i], label);
+        }
+        kfree(candidates);
+        ix_last_candidates = count;
+        ix_last_query_us = (uint32_t)(time_us() - start);
+    } else {
+        fs_walk_t walk;
+        fs_walk_begin(&walk, node);
+        while ((node = fs_walk_next(&walk))) {
+            if (node->type != FS_FILE || (!g.re && node->size < g.search.len)) continue;
+            fs_get_path(node, label);
+            grep_file(&g, node, label);
+        }
+        fs_walk_end(&walk);
+    }
+    regex_free(g.re);
+}
+
+// grep <pattern> without a path reads its input, a line at a time
+typedef struct {
+    grep_t g;
+    bool failed;
+    uint32_t line, hits;
+    char text[PIPE_SIZE];
+} grep_filter_t;
+
+static bool grep_filter_begin(void* state, char* args) {
+    grep_filter_t* f = state;
+    char* path;
+    f->line = f->hits = 0;
+    // A bad command line still takes the input, so the error shows once
+    f->failed = !grep_begin(&f->g, args, &path);
+    if (f->failed || (!path && !f->g.recursive)) return true;
+    regex_free(f->g.re);
+    return false;
+}
+
+static void grep_filter_feed(void* state, pipe_t* in, bool eof) {
+    grep_filter_t* f = state;
+    int len;
+    while ((len = pipe_read_line(in, f->text, eof)) >= 0) {
+        if (f->failed) continue;
+        const uint8_t* text = (const uint8_t*)f->text;
+        f->line++;
+        if (!grep_next_line(&f->g, text, text + len)) continue;
+        f->hits++;
+        if (!f->g.count_only) grep_print_line(&f->g, NULL, f->line, text, text + len);
+    }
+    if (!eof || f->failed) return;
+    if (f->g.count_only) { term_write_dec(f->hits); term_write("\n"); }
+    regex_free(f->g.re);
+}
+
+static const filter_t grep_filter = { sizeof(grep_filter_t), grep_filter_begin, grep_filter_feed };
+
+// find [dir] [-name] <glob> | -regex <re>; a glob without wildcards
+// matches any name containing it, a regex any name it matches part of
+void cmd_find(char* args) {
+    char *arg, *dir_path = NULL, *pattern = NULL;
+    bool use_regex = false;
+    while ((arg = shell_next_arg(&args))) {
+        if (strcmp(arg, "-name") == 0) continue;
+        if (strcmp(arg, "-regex") == 0) { use_regex = true; continue; }
+        if (pattern && !dir_path) dir_path = pattern;
+        pattern = arg;
+    }
+    if (!pattern) { term_setcolor(0x0C); term_write("Usage: find [dir] <pattern> | -regex <re>\n"); term_setcolor(0x07); return; }
+    fs_node_t* node = dir_path ? fs_resolve_path(dir_path) : current_dir;
+    if (!node) { term_setcolor(0x0C); term_write("find: '"); term_write(dir_path); term_write("': No such file or directory\n"); term_setcolor(0x07); return; }
+
+    char glob[132], path[MAX_PATH];
+    regex_t* re = NULL;
+    if (use_regex) {
+        const char* error;
+        if (!(re = regex_compile(pattern, &error))) {
+            term_setcolor(0x0C); term_write("find: "); term_write(error); term_write("\n"); term_setcolor(0x07);
+            return;
+        }
+    }
+    else if (strchr(pattern, '*') || strchr(pattern, '?') || strchr(pattern, '[')) strcpy(glob, pattern);
+    else { strcpy(glob, "*"); strcat(glob, pattern); strcat(glob, "*"); }
+    fs_walk_t walk;
+    fs_walk_begin(&walk, node);
+    while ((node = fs_walk_next(&walk))) {
+        if (re ? !regex_match(re, node->name, strlen(node->name)) : !glob_match(glob, node->name)) continue;
+        fs_get_path(node, path);
+        term_setcolor(node->type == FS_DIRECTORY ? 0x09 : 0x0F);
+        term_write(path);
+        term_setcolor(0x07);
+        term_write("\n");
+    }
+    fs_walk_end(&walk);
+    regex_free(re);
+}
+
+typedef struct {
+    uint32_t files, compressed;
+    uint64_t logical, inline_bytes, compressed_logical, compressed_stored;
+} fs_usage_t;
+
+static void fs_usage(fs_node_t* node, fs_usage_t* u) {
+    if (node->type == FS_FILE) {
+        u->files++;
+        u->logical += node->size;
+        if (node->flags & FS_NODE_INLINE) u->inline_bytes += node->size;
+        if (node->flags & FS_NODE_COMPRESSED) {
+            u->compressed++;
+            u->compressed_logical += node->size;
+            u->compressed_stored += fs_packed_size(node);
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < fs_child_count(node); i++) fs_usage(fs_child(node, i), u);
+}
+
+void cmd_df() {
+    fs_usage_t u = {0};
+    fs_usage(fs_root, &u);
+    uint32_t physical_kb = (fs_blocks_used * FS_BLOCK_SIZE + (uint32_t)u.inline_bytes + 1023) / 1024;
+    uint32_t logical_kb = (uint32_t)((u.logical + 1023) >> 10);
+
+    term_setcolor(0x0F);
+    term_write("Filesystem  Files   Logical KB  Physical KB  Saved KB\n");
+    term_setcolor(0x07);
+    term_write("ramfs       ");
+    term_write_dec(u.files);
+    while (term_col < 20) term_putchar(' ');
+    term_write_dec(logical_kb);
+    while (term_col < 32) term_putchar(' ');
+    term_write_dec(physical_kb);
+    while (term_col < 45) term_putchar(' ');
+    term_write_dec(logical_kb > physical_kb ? logical_kb - physical_kb : 0); term_write("\n");
+    term_write("Blocks: "); term_write_dec(fs_blocks_used); term_write(" used of ");
+    term_write_dec((fs_group_count - fs_adopted_groups) * FS_GROUP_BLOCKS); term_write(" (512 B), inodes: ");
+    term_write_dec(fs_node_count); term_write(", names: "); term_write_dec(fs_name_count); term_write("\n");
+    term_write("Dedup: ");
+    term_setcolor(fs_dedup_enabled ? 0x0A : 0x08);
+    term_write(fs_dedup_enabled ? "on" : "off");
+    term_setcolor(0x07);
+    term_write(", "); term_write_dec(fs_dedup_indexed); term_write(" blocks indexed, ");
+    term_write_dec(fs_dedup_merged); term_write(" duplicate blocks merged\n");
+    term_write("Compression: ");
+    term_setcolor(fs_compress_enabled ? 0x0A : 0x08);
+    term_write(fs_compress_enabled ? "on" : "off");
+    term_setcolor(0x07);
+    term_write(", "); term_write_dec(u.compressed); term_write(" files, ");
+    term_write_dec((uint32_t)((u.compressed_logical + 1023) >> 10)); term_write(" KB stored in ");
+    term_write_dec((uint32_t)((u.compressed_stored + 1023) >> 10)); term_write(" KB\n");
+    term_write("Hot cache: "); term_write_dec((fs_hot_bytes + 1023) / 1024); term_write(" KB, ");
+    term_write_dec(fs_hot_hits); term_write(" hits, "); term_write_dec(fs_hot_misses); term_write(" misses\n");
+    if (fsimg_count) {
+        uint32_t blocks = 0;
+        for (uint32_t i = 0; i < fsimg_count; i++) blocks += fsimg_blocks[i];
+        term_write("Boot image: "); term_write_dec(fsimg_files); term_write(" files, ");
+        term_write_dec(fsimg_blocks_mapped() / 2); term_write(" KB of ");
+        term_write_dec(blocks / 2); term_write(" KB still read in place\n");
+    }
+}
+
+void cmd_index(char* arg) {
+    if (strcmp(arg, "on") == 0 || strcmp(arg, "rebuild") == 0) ix_set_enabled(true);
+    else if (strcmp(arg, "off") == 0) ix_set_enabled(false);
+    else if (arg[0]) { term_setcolor(0x0C); term_write("Usage: index [on|off|rebuild]\n"); term_setcolor(0x07); return; }
+    term_write("Trigram index: ");
+    term_setcolor(ix_enabled ? 0x0A : 0x08);
+    term_write(ix_enabled ? "on" : "off");
+    term_setcolor(0x07);
+    if (!ix_enabled) { term_write("\n"); return; }
+    ix_drain(0xFFFFFFFF);
+    uint32_t overhead = ix_list_bytes + ix_table_size * sizeof(ix_slot_t) + ix_doc_capacity * sizeof(fs_node_t*) + ix_refs.size * sizeof(fs_map_entry_t);
+    fs_usage_t u = {0};
+    fs_usage(fs_root, &u);
+    term_write(", "); term_write_dec(ix_live); term_write(" files, ");
+    term_write_dec(ix_trigrams); term_write(" trigrams, ");
+    term_write_dec(ix_doc_count - ix_live); term_write(" stale ids, ");
+    term_write_dec(ix_rebuilds); term_write(" builds\n");
+    term_write("Memory: "); term_write_dec((overhead + 1023) / 1024); term_write(" KB (");
+    term_write_dec((ix_list_bytes + 1023) / 1024); term_write(" KB postings) for ");
+    term_write_dec((uint32_t)((u.logical + 1023) >> 10)); term_write(" KB of data\n");
+    term_write("Last indexed grep: "); term_write_dec(ix_last_candidates); term_write(" candidate files, ");
+    term_write_dec(ix_last_query_us); term_write(" us\n");
+}
+
+// import: every opt/ blob of QEMU's fw_cfg; import <name> [dest]: one blob
+void cmd_import(char* args) {
+    if (!fw_cfg_present) { term_setcolor(0x0C); term_write("import: no fw_cfg device (QEMU only)\n"); term_setcolor(0x07); return; }
+    char* name = shell_next_arg(&args);
+    char* dest = shell_next_arg(&args);
+    uint64_t bytes = 0, us = 0;
+    uint32_t count = 0;
+    if (name) {
+        fw_cfg_file_t* f = fw_cfg_find(name);
+        if (!f) { term_setcolor(0x0C); term_write("import: "); term_write(name); term_write(": no such fw_cfg file\n"); term_setcolor(0x07); return; }
+        uint64_t start = time_us();
+        if (!fw_cfg_import(f, dest)) { term_setcolor(0x0C); term_write("import: "); term_write(name); term_write(": import failed\n"); term_setcolor(0x07); return; }
+        us = time_us() - start;
+        bytes = f->size;
+        count = 1;
+    } else {
+        count = fw_cfg_import_all(&bytes, &us, true);
     }
+    term_setcolor(0x0F);
+    term_write_dec(count); term_write(" files, ");
+    term_write_dec((uint32_t)((bytes + 1023) >> 10)); term_write(" KB in ");
+    term_write_dec((uint32_t)udiv64(us, 1000)); term_write(" ms: ");
+    fw_cfg_write_rate(bytes, us);
+    term_write(fw_cfg_has_dma ? " (DMA)\n" : " (port I/O)\n");
+    term_setcolor(0x07);
 }
 
-// ==================== COMMAND FUNCTIONS ====================
-void cmd_ls(const char* path) {
-    fs_node_t* dir = path && *path ? fs_resolve_path(path) : current_dir;
-    if (!dir) {
-        term_setcolor(0x0C);
-        term_write("ls: cannot access '"); term_write(path); term_write("': No such file or directory\n");
-        term_setcolor(0x07);
-        return;
+void cmd_sync() {
+    if (!dk_mounted) { term_setcolor(0x0C); term_write("sync: no disk filesystem\n"); term_setcolor(0x07); return; }
+    if (!dk_sync()) { term_setcolor(0x0C); term_write("sync: I/O error\n"); term_setcolor(0x07); return; }
+    term_write_dec(dk_sync_sectors); term_write(" sectors written in ");
+    term_write_dec(dk_sync_us / 1000); term_write("."); term_write_dec(dk_sync_us / 100 % 10); term_write(" ms\n");
+}
+
+// Reads a file (or the start of the disk) through a cold, then a warm cache
+static void dk_bench(const char* path) {
+    fs_node_t* file = NULL;
+    uint32_t sector = 0, bytes = DK_BENCH_BYTES;
+    if (path) {
+        file = fs_resolve_path(path);
+        if (!file || file->type != FS_FILE) { term_setcolor(0x0C); term_write("disk: "); term_write(path); term_write(": No such file\n"); term_setcolor(0x07); return; }
+        fs_map_entry_t* e = fs_map_find(&dk_inos, file);
+        if (!e || (file->flags & FS_NODE_DIRTY)) { term_setcolor(0x0C); term_write("disk: "); term_write(path); term_write(": not on disk yet (sync)\n"); term_setcolor(0x07); return; }
+        sector = dk_super.data_start + dk_table[e->value].start;
+        bytes = file->size;
     }
-    
-    if (dir->type != FS_DIRECTORY) {
-        term_setcolor(0x0F); term_write(dir->name); term_write("\n"); term_setcolor(0x07);
+    if (bytes > (uint64_t)disk_sectors * ATA_SECTOR) bytes = disk_sectors * ATA_SECTOR;
+    uint8_t* buf = kmalloc(BC_CLUSTER);
+    if (!buf || !bc_drop()) { kfree(buf); term_setcolor(0x0C); term_write("disk: bench failed\n"); term_setcolor(0x07); return; }
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t reads = disk_reads, hits = bc_hits;
+        uint64_t start = time_us();
+        bool ok = true;
+        for (uint32_t done = 0; ok && done < bytes; done += BC_CLUSTER) {
+            uint32_t chunk = bytes - done < BC_CLUSTER ? bytes - done : BC_CLUSTER;
+            ok = bc_read(sector + done / ATA_SECTOR, buf, chunk);
+        }
+        uint64_t us = time_us() - start;
+        if (!ok) { term_setcolor(0x0C); term_write("disk: read error\n"); term_setcolor(0x07); break; }
+        term_write(pass ? "warm: " : "cold: ");
+        term_write_dec((bytes + 1023) / 1024); term_write(" KB in ");
+        term_write_dec((uint32_t)udiv64(us, 1000)); term_write(" ms, ");
+        fw_cfg_write_rate(bytes, us);
+        term_write(", "); term_write_dec(disk_reads - reads); term_write(" sectors read, ");
+        term_write_dec(bc_hits - hits); term_write(" cache hits\n");
+    }
+    kfree(buf);
+}
+
+// disk: status; disk format: new filesystem holding the current tree;
+// disk bench [file]: cold and warm read throughput
+void cmd_disk(char* args) {
+    if (!disk_present) { term_setcolor(0x0C); term_write("disk: no disk (QEMU -hda or -drive if=virtio)\n"); term_setcolor(0x07); return; }
+    char* sub = shell_next_arg(&args);
+    if (sub && strcmp(sub, "format") == 0) {
+        if (!dk_format()) { term_setcolor(0x0C); term_write("disk: format failed\n"); term_setcolor(0x07); return; }
+        term_write("Formatted: "); term_write_dec(dk_super.inode_count); term_write(" inodes, ");
+        term_write_dec(dk_super.data_blocks / 2048); term_write(" MB of data blocks\n");
         return;
     }
-    
-    for (int i = 0; i < dir->child_count; i++) {
-        fs_node_t* child = dir->children[i];
-        if (child->type == FS_DIRECTORY) {
-            term_setcolor(0x09); term_write(child->name); term_write("/");
-        } else {
-            term_setcolor(0x0F); term_write(child->name);
-        }
-        
-        if (child->type == FS_FILE) {
-            term_setcolor(0x08);
-            term_write("  (");
-            char size_str[16];
-            int idx = 15;
-            size_str[idx--] = '\0';
-            size_t size = child->size;
-            if (size == 0) size_str[idx--] = '0';
-            else while (size > 0 && idx >= 0) {
-                size_str[idx--] = '0' + (size % 10);
-                size /= 10;
-            }
-            term_write(&size_str[idx + 1]);
-            term_write("B)");
+    if (sub && strcmp(sub, "bench") == 0) { dk_bench(shell_next_arg(&args)); return; }
+    if (sub) { term_setcolor(0x0C); term_write("disk: unknown subcommand "); term_write(sub); term_write("\n"); term_setcolor(0x07); return; }
+    term_setcolor(0x0F);
+    term_write(disk_model); term_write(": "); term_write_dec(disk_sectors / 2048); term_write(" MB\n");
+    term_setcolor(0x07);
+    if (!dk_mounted) {
+        term_write("No filesystem, 'disk format' writes the current tree to it\n");
+    } else {
+        term_write("Inodes: "); term_write_dec(dk_used_inodes); term_write(" used of "); term_write_dec(dk_super.inode_count);
+        term_write(", data: "); term_write_dec((dk_super.data_blocks - dk_free_blocks) / 2); term_write(" KB used of ");
+        term_write_dec(dk_super.data_blocks / 2); term_write(" KB\n");
+        term_write("Lazy loads: "); term_write_dec(dk_loads); term_write(" files, pending changes: ");
+        term_write(fs_changed ? "yes\n" : "no\n");
+    }
+    term_write("Cache: "); term_write_dec(BC_ENTRIES * BC_CLUSTER / 1024); term_write(" KB, ");
+    term_write_dec(bc_hits); term_write(" hits, "); term_write_dec(bc_misses); term_write(" misses, ");
+    term_write_dec(bc_readahead); term_write(" clusters read ahead, ");
+    term_write_dec(bc_dirty); term_write(" dirty\n");
+    term_write("I/O: "); term_write_dec(disk_reads); term_write(" sectors read, ");
+    term_write_dec(disk_writes); term_write(" written");
+    if (dk_sync_us) {
+        term_write(", last sync "); term_write_dec(dk_sync_sectors); term_write(" sectors in ");
+        term_write_dec(dk_sync_us / 1000); term_write(" ms");
+    }
+    term_write("\n");
+}
+
+void cmd_lspci() {
+    for (uint32_t i = 0; i < pci_device_count; i++) {
+        pci_device_t* d = &pci_devices[i];
+        term_write_hex(d->bus, 2); term_putchar(':'); term_write_hex(d->slot, 2); term_putchar('.'); term_write_hex(d->func, 1);
+        term_write("  "); term_write_hex(d->vendor, 4); term_putchar(':'); term_write_hex(d->device, 4);
+        term_write("  "); term_write(pci_class_name(d->class_code)); term_putchar(' ');
+        term_write_hex(d->class_code, 2); term_write_hex(d->subclass, 2);
+        if (d->irq && d->irq != 0xFF) { term_write(", irq "); term_write_dec(d->irq); }
+        if (d->vendor == VIRTIO_VENDOR && d->device == VIRTIO_DEV_BLK) term_write(blk_present ? " (virtio-blk, in use)" : " (virtio-blk)");
+        term_write("\n");
+    }
+    if (!pci_device_count) term_write("No PCI devices\n");
+}
+
+#define BLKBENCH_MS 250
+#define BLKBENCH_MAX_DEPTH 32
+#define BLKBENCH_SEQ_BYTES (64 * 1024)
+#define BLKBENCH_RAND_BYTES 4096
+
+// Keeps depth reads in flight for BLKBENCH_MS: whatever completes is
+// resubmitted, and the resubmissions of one poll share a notification
+static void blkbench_run(const char* label, uint32_t depth, uint32_t bytes, bool random, uint8_t* buffers) {
+    blk_request_t reqs[BLKBENCH_MAX_DEPTH];
+    blk_sg_t sg[BLKBENCH_MAX_DEPTH];
+    uint32_t span = (uint32_t)udiv64(blk_capacity < 0xFFFFFFFF ? blk_capacity : 0xFFFFFFFF, bytes / BLK_SECTOR);
+    if (!span) { term_setcolor(0x0C); term_write(label); term_write(": disk smaller than one request\n"); term_setcolor(0x07); return; }
+    uint32_t next = 0, seed = 12345, count = 0, errors = 0, active = 0, kicks = blk_kicks;
+    uint64_t start = time_us(), end = start + BLKBENCH_MS * 1000, now = start;
+    for (uint32_t i = 0; i < depth; i++) {
+        sg[i].data = buffers + i * bytes;
+        sg[i].len = bytes;
+        reqs[i].sg = NULL;                        // free slot
+        reqs[i].complete = true;
+    }
+    while (true) {
+        bool running = now < end;
+        uint32_t seen = blk_completed;
+        for (uint32_t i = 0; i < depth; i++) {
+            blk_request_t* r = &reqs[i];
+            if (!r->complete) continue;
+            if (r->sg) { count++; if (!r->ok) errors++; active--; }
+            r->sg = NULL;
+            if (!running) continue;
+            memset(r, 0, sizeof(*r));
+            r->type = BLK_READ;
+            r->sg = &sg[i];
+            r->sg_count = 1;
+            if (random) seed = seed * 1103515245 + 12345;
+            r->sector = (uint64_t)(random ? (seed >> 4) % span : next++ % span) * (bytes / BLK_SECTOR);
+            if (blk_submit(r)) active++;
+            else { r->sg = NULL; r->complete = true; }
         }
-        term_write("  ");
+        if (!active) break;
+        blk_kick();
+        blk_wait_completion(seen);
+        now = time_us();
     }
-    if (dir->child_count > 0) term_write("\n");
-    term_setcolor(0x07);
+    uint64_t us = now - start;
+    if (!us) us = 1;
+    kicks = blk_kicks - kicks;
+    term_write(label);
+    while (term_col < 10) term_putchar(' ');
+    term_write_dec(depth);
+    while (term_col < 16) term_putchar(' ');
+    term_write_dec((uint32_t)udiv64((uint64_t)count * 1000000, us));
+    while (term_col < 25) term_putchar(' ');
+    fw_cfg_write_rate((uint64_t)count * bytes, us);
+    while (term_col < 40) term_putchar(' ');
+    term_write_dec(count ? (uint32_t)udiv64(us * depth, count) : 0);
+    while (term_col < 49) term_putchar(' ');
+    term_write_dec(kicks ? count / kicks : count); term_write(".");
+    term_write_dec(kicks ? count * 10 / kicks % 10 : 0);
+    if (errors) { term_setcolor(0x0C); term_write("  "); term_write_dec(errors); term_write(" errors"); term_setcolor(0x07); }
+    term_write("\n");
 }
 
-void cmd_help() {
+// Sequential 64 KB and random 4 KB reads at growing queue depths; the
+// disk's content is not modified
+void cmd_blkbench() {
+    if (!blk_present) { term_setcolor(0x0C); term_write("blkbench: no virtio-blk disk (QEMU -drive if=virtio)\n"); term_setcolor(0x07); return; }
+    static const uint32_t depths[] = {1, 4, 16, 32};
+    uint32_t pages = BLKBENCH_MAX_DEPTH * BLKBENCH_SEQ_BYTES / PAGE_SIZE;
+    uint8_t* buffers = kpage_alloc(pages);
+    if (!buffers) { term_setcolor(0x0C); term_write("blkbench: out of memory\n"); term_setcolor(0x07); return; }
     term_setcolor(0x0F);
-    term_write("\n🎯 HybridOS Ultimate v2.0 - Complete Command Reference\n");
-    term_write("========================================================\n");
-    term_setcolor(0x0A);
-    term_write("📁 FILES:     "); term_setcolor(0x07); term_write("ls [path], cd <dir>, pwd, mkdir <n>, touch <file>\n");
-    term_setcolor(0x0A);
-    term_write("               "); term_setcolor(0x07); term_write("cat <file>, cp <src> <dest>, mv <old> <new>, rm <file>\n");
-    term_setcolor(0x0A);
-    term_write("               "); term_setcolor(0x07); term_write("find <pattern>, grep <text> <file>, tree\n");
-    term_setcolor(0x0A);
-    term_write("✍️ EDITOR:     "); term_setcolor(0x07); term_write("edit <filename> (Ctrl+S save, Ctrl+X exit)\n");
-    term_setcolor(0x0A);
-    term_write("🎮 GAMES:      "); term_setcolor(0x07); term_write("snake, pong, matrix\n");
-    term_setcolor(0x0A);
-    term_write("🎨 GRAPHICS:   "); term_setcolor(0x07); term_write("graphics (VGA mode demo)\n");
-    term_setcolor(0x0A);
-    term_write("🔧 PROCESS:    "); term_setcolor(0x07); term_write("ps, kill <pid>\n");
-    term_setcolor(0x0A);
-    term_write("🌐 NETWORK:    "); term_setcolor(0x07); term_write("ping <host>, http\n");
-    term_setcolor(0x0A);
-    term_write("💻 DEV:        "); term_setcolor(0x07); term_write("compile <file.c>, basic <code>, run <program>\n");
-    term_setcolor(0x0A);
-    term_write("⚙️ SYSTEM:     "); term_setcolor(0x07); term_write("clear, help, about, reboot\n");
-    term_setcolor(0x0E);
-    term_write("\n🎯 Quick Start: cd home/user && cat readme.txt\n");
+    term_write("Test      QD    IOPS     Throughput     Lat us   Req/notify\n");
     term_setcolor(0x07);
+    for (int random = 0; random < 2; random++)
+        for (uint32_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+            if (depths[i] * 3 <= vq_size)        // header, data and status descriptors
+                blkbench_run(random ? "rand 4K" : "seq 64K", depths[i], random ? BLKBENCH_RAND_BYTES : BLKBENCH_SEQ_BYTES, random, buffers);
+    kpage_free(buffers, pages);
+    if (blk_irq_driven) { term_write("Completions: IRQ "); term_write_dec(blk_irq_line); term_write(", "); term_write_dec(blk_irqs); term_write(" interrupts\n"); }
+    else term_write("Completions: polled\n");
 }
 
 // ==================== BOOT ANIMATION ====================
@@ -1281,142 +6622,732 @@ void show_boot_logo() {
 }
 
 // ==================== COMMAND PROCESSING ====================
-void process_command(char* cmd) {
-    char command[64], arg1[128];
-    // CORRIGÉ: suppression de arg2 non utilisé
-    int i = 0, j = 0;
-    
-    // Parse command
-    while (cmd[i] && cmd[i] != ' ' && j < 63) command[j++] = cmd[i++];
-    command[j] = '\0';
-    while (cmd[i] == ' ') i++;
-    j = 0;
-    while (cmd[i] && j < 127) arg1[j++] = cmd[i++];
-    arg1[j] = '\0';
+// Every command is one entry of the registry below: name, handler,
+// arguments, help text, and the filter of commands that read a pipe.
+// Dispatch, help and tab completion all read it.
+// Lookups go through a perfect hash built on first use: a seed is tried
+// until the seeded FNV-1a hash of every name lands in a slot of its own, so
+// finding a command is one hash and one strcmp whatever its position. The
+// names also go in a trie for completion, see TAB COMPLETION.
+enum { CMD_FILES, CMD_EDITOR, CMD_GAMES, CMD_GRAPHICS, CMD_PROCESS, CMD_NETWORK, CMD_DEV, CMD_SYSTEM, CMD_GROUPS };
+
+typedef struct {
+    const char* name;
+    const char* args;           // "<x>" is required, "[x]" optional
+    uint8_t group;
+    void (*run)(char* args);    // one of these two
+    void (*run_plain)(void);
+    const char* help;
+    const filter_t* filter;     // reads the input of a pipe or <
+} command_t;
+
+#define CMD_SLOTS 256            // power of two, several times the commands
+#define CMD_TRIE_NODES 512
+#define CMD_SEED_TRIES 65536     // FNV seeds tried for a perfect hash
+#define CMD_NO_SEED 0xFFFFFFFFu  // none found: lookups walk the trie
+
+// Trie node: children are a sorted sibling list, 0 ends a list
+typedef struct {
+    char c;
+    uint16_t child, sibling;
+    const command_t* command;   // a name ends here
+} command_trie_t;
+
+void cmd_cd(char* args) {
+    if (!args[0]) { current_dir = fs_root; strcpy(current_path, "/"); return; }
+    fs_node_t* new_dir = fs_resolve_path(args);
+    if (!new_dir) {
+        term_setcolor(0x0C); term_write("cd: "); term_write(args); term_write(": No such file or directory\n"); term_setcolor(0x07);
+    } else if (new_dir->type != FS_DIRECTORY) {
+        term_setcolor(0x0C); term_write("cd: "); term_write(args); term_write(": Not a directory\n"); term_setcolor(0x07);
+    } else {
+        current_dir = new_dir; fs_get_path(current_dir, current_path);
+    }
+}
+
+void cmd_pwd() { term_write(current_path); term_write("\n"); }
+
+void cmd_echo(char* args) {
+    char* arg;
+    for (bool first = true; (arg = shell_next_arg(&args)); first = false) {
+        if (!first) term_putchar(' ');
+        term_write(arg);
+    }
+    term_write("\n");
+}
+
+void cmd_mkdir(char* args) {
+    if (fs_lookup(current_dir, args)) { term_setcolor(0x0C); term_write("mkdir: "); term_write(args); term_write(": File exists\n"); term_setcolor(0x07); }
+    else if (!fs_create_node(args, FS_DIRECTORY, current_dir)) { term_setcolor(0x0C); term_write("mkdir: Out of space\n"); term_setcolor(0x07); }
+}
+
+void cmd_touch(char* args) {
+    if (!fs_lookup(current_dir, args)) fs_create_node(args, FS_FILE, current_dir);
+}
+
+static void remove_command(const char* command, const char* path, bool dir_only) {
+    fs_node_t* node = fs_resolve_path(path);
+    const char* error = NULL;
+    if (!node) error = ": No such file or directory\n";
+    else if (dir_only && node->type != FS_DIRECTORY) error = ": Not a directory\n";
+    else if (fs_child_count(node) > 0) error = ": Directory not empty\n";
+    else if (!fs_remove_node(node)) error = ": Device or resource busy\n";
+    if (error) { term_setcolor(0x0C); term_write(command); term_write(": "); term_write(path); term_write(error); term_setcolor(0x07); }
+}
+
+void cmd_rm(char* args) { remove_command("rm", args, false); }
+void cmd_rmdir(char* args) { remove_command("rmdir", args, true); }
+
+void cmd_mv(char* args) {
+    char* arg2 = strchr(args, ' ');
+    if (arg2) { *arg2++ = '\0'; while (*arg2 == ' ') arg2++; }
+    if (!arg2 || !*arg2) { term_setcolor(0x0C); term_write("mv: missing operand\n"); term_setcolor(0x07); return; }
+    fs_node_t* src = fs_resolve_path(args);
+    if (!src) { term_setcolor(0x0C); term_write("mv: "); term_write(args); term_write(": No such file or directory\n"); term_setcolor(0x07); return; }
+    char name[MAX_FILENAME];
+    fs_node_t* dest_dir = fs_resolve_path(arg2);
+    if (dest_dir && dest_dir->type == FS_DIRECTORY) strcpy(name, src->name);
+    else dest_dir = fs_resolve_parent(arg2, name);
+    if (!dest_dir || !name[0] || !fs_rename(src, dest_dir, name)) {
+        term_setcolor(0x0C); term_write("mv: cannot move '"); term_write(args); term_write("' to '"); term_write(arg2); term_write("'\n"); term_setcolor(0x07);
+    } else if (fs_is_within(current_dir, src)) {
+        fs_get_path(current_dir, current_path);
+    }
+}
+
+void cmd_cat(char* args) {
+    fs_node_t* file = fs_resolve_path(args);
+    if (!file) { term_setcolor(0x0C); term_write("cat: "); term_write(args); term_write(": No such file or directory\n"); term_setcolor(0x07); }
+    else if (file->type == FS_DIRECTORY) { term_setcolor(0x0C); term_write("cat: "); term_write(args); term_write(": Is a directory\n"); term_setcolor(0x07); }
+    else {
+        char buf[FS_BLOCK_SIZE];
+        uint32_t offset = 0, n = 0;
+        while ((n = fs_read(file, offset, buf, sizeof(buf))) > 0) {
+            for (uint32_t k = 0; k < n; k++) term_putchar(buf[k]);
+            offset += n;
+        }
+        if (file->size > 0 && buf[(file->size - 1) % FS_BLOCK_SIZE] != '\n') term_write("\n");
+    }
+}
+
+// cat without a file copies its input
+static bool cat_filter_begin(void* state, char* args) { (void)state; return !args[0]; }
+static void cat_filter_feed(void* state, pipe_t* in, bool eof) { (void)state; (void)eof; pipe_pass(in); }
+static const filter_t cat_filter = { 0, cat_filter_begin, cat_filter_feed };
+
+void cmd_edit(char* args) {
+    char* arg2 = strchr(args, ' ');
+    size_t line = 0;
+    if (arg2) *arg2++ = '\0';
+    while (arg2 && *arg2 >= '0' && *arg2 <= '9') line = line * 10 + (*arg2++ - '0');
+    editor_init(args);
+    if (!editor.text) { term_setcolor(0x0C); term_write("edit: out of memory\n"); term_setcolor(0x07); return; }
+    if (line) editor_goto_line(line - 1);
     
-    // Execute commands
-    if (strcmp(command, "help") == 0) cmd_help();
-    else if (strcmp(command, "clear") == 0) term_clear();
-    else if (strcmp(command, "ls") == 0) cmd_ls(arg1[0] ? arg1 : NULL);
-    else if (strcmp(command, "cd") == 0) {
-        if (!arg1[0]) {
-            current_dir = fs_root; strcpy(current_path, "/");
-        } else {
-            fs_node_t* new_dir = fs_resolve_path(arg1);
-            if (!new_dir) {
-                term_setcolor(0x0C); term_write("cd: "); term_write(arg1); term_write(": No such file or directory\n"); term_setcolor(0x07);
-            } else if (new_dir->type != FS_DIRECTORY) {
-                term_setcolor(0x0C); term_write("cd: "); term_write(arg1); term_write(": Not a directory\n"); term_setcolor(0x07);
-            } else {
-                current_dir = new_dir; fs_get_path(current_dir, current_path);
-            }
+    while (true) {
+        editor_display();
+        char key = read_key();
+        if (key == 19) { editor_save(); } // Ctrl+S
+        else if (key == 24) { editor_close(); break; } // Ctrl+X
+        else if (key == '\b') editor_backspace();
+        else if (key == 3) editor_left();
+        else if (key == 4) editor_right();
+        else if (key == 1 && editor.line > 0) editor_goto_line(editor.line - 1);
+        else if (key == 2) editor_goto_line(editor.line + 1);
+        else if (key == 5) editor_home();
+        else if (key == 6) editor_end();
+        else if (key == 11) editor_page(false);
+        else if (key == 12) editor_page(true);
+        else if (key >= 32 || key == '\n') editor_insert(key);
+    }
+    term_clear();
+}
+
+void cmd_graphics() {
+    init_graphics();
+    // Graphics demo
+    for (int i = 0; i < 100; i++) {
+        memset(GRAPHICS_MEMORY, 0, 320 * 200);
+        draw_rect(i, 50, 50, 50, 4);
+        draw_line(0, i, 319, 199 - i, 15);
+        for (volatile int j = 0; j < 200000; j++);
+    }
+    exit_graphics(); term_clear();
+    term_setcolor(0x0A); term_write("Graphics demo complete!\n"); term_setcolor(0x07);
+}
+
+void cmd_dedup(char* args) {
+    if (strcmp(args, "on") == 0) fs_dedup_enabled = true;
+    else if (strcmp(args, "off") == 0) fs_dedup_enabled = false;
+    term_write("Block deduplication is ");
+    term_write(fs_dedup_enabled ? "on\n" : "off\n");
+}
+
+void cmd_compress(char* args) {
+    if (strcmp(args, "on") == 0) fs_compress_enabled = true;
+    else if (strcmp(args, "off") == 0) fs_compress_enabled = false;
+    else if (strcmp(args, "now") == 0) {
+        term_write_dec(fs_compress_all());
+        term_write(" files compressed\n");
+    }
+    term_write("Background compression of cold files is ");
+    term_write(fs_compress_enabled ? "on\n" : "off\n");
+}
+
+void cmd_ping(char* args) { ping(args[0] ? args : "127.0.0.1"); }
+
+void cmd_about() {
+    term_setcolor(0x0E); term_write("\n🚀 HybridOS Ultimate v2.0\n");
+    term_setcolor(0x0B); term_write("The Complete Operating System\n"); term_setcolor(0x07);
+    term_write("✨ All Features Included:\n");
+    term_write("   📁 Complete filesystem (Unix-like commands)\n");
+    term_write("   ✍️ Integrated text editor with syntax highlighting\n");
+    term_write("   🎮 Games: Snake, Pong with VGA graphics\n");
+    term_write("   🎨 Graphics mode with pixel manipulation\n");
+    term_write("   🔧 Process management\n");
+    term_write("   🌐 Network stack with ping and HTTP server\n");
+    term_write("   💻 C compiler and BASIC interpreter\n");
+    term_write("   ⌨️ Advanced interface: history, autocompletion, colors\n");
+    term_write("   🕐 Real-time clock\n");
+    term_write("   🎬 Boot animations and visual effects\n\n");
+    term_setcolor(0x0A); term_write("Windows + Linux + Ultimate = Freedom!\n"); term_setcolor(0x07);
+}
+
+void cmd_input(char* args) {
+    char* sub = shell_next_arg(&args);
+    char* path = shell_next_arg(&args);
+    char* mode = shell_next_arg(&args);
+    const char* error = NULL;
+    if (sub && strcmp(sub, "reset") == 0) { input_samples = 0; return; }
+    if (sub && strcmp(sub, "stop") == 0) {
+        if (input_replaying) { input_replay_end(); return; }
+        int keys;
+        if (!input_recording) error = "not recording";
+        else if ((keys = input_record_stop()) < 0) error = "cannot write the recording";
+        else { term_write("Saved "); term_write_dec(keys); term_write(" keys to "); term_write(input_path); term_write("\n"); }
+    } else if (sub && (strcmp(sub, "record") == 0 || strcmp(sub, "replay") == 0)) {
+        if (!path) error = "missing file operand";
+        else if (input_recording || input_replaying) error = "already recording or replaying";
+        else if (sub[2] == 'c') {
+            if (!input_record_start(path)) error = "cannot create the file";
+            else { term_write("Recording keys to "); term_write(input_path); term_write(", 'input stop' ends\n"); }
+        }
+        else error = input_replay_start(path, mode && strcmp(mode, "fast") == 0);
+    } else if (sub) {
+        error = "usage: input [record <file>|replay <file> [fast]|stop|reset]";
+    } else {
+        if (input_recording) { term_write("Recording to "); term_write(input_path); term_write(", "); term_write_dec(input_count); term_write(" keys\n"); }
+        if (input_replaying) { term_write("Replaying key "); term_write_dec(input_next); term_putchar('/'); term_write_dec(input_count); term_write("\n"); }
+        if (input_replay_keys) {
+            term_write("Last replay: "); term_write_dec(input_replay_keys); term_write(" keys in ");
+            term_write_dec(input_replay_ms); term_write(" ms\n");
         }
+        uint32_t n = input_samples < INPUT_SAMPLES ? input_samples : INPUT_SAMPLES;
+        if (!n) { term_write("No keys measured yet\n"); return; }
+        // Insertion sort, a few hundred thousand steps at most
+        static uint32_t sorted[INPUT_SAMPLES];
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t v = input_latency[i], j = i;
+            for (; j > 0 && sorted[j - 1] > v; j--) sorted[j] = sorted[j - 1];
+            sorted[j] = v;
+        }
+        term_write("Key to echo over the last "); term_write_dec(n); term_write(" keys (us): min ");
+        term_write_dec(sorted[0]); term_write(", median "); term_write_dec(sorted[n / 2]);
+        term_write(", p99 "); term_write_dec(sorted[n * 99 / 100]); term_write(", max "); term_write_dec(sorted[n - 1]); term_write("\n");
     }
-    else if (strcmp(command, "pwd") == 0) { term_write(current_path); term_write("\n"); }
-    else if (strcmp(command, "mkdir") == 0) {
-        if (!arg1[0]) { term_setcolor(0x0C); term_write("mkdir: missing operand\n"); term_setcolor(0x07); }
-        else if (fs_find_child(current_dir, arg1)) { term_setcolor(0x0C); term_write("mkdir: "); term_write(arg1); term_write(": File exists\n"); term_setcolor(0x07); }
-        else if (!fs_create_node(arg1, FS_DIRECTORY, current_dir)) { term_setcolor(0x0C); term_write("mkdir: Out of space\n"); term_setcolor(0x07); }
-    }
-    else if (strcmp(command, "touch") == 0) {
-        if (!arg1[0]) { term_setcolor(0x0C); term_write("touch: missing file operand\n"); term_setcolor(0x07); }
-        else if (!fs_find_child(current_dir, arg1)) fs_create_node(arg1, FS_FILE, current_dir);
-    }
-    else if (strcmp(command, "cat") == 0) {
-        if (!arg1[0]) { term_setcolor(0x0C); term_write("cat: missing file operand\n"); term_setcolor(0x07); }
-        else {
-            fs_node_t* file = fs_resolve_path(arg1);
-            if (!file) { term_setcolor(0x0C); term_write("cat: "); term_write(arg1); term_write(": No such file or directory\n"); term_setcolor(0x07); }
-            else if (file->type == FS_DIRECTORY) { term_setcolor(0x0C); term_write("cat: "); term_write(arg1); term_write(": Is a directory\n"); term_setcolor(0x07); }
-            else if (file->content) {
-                term_write(file->content);
-                if (file->size > 0 && file->content[file->size - 1] != '\n') term_write("\n");
-            }
+    if (error) { term_setcolor(0x0C); term_write("input: "); term_write(error); term_write("\n"); term_setcolor(0x07); }
+}
+
+void cmd_reboot() {
+    term_setcolor(0x0C); term_write("🔄 Rebooting HybridOS...\n");
+    term_write("System restart initiated.\n");
+    outb(0x64, 0xFE);
+}
+
+void cmd_help(char* args);
+
+static const command_t commands[] = {
+    {"ls",       "[path]",                      CMD_FILES,    cmd_ls, NULL,            "List files and directories", NULL},
+    {"cd",       "[dir]",                       CMD_FILES,    cmd_cd, NULL,            "Change directory, / without argument", NULL},
+    {"pwd",      "",                            CMD_FILES,    NULL, cmd_pwd,           "Show the current directory", NULL},
+    {"mkdir",    "<name>",                      CMD_FILES,    cmd_mkdir, NULL,         "Create a directory", NULL},
+    {"touch",    "<file>",                      CMD_FILES,    cmd_touch, NULL,         "Create an empty file", NULL},
+    {"echo",     "[text]",                      CMD_FILES,    cmd_echo, NULL,          "Print text, echo text > file writes it", NULL},
+    {"cat",      "<file>",                      CMD_FILES,    cmd_cat, NULL,           "Display a file, or the input of a pipe", &cat_filter},
+    {"cp",       "[-r] <src> <dest>",           CMD_FILES,    cmd_cp, NULL,            "Copy files or directories", NULL},
+    {"mv",       "<old> <new>",                 CMD_FILES,    cmd_mv, NULL,            "Move or rename", NULL},
+    {"rm",       "<file>",                      CMD_FILES,    cmd_rm, NULL,            "Remove a file or an empty directory", NULL},
+    {"rmdir",    "<dir>",                       CMD_FILES,    cmd_rmdir, NULL,         "Remove an empty directory", NULL},
+    {"find",     "[dir] <glob>|-regex <re>",    CMD_FILES,    cmd_find, NULL,          "Search for files by name", NULL},
+    {"grep",     "[-rcnFE] <pattern> [path]",  CMD_FILES,    cmd_grep, NULL,          "Search in files, or in the input of a pipe", &grep_filter},
+    {"df",       "",                            CMD_FILES,    NULL, cmd_df,            "Filesystem usage", NULL},
+    {"dedup",    "[on|off]",                    CMD_FILES,    cmd_dedup, NULL,         "Block deduplication", NULL},
+    {"compress", "[on|off|now]",                CMD_FILES,    cmd_compress, NULL,      "Background compression of cold files", NULL},
+    {"index",    "[on|off|rebuild]",            CMD_FILES,    cmd_index, NULL,         "Trigram index for grep", NULL},
+    {"import",   "[name [dest]]",               CMD_FILES,    cmd_import, NULL,        "Copy QEMU -fw_cfg files to /import", NULL},
+    {"disk",     "[format|bench [file]]",       CMD_FILES,    cmd_disk, NULL,          "Disk filesystem (QEMU -hda or virtio disk)", NULL},
+    {"sync",     "",                            CMD_FILES,    NULL, cmd_sync,          "Write everything to the disk", NULL},
+    {"lspci",    "",                            CMD_FILES,    NULL, cmd_lspci,         "List PCI devices", NULL},
+    {"blkbench", "",                            CMD_FILES,    NULL, cmd_blkbench,      "virtio-blk read IOPS by queue depth", NULL},
+    {"edit",     "<file> [line]",               CMD_EDITOR,   cmd_edit, NULL,          "Text editor (Ctrl+S save, Ctrl+X exit)", NULL},
+    {"snake",    "",                            CMD_GAMES,    NULL, game_snake,        "Snake (WASD to move, Q to quit)", NULL},
+    {"pong",     "",                            CMD_GAMES,    NULL, game_pong,         "Pong (WS for the paddle)", NULL},
+    {"matrix",   "",                            CMD_GAMES,    NULL, matrix_effect,     "Matrix digital rain", NULL},
+    {"graphics", "",                            CMD_GRAPHICS, NULL, cmd_graphics,      "VGA mode demo", NULL},
+    {"ps",       "",                            CMD_PROCESS,  NULL, list_processes,    "List processes", NULL},
+    {"ping",     "[host]",                      CMD_NETWORK,  cmd_ping, NULL,          "Ping a host", NULL},
+    {"http",     "",                            CMD_NETWORK,  NULL, http_server,       "HTTP server demo", NULL},
+    {"compile",  "<file.c>",                    CMD_DEV,      compile_c, NULL,         "Compile a C file", NULL},
+    {"basic",    "<code>",                      CMD_DEV,      interpret_basic, NULL,   "Run a line of BASIC", NULL},
+    {"clear",    "",                            CMD_SYSTEM,   NULL, term_clear,        "Clear the screen", NULL},
+    {"help",     "[command]",                   CMD_SYSTEM,   cmd_help, NULL,          "This list, or how to use a command", NULL},
+    {"about",    "",                            CMD_SYSTEM,   NULL, cmd_about,         "About HybridOS", NULL},
+    {"input",    "[record|replay <file> [fast]|stop]", CMD_SYSTEM, cmd_input, NULL,     "Record and replay keys, keystroke latency", NULL},
+    {"serial",   "",                            CMD_SYSTEM,   NULL, cmd_serial,        "COM1 console statistics", NULL},
+    {"dcache",   "",                            CMD_SYSTEM,   NULL, cmd_dcache,        "Path lookup cache statistics", NULL},
+    {"reboot",   "",                            CMD_SYSTEM,   NULL, cmd_reboot,        "Restart the machine", NULL},
+};
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+static const command_t* command_slots[CMD_SLOTS];
+static uint32_t command_seed = 0;          // 0 until the table is built, else CMD_NO_SEED
+static command_trie_t command_trie[CMD_TRIE_NODES];     // [0] is the root
+static uint16_t command_trie_size = 1;
+
+static uint32_t command_hash(const char* name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    while (*name) hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    return hash & (CMD_SLOTS - 1);
+}
+
+// False when the trie is full or already has the name
+static bool command_trie_add(const command_t* command) {
+    uint16_t node = 0;
+    for (const char* p = command->name; *p; p++) {
+        uint16_t* link = &command_trie[node].child;
+        while (*link && command_trie[*link].c < *p) link = &command_trie[*link].sibling;
+        if (!*link || command_trie[*link].c != *p) {
+            if (command_trie_size == CMD_TRIE_NODES) return false;
+            command_trie_t* added = &command_trie[command_trie_size];
+            added->c = *p;
+            added->sibling = *link;
+            *link = command_trie_size++;
         }
+        node = *link;
     }
-    else if (strcmp(command, "edit") == 0) {
-        if (!arg1[0]) { term_setcolor(0x0C); term_write("edit: missing filename\n"); term_setcolor(0x07); return; }
-        editor_init(arg1);
-        
-        while (true) {
-            editor_display();
-            char key = read_key();
-            if (key == 19) { editor_save(); } // Ctrl+S
-            else if (key == 24) { break; } // Ctrl+X
-            else if (key == '\b') {
-                if (editor.cursor_x > 0) {
-                    // CORRIGÉ: loop avec types compatibles
-                    for (size_t i = editor.cursor_x - 1; i < editor.size - 1; i++)
-                        editor.content[i] = editor.content[i + 1];
-                    editor.size--; editor.cursor_x--; editor.modified = true;
-                }
-            }
-            else if (key >= 32 || key == '\n') {
-                if (editor.size < editor.capacity - 1) {
-                    for (size_t i = editor.size; i > editor.cursor_x; i--)
-                        editor.content[i] = editor.content[i-1];
-                    editor.content[editor.cursor_x] = key;
-                    editor.size++; editor.cursor_x++; editor.modified = true;
+    if (command_trie[node].command) return false;
+    command_trie[node].command = command;
+    return true;
+}
+
+static const command_t* command_trie_find(const char* name) {
+    uint16_t node = 0;
+    for (; *name; name++) {
+        node = command_trie[node].child;
+        while (node && command_trie[node].c != *name) node = command_trie[node].sibling;
+        if (!node) return NULL;
+    }
+    return command_trie[node].command;
+}
+
+// Searches a seed that puts every name in its own slot. A duplicate name
+// or no seed within CMD_SEED_TRIES is an error in the table above: said
+// loudly, then the trie serves the lookups.
+static void command_build() {
+    command_seed = CMD_NO_SEED;
+    for (uint32_t i = 0; i < COMMAND_COUNT; i++) {
+        if (command_trie_add(&commands[i])) continue;
+        term_setcolor(0x0C); term_write("commands: duplicate name or trie full: "); term_write(commands[i].name); term_write("\n"); term_setcolor(0x07);
+        return;
+    }
+    for (uint32_t seed = 1; seed <= CMD_SEED_TRIES; seed++) {
+        memset(command_slots, 0, sizeof(command_slots));
+        uint32_t i = 0;
+        for (; i < COMMAND_COUNT; i++) {
+            const command_t** slot = &command_slots[command_hash(commands[i].name, seed)];
+            if (*slot) break;
+            *slot = &commands[i];
+        }
+        if (i == COMMAND_COUNT) { command_seed = seed; return; }
+    }
+    term_setcolor(0x0C); term_write("commands: no perfect hash, raise CMD_SLOTS\n"); term_setcolor(0x07);
+}
+
+const command_t* command_find(const char* name) {
+    if (!command_seed) command_build();
+    if (command_seed == CMD_NO_SEED) return command_trie_find(name);
+    const command_t* command = command_slots[command_hash(name, command_seed)];
+    return command && strcmp(command->name, name) == 0 ? command : NULL;
+}
+
+void cmd_help(char* args) {
+    static const char* const groups[CMD_GROUPS] = {
+        "📁 FILES:     ", "✍️ EDITOR:     ", "🎮 GAMES:      ", "🎨 GRAPHICS:   ",
+        "🔧 PROCESS:    ", "🌐 NETWORK:    ", "💻 DEV:        ", "⚙️ SYSTEM:     "
+    };
+    if (args[0]) {
+        const command_t* command = command_find(args);
+        if (!command) { term_setcolor(0x0C); term_write("help: no such command: "); term_write(args); term_write("\n"); term_setcolor(0x07); return; }
+        term_write("Usage: "); term_write(command->name);
+        if (command->args[0]) { term_write(" "); term_write(command->args); }
+        term_write("\n  "); term_write(command->help); term_write("\n");
+        return;
+    }
+    term_setcolor(0x0F);
+    term_write("\n🎯 HybridOS Ultimate v2.0 - Complete Command Reference\n");
+    term_write("========================================================\n");
+    for (int group = 0; group < CMD_GROUPS; group++) {
+        term_setcolor(0x0A); term_write(groups[group]); term_setcolor(0x07);
+        size_t indent = term_col;
+        bool first = true;
+        for (uint32_t i = 0; i < COMMAND_COUNT; i++) {
+            const command_t* command = &commands[i];
+            if (command->group != group) continue;
+            size_t width = strlen(command->name) + (command->args[0] ? strlen(command->args) + 1 : 0);
+            if (!first) {
+                term_write(",");
+                if (term_col + width + 2 >= VGA_WIDTH) {
+                    term_write("\n");
+                    while (term_col < indent) term_putchar(' ');
+                } else {
+                    term_write(" ");
                 }
             }
+            term_write(command->name);
+            if (command->args[0]) { term_write(" "); term_write(command->args); }
+            first = false;
         }
-        term_clear();
+        term_write("\n");
+    }
+    term_setcolor(0x0E);
+    term_write("\n🎯 Quick Start: cd home/user && cat readme.txt, help <command> for details\n");
+    term_setcolor(0x07);
+}
+
+// ---- Pipelines ----
+// cmd1 | cmd2 ... [< in] [> out | >> out]: each stage after a | (or the
+// first with <) gets a pipe; a stage whose command has a filter and no
+// input of its own reads it, any other runs once the stage before is done
+// and its input is dropped. See STREAMS.
+#define SHELL_LINE 256
+#define SHELL_ARGS 128
+#define SHELL_STAGES 8
+
+typedef struct {
+    const command_t* command;
+    char args[SHELL_ARGS];
+    char filter_args[SHELL_ARGS];    // parsed in place by filter->begin
+    pipe_t* in;
+    void* state;
+} shell_stage_t;
+
+static shell_stage_t shell_stages[SHELL_STAGES];
+
+// Cuts the line at unquoted |, < and >; the stage count, -1 on a syntax error
+static int shell_parse(char* line, char** stages, char** input, char** output, bool* append) {
+    int count = 1;
+    bool quoted = false, after_target = false;
+    stages[0] = line;
+    *input = *output = NULL;
+    *append = false;
+    for (char* p = line; *p; p++) {
+        if (*p == '\\' && p[1] == '"') { p++; continue; }
+        if (*p == '"') quoted = !quoted;
+        if (quoted || !strchr("|<>", *p)) {
+            if (after_target && *p != ' ') return -1;
+            continue;
+        }
+        char c = *p;
+        *p = '\0';
+        after_target = false;
+        if (c == '|') {
+            if (count == SHELL_STAGES || *output) return -1;
+            stages[count++] = p + 1;
+            continue;
+        }
+        char** target = c == '<' ? input : output;
+        if (*target || (c == '<' && count > 1)) return -1;
+        if (c == '>' && p[1] == '>') { *append = true; p++; }
+        while (p[1] == ' ') p++;
+        *target = p + 1;
+        while (p[1] && !strchr(" |<>", p[1])) p++;
+        if (p + 1 == *target) return -1;
+        if (p[1] == ' ') *++p = '\0';
+        after_target = true;
     }
-    else if (strcmp(command, "snake") == 0) game_snake();
-    else if (strcmp(command, "pong") == 0) game_pong();
-    else if (strcmp(command, "matrix") == 0) matrix_effect();
-    else if (strcmp(command, "graphics") == 0) {
-        init_graphics();
-        // Graphics demo
-        for (int i = 0; i < 100; i++) {
-            memset(GRAPHICS_MEMORY, 0, 320 * 200);
-            draw_rect(i, 50, 50, 50, 4);
-            draw_line(0, i, 319, 199 - i, 15);
-            for (volatile int j = 0; j < 200000; j++);
-        }
-        exit_graphics(); term_clear();
-        term_setcolor(0x0A); term_write("Graphics demo complete!\n"); term_setcolor(0x07);
-    }
-    else if (strcmp(command, "ps") == 0) list_processes();
-    else if (strcmp(command, "ping") == 0) ping(arg1[0] ? arg1 : "127.0.0.1");
-    else if (strcmp(command, "http") == 0) http_server();
-    else if (strcmp(command, "compile") == 0) compile_c(arg1);
-    else if (strcmp(command, "basic") == 0) interpret_basic(arg1);
-    else if (strcmp(command, "about") == 0) {
-        term_setcolor(0x0E); term_write("\n🚀 HybridOS Ultimate v2.0\n");
-        term_setcolor(0x0B); term_write("The Complete Operating System\n"); term_setcolor(0x07);
-        term_write("✨ All Features Included:\n");
-        term_write("   📁 Complete filesystem (Unix-like commands)\n");
-        term_write("   ✍️ Integrated text editor with syntax highlighting\n");
-        term_write("   🎮 Games: Snake, Pong with VGA graphics\n");
-        term_write("   🎨 Graphics mode with pixel manipulation\n");
-        term_write("   🔧 Process management\n");
-        term_write("   🌐 Network stack with ping and HTTP server\n");
-        term_write("   💻 C compiler and BASIC interpreter\n");
-        term_write("   ⌨️ Advanced interface: history, autocompletion, colors\n");
-        term_write("   🕐 Real-time clock\n");
-        term_write("   🎬 Boot animations and visual effects\n\n");
-        term_setcolor(0x0A); term_write("Windows + Linux + Ultimate = Freedom!\n"); term_setcolor(0x07);
-    }
-    else if (strcmp(command, "reboot") == 0) {
-        term_setcolor(0x0C); term_write("🔄 Rebooting HybridOS...\n");
-        term_write("System restart initiated.\n");
-        outb(0x64, 0xFE);
-    }
-    else if (command[0] != '\0') {
-        term_setcolor(0x0C); term_write("Command not found: "); term_write(command); 
+    return quoted ? -1 : count;
+}
+
+// Splits a stage into its command and arguments: 1, 0 when empty, -1 when
+// the command does not exist
+static int shell_lookup(const char* text, shell_stage_t* stage) {
+    char command[64];
+    int i = 0, j = 0;
+    while (text[i] == ' ') i++;
+    while (text[i] && text[i] != ' ' && j < 63) command[j++] = text[i++];
+    command[j] = '\0';
+    while (text[i] == ' ') i++;
+    j = 0;
+    while (text[i] && j < SHELL_ARGS - 1) stage->args[j++] = text[i++];
+    while (j > 0 && stage->args[j - 1] == ' ') j--;
+    stage->args[j] = '\0';
+    if (!command[0]) return 0;
+    if (!(stage->command = command_find(command))) {
+        term_setcolor(0x0C); term_write("Command not found: "); term_write(command);
         term_setcolor(0x07); term_write("\nType 'help' for available commands\n");
+        return -1;
+    }
+    return 1;
+}
+
+// Whether a stage that reads files (cat, grep) names file among its
+// operands; grep's pattern is not one
+static bool shell_reads(const shell_stage_t* stage, fs_node_t* file) {
+    if (!stage->command->filter) return false;
+    bool pattern = stage->command->filter == &grep_filter;
+    char word[SHELL_ARGS];
+    for (const char* p = stage->args; *p;) {
+        while (*p == ' ') p++;
+        size_t n = 0;
+        for (; *p && *p != ' '; p++) if (*p != '"') word[n++] = *p;
+        word[n] = '\0';
+        if (!n || word[0] == '-') continue;
+        if (pattern) { pattern = false; continue; }
+        if (fs_resolve_path(word) == file) return true;
+    }
+    return false;
+}
+
+static void shell_run(const command_t* entry, char* args) {
+    if (entry->args[0] == '<' && !args[0]) {
+        term_setcolor(0x0C); term_write(entry->name); term_write(": missing operand\n");
+        term_setcolor(0x07); term_write("Usage: "); term_write(entry->name); term_write(" "); term_write(entry->args); term_write("\n");
+    } else if (entry->run) {
+        entry->run(args);
+    } else {
+        entry->run_plain();
+    }
+}
+
+void process_command(char* cmd) {
+    char line[SHELL_LINE], *texts[SHELL_STAGES], *input, *output;
+    bool append;
+    size_t len = 0;
+    for (; cmd[len] && len < SHELL_LINE - 1; len++) line[len] = cmd[len];
+    line[len] = '\0';
+    int count = shell_parse(line, texts, &input, &output, &append);
+    shell_stage_t* stages = shell_stages;
+    for (int k = 0; k < count; k++) {
+        int found = shell_lookup(texts[k], &stages[k]);
+        if (found < 0) return;
+        if (!found && count == 1 && !input && !output) return;
+        if (!found) count = -1;
+    }
+    if (count < 0) { term_setcolor(0x0C); term_write("shell: syntax error\n"); term_setcolor(0x07); return; }
+    if (count == 1 && !input && !output) { shell_run(stages[0].command, stages[0].args); return; }
+
+    fs_node_t* source = input ? fs_resolve_path(input) : NULL;
+    if (input && (!source || source->type != FS_FILE)) {
+        term_setcolor(0x0C); term_write("shell: "); term_write(input);
+        term_write(source ? ": Is a directory\n" : ": No such file or directory\n"); term_setcolor(0x07);
+        return;
+    }
+    // cat f >> f would read what it appends until the disk is full
+    fs_node_t* target = output ? fs_resolve_path(output) : NULL;
+    bool clash = target && target->type == FS_FILE && target == source;
+    for (int k = 0; target && k < count; k++) clash = clash || shell_reads(&stages[k], target);
+    if (clash) {
+        term_setcolor(0x0C); term_write("shell: "); term_write(output); term_write(": input file is output file\n"); term_setcolor(0x07);
+        return;
+    }
+    file_stream_t* sink = NULL;
+    if (output && !(sink = file_stream_open(output, append))) return;
+
+    bool ok = true;
+    for (int k = 0; k < count; k++) {
+        shell_stage_t* s = &stages[k];
+        const filter_t* filter = s->command->filter;
+        s->in = NULL; s->state = NULL;
+        if (k == 0 && !input) continue;
+        if (!(s->in = kmalloc(sizeof(pipe_t)))) ok = false;
+        else if (filter && filter->state_size && !(s->state = kmalloc(filter->state_size))) ok = false;
+    }
+    for (int k = 0; ok && k < count; k++) {
+        shell_stage_t* s = &stages[k];
+        const filter_t* filter = s->command->filter;
+        if (!s->in) continue;
+        s->in->stream.write = pipe_write;
+        s->in->head = s->in->tail = 0;
+        s->in->filter = NULL;
+        s->in->state = s->state;
+        s->in->out = k + 1 < count ? &stages[k + 1].in->stream : sink ? &sink->stream : NULL;
+        strcpy(s->filter_args, s->args);
+        if (filter && filter->begin(s->state, s->filter_args)) s->in->filter = filter;
+    }
+    // Stages in order: a filter has been fed while the stage before ran
+    // and only sees the end of its input, any other command runs now
+    for (int k = 0; ok && k < count; k++) {
+        shell_stage_t* s = &stages[k];
+        if (s->in && s->in->filter) {
+            char buf[FS_BLOCK_SIZE];
+            uint32_t offset = 0, n;
+            while (k == 0 && (n = fs_read(source, offset, buf, sizeof(buf))) > 0) {
+                pipe_write(&s->in->stream, buf, n);
+                offset += n;
+            }
+            pipe_drain(s->in, true);
+        } else {
+            term_out = k + 1 < count ? &stages[k + 1].in->stream : sink ? &sink->stream : NULL;
+            shell_run(s->command, s->args);
+            term_out = NULL;
+        }
     }
+    if (!ok) { term_setcolor(0x0C); term_write("shell: Out of memory\n"); term_setcolor(0x07); }
+    if (sink) { file_stream_flush(sink); kfree(sink); }
+    for (int k = 0; k < count; k++) { kfree(stages[k].state); kfree(stages[k].in); }
+}
+
+// ==================== TAB COMPLETION ====================
+// Tab completes the last word of the input line: the command name through
+// a trie of the registry, or a path argument from the entries of the
+// directory it names. The word grows to the longest prefix all candidates
+// share; when it can't grow, the candidates are listed, sorted for commands
+// and in directory order for paths, and the line is redrawn. A directory is
+// one pass over its packed entries, so thousands of names stay instant.
+#define COMPLETE_SHOW 96           // candidates listed before "... more"
+#define COMPLETE_COLUMN 16
+
+typedef struct {
+    size_t prefix_len;
+    char common[MAX_PATH];      // longest prefix of the candidates so far
+    size_t common_len;
+    uint32_t count;
+    bool dir;                   // last candidate is a directory
+    bool list;                  // second pass: print them
+} complete_t;
+
+static void complete_add(complete_t* c, const char* name, bool dir) {
+    if (!c->count++) {
+        c->common_len = strlen(name) < MAX_PATH ? strlen(name) : MAX_PATH - 1;
+        memcpy(c->common, name, c->common_len);
+    } else {
+        size_t n = 0;
+        while (n < c->common_len && c->common[n] == name[n]) n++;
+        c->common_len = n;
+    }
+    c->dir = dir;
+    if (!c->list) return;
+    if (c->count > COMPLETE_SHOW) {
+        if (c->count == COMPLETE_SHOW + 1) term_write("\n... ");
+        return;
+    }
+    size_t width = strlen(name) + dir;
+    if (term_col && term_col + width >= VGA_WIDTH) term_write("\n");
+    term_setcolor(dir ? 0x09 : 0x07);
+    term_write(name);
+    if (dir) term_write("/");
+    term_setcolor(0x07);
+    do term_putchar(' '); while (term_col % COMPLETE_COLUMN && term_col + 1 < VGA_WIDTH);
+}
+
+static void complete_trie(complete_t* c, uint16_t node) {
+    for (; node; node = command_trie[node].sibling) {
+        if (command_trie[node].command) complete_add(c, command_trie[node].command->name, false);
+        complete_trie(c, command_trie[node].child);
+    }
+}
+
+static void complete_command(complete_t* c, const char* prefix) {
+    uint16_t node = 0;
+    command_find("");                       // builds the tables
+    for (; *prefix && (node = command_trie[node].child); prefix++) {
+        while (node && command_trie[node].c != *prefix) node = command_trie[node].sibling;
+        if (!node) return;
+    }
+    if (*prefix) return;
+    if (node && command_trie[node].command) complete_add(c, command_trie[node].command->name, false);
+    complete_trie(c, command_trie[node].child);
+}
+
+static void complete_path(complete_t* c, const char* word) {
+    const char* slash = strrchr(word, '/');
+    fs_node_t* dir = current_dir;
+    if (slash) {
+        char path[MAX_PATH];
+        size_t len = slash - word;
+        if (len >= MAX_PATH) return;
+        memcpy(path, word, len);
+        path[len] = '\0';
+        dir = len ? fs_resolve_path(path) : fs_root;
+        word = slash + 1;
+        if (!dir) return;
+    }
+    size_t len = strlen(word);
+    for (uint32_t i = 0; i < fs_child_count(dir); i++) {
+        fs_node_t* child = fs_child(dir, i);
+        if (strncmp(child->name, word, len) == 0) complete_add(c, child->name, child->type == FS_DIRECTORY);
+    }
+}
+
+// Completes buffer[0, pos) in place and on screen; returns the new length
+int shell_complete(char* buffer, int pos, int max_len) {
+    buffer[pos] = '\0';
+    char* word = strrchr(buffer, ' ');
+    bool command = !word;
+    word = word ? word + 1 : buffer;
+    const char* last = strrchr(word, '/');
+    complete_t c = {0};
+    c.prefix_len = strlen(last ? last + 1 : word);
+    if (command) complete_command(&c, word);
+    else complete_path(&c, word);
+    if (!c.count) return pos;
+
+    if (c.common_len > c.prefix_len || c.count == 1) {
+        for (size_t i = c.prefix_len; i < c.common_len && pos < max_len - 2; i++) buffer[pos++] = c.common[i];
+        if (c.count == 1) buffer[pos++] = c.dir ? '/' : ' ';
+        buffer[pos] = '\0';
+        term_write(buffer + (pos - (int)(c.common_len - c.prefix_len) - (c.count == 1)));
+        return pos;
+    }
+    // Nothing to add: show the choices and redraw the line under them
+    c.count = 0;
+    c.list = true;
+    term_write("\n");
+    if (command) complete_command(&c, word);
+    else complete_path(&c, word);
+    if (c.count > COMPLETE_SHOW) { term_write_dec(c.count - COMPLETE_SHOW); term_write(" more"); }
+    term_write("\n");
+    shell_prompt();
+    term_write(buffer);
+    return pos;
 }
 
 // ==================== MAIN KERNEL ====================
-void kernel_main(void) {
+#define MULTIBOOT_MAGIC 0x2BADB002
+extern uint8_t kernel_end[];
+
+void kernel_main(uint32_t magic, multiboot_info_t* mbi) {
     // Boot animation
     show_boot_logo();
     
     // Initialize all systems
     term_clear();
+#ifdef HOSTED
+    size_t mem_start = (size_t)hosted_memory, mem_end = mem_start + hosted_memory_size;
+    if (magic == MULTIBOOT_MAGIC && (mbi->flags & 8)) boot_save_modules(mbi, mem_start);
+#else
+    size_t mem_start = (size_t)kernel_end, mem_end = 32 * 1024 * 1024;
+    if (magic == MULTIBOOT_MAGIC && (mbi->flags & 1) && mbi->mem_upper < 3 * 1024 * 1024)
+        mem_end = 0x100000 + (size_t)mbi->mem_upper * 1024;
+    if (magic == MULTIBOOT_MAGIC && (mbi->flags & 8)) mem_start = boot_save_modules(mbi, mem_start);
+#endif
+    kmem_init((void*)mem_start, (void*)mem_end);
+    time_init();
+    serial_init();
     fs_init();
+    boot_mount_disk();
+    boot_mount_modules();
+    boot_import_fw_cfg();
     init_processes();
     enable_cursor();
     // init_idt();  // Simplifié pour compatibilité
@@ -1456,20 +7387,7 @@ void kernel_main(void) {
     
     // Main command loop
     while (1) {
-        // Show enhanced prompt
-        term_setcolor(0x0A);
-        term_write("[");
-        term_setcolor(0x0E);
-        term_write(current_path);
-        term_setcolor(0x0A);
-        term_write("] ");
-        term_setcolor(0x0B);
-        term_write("HybridOS");
-        term_setcolor(0x0D);
-        term_write(">");
-        term_setcolor(0x07);
-        term_write(" ");
-        
+        shell_prompt();
         get_input_with_history(input_buffer, 256);
         process_command(input_buffer);
     }
@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+# Packs a host directory into a HybridOS filesystem image, loaded by GRUB
+# as a multiboot module and mounted at boot:
+#
+#     python3 mkfsimage.py rootfs iso/boot/rootfs.img [--mount /]
+#     grub.cfg:  module /boot/rootfs.img
+#
+# Layout (little endian), see BOOT IMAGE in kernel/kernel.c:
+#   header   magic "HYFS", version, entry_count, entries_offset,
+#            names_offset, names_size, data_offset, data_blocks, mount
+#   entries  parent, name, type (1 file, 2 directory), size, block
+#   names    NUL-terminated strings, the mount path first
+#   data     512-byte blocks; each file is contiguous, identical files
+#            share their blocks
+import argparse
+import os
+import struct
+import sys
+
+MAGIC = 0x53465948
+VERSION = 1
+BLOCK = 512
+MAX_FILENAME = 32
+FS_FILE, FS_DIRECTORY = 1, 2
+HEADER = struct.Struct("<9I")
+ENTRY = struct.Struct("<5I")
+
+
+def align(n, to):
+    return (n + to - 1) // to * to
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build a HybridOS boot filesystem image")
+    parser.add_argument("source", help="directory to pack")
+    parser.add_argument("output", help="image file to write")
+    parser.add_argument("--mount", default="/", help="where the kernel mounts the image (default /)")
+    args = parser.parse_args()
+
+    names = bytearray()
+    name_offsets = {}
+
+    def name(s):
+        if s not in name_offsets:
+            name_offsets[s] = len(names)
+            names.extend(s.encode() + b"\0")
+        return name_offsets[s]
+
+    name(args.mount)
+    entries = [(0, 0, FS_DIRECTORY, 0, 0)]
+    data = bytearray()
+    blobs = {}
+
+    # Preorder, so every parent precedes its children
+    pending = [(args.source, 0)]
+    while pending:
+        path, parent = pending.pop()
+        for item in sorted(os.listdir(path), reverse=True):
+            full = os.path.join(path, item)
+            if len(item.encode()) >= MAX_FILENAME:
+                print(f"skipping {full}: name longer than {MAX_FILENAME - 1} bytes", file=sys.stderr)
+                continue
+            if os.path.isdir(full) and not os.path.islink(full):
+                entries.append((parent, name(item), FS_DIRECTORY, 0, 0))
+                pending.append((full, len(entries) - 1))
+            elif os.path.isfile(full):
+                with open(full, "rb") as f:
+                    content = f.read()
+                if len(content) >= 1 << 32:
+                    print(f"skipping {full}: larger than 4 GB", file=sys.stderr)
+                    continue
+                block = blobs.get(content)
+                if block is None:
+                    block = blobs[content] = len(data) // BLOCK
+                    data.extend(content)
+                    data.extend(bytes(align(len(data), BLOCK) - len(data)))
+                entries.append((parent, name(item), FS_FILE, len(content), block))
+
+    entries_offset = HEADER.size
+    names_offset = entries_offset + len(entries) * ENTRY.size
+    data_offset = align(names_offset + len(names), BLOCK)
+    header = HEADER.pack(MAGIC, VERSION, len(entries), entries_offset, names_offset,
+                         len(names), data_offset, len(data) // BLOCK, 0)
+    with open(args.output, "wb") as out:
+        out.write(header)
+        for entry in entries:
+            out.write(ENTRY.pack(*entry))
+        out.write(names)
+        out.write(bytes(data_offset - names_offset - len(names)))
+        out.write(data)
+    files = sum(1 for e in entries if e[2] == FS_FILE)
+    print(f"{args.output}: {files} files, {len(entries) - 1 - files} directories, "
+          f"{len(data) // 1024} KB of data, mounted on {args.mount}")
+
+
+if __name__ == "__main__":
+    main()
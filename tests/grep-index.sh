@@ -0,0 +1,42 @@
+#!/bin/sh
+# grep -r must print the same matches with the trigram index off and on.
+# Usage: tests/grep-index.sh [./hybridos-hosted]
+bin=${1:-./hybridos-hosted}
+
+patterns='a{2,10}
+a{100}
+[\]z]zz
+[]z]zz
+x[^]]y
+ab{2}c
+(ab)+c
+\.txt
+zebra'
+
+script() {
+    echo 'cd tmp'
+    echo 'echo aa > two.txt'
+    echo 'echo aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa > many.txt'
+    echo 'echo ]zz > bracket.txt'
+    echo 'echo x-y abbc ababc name.txt zebra > misc.txt'
+    echo 'index off'
+    echo "$patterns" | while read -r p; do echo "grep -r \"$p\" ."; done
+    echo 'echo ----'
+    echo 'index on'
+    echo "$patterns" | while read -r p; do echo "grep -r \"$p\" ."; done
+}
+
+out=$(script | "$bin" | sed -n '/HybridOS> index off/,$p' | grep -v '^Trigram index\|^Memory:\|^Last indexed\|HybridOS> index\|HybridOS> echo\|HybridOS> *$')
+off=$(echo "$out" | sed '/^----$/,$d')
+on=$(echo "$out" | sed '1,/^----$/d')
+if [ "$off" != "$on" ]; then
+    echo "grep-index: index on and off disagree"
+    printf '%s\n' "$off" > /tmp/grep-index.off
+    printf '%s\n' "$on" > /tmp/grep-index.on
+    diff /tmp/grep-index.off /tmp/grep-index.on
+    exit 1
+fi
+for f in two.txt many.txt bracket.txt misc.txt; do
+    echo "$off" | grep -q "/tmp/$f:" || { echo "grep-index: no match in $f"; exit 1; }
+done
+echo "grep-index: ok"
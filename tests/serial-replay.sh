@@ -0,0 +1,30 @@
+#!/bin/sh
+# Keys piped in while a replay is running wait in the UART, none are lost.
+# Usage: tests/serial-replay.sh [./hybridos-hosted]
+bin=${1:-./hybridos-hosted}
+n=300
+
+script() {
+    echo 'input record /tmp/replay.keys'
+    for i in 1 2 3 4 5; do echo "echo replayed$i"; sleep 0.1; done   # a replay that lasts
+    echo 'input stop'
+    echo 'input replay /tmp/replay.keys'
+    i=1
+    while [ $i -le $n ]; do echo "echo piped$i"; i=$((i + 1)); done
+    echo 'serial'
+}
+
+out=$(script | "$bin")
+got=$(echo "$out" | grep -c '^piped[0-9]*$')
+if [ "$got" -ne $n ]; then
+    echo "serial-replay: $got of $n piped lines ran"
+    exit 1
+fi
+if echo "$out" | grep -q 'Command not found'; then
+    echo "serial-replay: keys were lost"
+    echo "$out" | grep 'Command not found' | head -5
+    exit 1
+fi
+echo "$out" | grep -q 'dropped 0$' || { echo "serial-replay: the receive ring dropped bytes"; exit 1; }
+[ "$(echo "$out" | grep -c '^replayed[0-9]$')" -ge 10 ] || { echo "serial-replay: the replay did not run"; exit 1; }
+echo "serial-replay: ok"